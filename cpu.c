@@ -19,14 +19,17 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "readbatch.h"
 #include "scrape.h"
 #include "util.h"
 
 // limits for CPU numbers
 #define MAX_CPU_ID 9999999
 #define MAX_CPU_DIGITS 7
-// size of input buffer for reading lines
-#define BUF_SIZE 256
+// size of input buffer for reading frequencies
+#define FREQ_SIZE 32
+// number of CPUs to probe for frequency data at once, when it's not known how many there are
+#define FREQ_PROBE 8
 
 static void *cpu_init(int argc, char *argv[]);
 static void cpu_collect(scrape_req *req, void *ctx_ptr);
@@ -39,6 +42,10 @@ const struct collector cpu_collector = {
 
 struct cpu_context {
   long clock_tick;
+  pfile *stat;
+  readbatch *batch;
+  // number of CPUs with frequency data found on the previous scrape
+  int freq_cpus;
 };
 
 void *cpu_init(int argc, char *argv[]) {
@@ -54,9 +61,17 @@ void *cpu_init(int argc, char *argv[]) {
   if (!ctx)
     return 0;
   ctx->clock_tick = clock_tick;
+  ctx->stat = pfile_open(PATH("/proc/stat"));
+  ctx->batch = readbatch_alloc();
+  ctx->freq_cpus = 0;
   return ctx;
 }
 
+static const struct metric_meta seconds_meta = METRIC_META(
+    "node_cpu_seconds_total", "counter", "Seconds the CPUs spent in each mode.");
+static const struct metric_meta freq_meta = METRIC_META(
+    "node_cpu_frequency_hertz", "gauge", "Current CPU thread frequency in hertz.");
+
 void cpu_collect(scrape_req *req, void *ctx_ptr) {
   struct cpu_context *ctx = ctx_ptr;
 
@@ -78,72 +93,88 @@ void cpu_collect(scrape_req *req, void *ctx_ptr) {
     LABEL_END,
   };
 
-  char buf[BUF_SIZE];
-
-  FILE *f;
+  bool meta_written = false;
 
   // collect node_cpu_seconds_total metrics from /proc/stat
 
-  f = fopen(PATH("/proc/stat"), "r");
-  if (f) {
-    while (fgets_line(buf, sizeof buf, f)) {
-      if (strncmp(buf, "cpu", 3) != 0 || (buf[3] < '0' || buf[3] > '9'))
+  const char *const *stat = scrape_read_lines(req, ctx->stat);
+  if (stat) {
+    for (const char *const *line = stat; *line; line++) {
+      if (strncmp(*line, "cpu", 3) != 0 || ((*line)[3] < '0' || (*line)[3] > '9'))
         continue;
 
-      char *at = buf + 3;
-      char *sep = strchr(at, ' ');
-      if (!sep || sep - at + 1 > (ptrdiff_t) sizeof cpu_label)
+      const char *at = *line + 3;
+      size_t id_len = strcspn(at, " ");
+      if (at[id_len] != ' ' || id_len + 1 > sizeof cpu_label)
         continue;
-      *sep = '\0';
-      strcpy(cpu_label, at);
+      memcpy(cpu_label, at, id_len);
+      cpu_label[id_len] = '\0';
 
-      at = sep + 1;
+      at += id_len;
       for (char **mode = modes; *mode; mode++) {
         while (*at == ' ')
           at++;
-        sep = strpbrk(at, " \n");
-        if (!sep)
+        if (*at == '\0')
           break;
-        *sep = '\0';
 
-        char *endptr;
-        double value = strtod(at, &endptr);
-        if (*endptr != '\0')
+        uint64_t ticks;
+        const char *end = parse_u64(at, &ticks);
+        if (!end || (*end != ' ' && *end != '\0'))
           break;
-        value /= ctx->clock_tick;
+        double value = (double) ticks / ctx->clock_tick;
 
+        if (!meta_written) {
+          scrape_write_meta(req, &seconds_meta);
+          meta_written = true;
+        }
         stat_labels[1].value = *mode;
-        scrape_write(req, "node_cpu_seconds_total", stat_labels, value);
+        scrape_write(req, seconds_meta.name, stat_labels, value);
 
-        at = sep + 1;
+        at = end;
       }
     }
-    fclose(f);
   }
 
-  // collect node_cpu_frequency_hertz metrics from /sys/devices/system/cpu/cpu*/cpufreq
+  // collect node_cpu_frequency_hertz metrics from /sys/devices/system/cpu/cpu*/cpufreq, reading
+  // the files of as many CPUs at once as were found last time (plus one, to notice new ones)
 
-  for (int cpu = 0; cpu <= MAX_CPU_ID; cpu++) {
 #define PATH_FORMAT PATH("/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq")
-    char path[sizeof PATH_FORMAT - 2 + MAX_CPU_DIGITS + 1];
-    snprintf(path, sizeof path, PATH_FORMAT, cpu);
-
-    f = fopen(path, "r");
-    if (!f)
-      break;
-
-    if (fgets(buf, sizeof buf, f)) {
-      char *endptr;
-      double value = strtod(buf, &endptr);
-      if (*endptr == '\0' || *endptr == '\n') {
-        value *= 1000;
-        snprintf(cpu_label, sizeof cpu_label, "%d", cpu);
-        scrape_write(req, "node_cpu_frequency_hertz", freq_labels, value);
+  char paths[READBATCH_MAX][sizeof PATH_FORMAT - 2 + MAX_CPU_DIGITS + 1];
+  char freqs[READBATCH_MAX][FREQ_SIZE];
+
+  meta_written = false;
+  int cpu = 0;
+  while (cpu <= MAX_CPU_ID) {
+    int count = ctx->freq_cpus > cpu ? ctx->freq_cpus - cpu + 1 : FREQ_PROBE;
+    if (count > READBATCH_MAX)
+      count = READBATCH_MAX;
+    if (count > MAX_CPU_ID - cpu + 1)
+      count = MAX_CPU_ID - cpu + 1;
+
+    for (int i = 0; i < count; i++) {
+      snprintf(paths[i], sizeof paths[i], PATH_FORMAT, cpu + i);
+      readbatch_add(ctx->batch, paths[i], freqs[i], sizeof freqs[i]);
+    }
+    readbatch_run(ctx->batch);
+
+    int i;
+    for (i = 0; i < count && readbatch_len(ctx->batch, i) >= 0; i++) {
+      uint64_t khz;
+      char *end = parse_u64(freqs[i], &khz);
+      if (end && (*end == '\0' || *end == '\n')) {
+        if (!meta_written) {
+          scrape_write_meta(req, &freq_meta);
+          meta_written = true;
+        }
+        snprintf(cpu_label, sizeof cpu_label, "%d", cpu + i);
+        scrape_write_u64(req, freq_meta.name, freq_labels, khz * 1000);
       }
     }
-
-    fclose(f);
+    cpu += i;
+    if (i < count)
+      break;  // no more CPUs
   }
+  ctx->freq_cpus = cpu;
 }
 
 #ifdef NANO_EXPORTER_TEST
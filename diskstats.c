@@ -23,9 +23,6 @@
 #include "scrape.h"
 #include "util.h"
 
-// size of input buffer for paths and lines
-#define BUF_SIZE 256
-
 // assumed constant size of disk sector in /proc/diskstats
 #define SECTOR_SIZE 512
 
@@ -39,10 +36,44 @@ const struct collector diskstats_collector = {
   .has_args = true,
 };
 
+static const struct {
+  struct metric_meta meta;
+  // scaling of the value: multiplied by mult, or converted from milliseconds to seconds
+  uint64_t mult;
+  bool millis;
+} columns[] = {
+  { .meta = METRIC_META("node_disk_reads_completed_total", "counter", "The total number of reads completed successfully."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_reads_merged_total", "counter", "The total number of reads merged."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_read_bytes_total", "counter", "The total number of bytes read successfully."), .mult = SECTOR_SIZE },
+  { .meta = METRIC_META("node_disk_read_time_seconds_total", "counter", "The total number of seconds spent by all reads."), .millis = true },
+  { .meta = METRIC_META("node_disk_writes_completed_total", "counter", "The total number of writes completed successfully."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_writes_merged_total", "counter", "The number of writes merged."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_written_bytes_total", "counter", "The total number of bytes written successfully."), .mult = SECTOR_SIZE },
+  { .meta = METRIC_META("node_disk_write_time_seconds_total", "counter", "The total number of seconds spent by all writes."), .millis = true },
+  { .meta = METRIC_META("node_disk_io_now", "gauge", "The number of I/Os currently in progress."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_io_time_seconds_total", "counter", "Total seconds spent doing I/Os."), .millis = true },
+  { .meta = METRIC_META("node_disk_io_time_weighted_seconds_total", "counter", "The weighted number of seconds spent doing I/Os."), .millis = true },
+  { .meta = METRIC_META("node_disk_discards_completed_total", "counter", "The total number of discards completed successfully."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_discards_merged_total", "counter", "The total number of discards merged."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_discarded_sectors_total", "counter", "The total number of sectors discarded successfully."), .mult = 1 },
+  { .meta = METRIC_META("node_disk_discard_time_seconds_total", "counter", "The total number of seconds spent by all discards."), .millis = true },
+};
+#define NCOLUMNS (sizeof columns / sizeof *columns)
+
+/** Values read for a device, kept until all the devices have been read. */
+struct diskstats_device {
+  char *name;
+  uint64_t values[NCOLUMNS];
+  // bit mask of the columns that held a valid number
+  uint32_t valid;
+  size_t ncolumns;
+};
+
 struct diskstats_context {
-  struct slist *include;
-  struct slist *exclude;
+  matcher *include;
+  matcher *exclude;
   bool filter_unused;
+  pfile *diskstats;
 };
 
 static void *diskstats_init(int argc, char *argv[]) {
@@ -51,12 +82,13 @@ static void *diskstats_init(int argc, char *argv[]) {
   ctx->include = 0;
   ctx->exclude = 0;
   ctx->filter_unused = true;
+  ctx->diskstats = pfile_open(PATH("/proc/diskstats"));
 
   for (int arg = 0; arg < argc; arg++) {
     if (strncmp(argv[arg], "include=", 8) == 0) {
-      ctx->include = slist_split(&argv[arg][8], ",");
+      ctx->include = matcher_split(&argv[arg][8], ",");
     } else if (strncmp(argv[arg], "exclude=", 8) == 0) {
-      ctx->exclude = slist_split(&argv[arg][8], ",");
+      ctx->exclude = matcher_split(&argv[arg][8], ",");
     } else if (strcmp(argv[arg], "keep-unused") == 0) {
       ctx->filter_unused = false;
     } else {
@@ -68,28 +100,6 @@ static void *diskstats_init(int argc, char *argv[]) {
   return ctx;
 }
 
-static const struct {
-  const char *metric;
-  double factor;
-} columns[] = {
-  { .metric = "node_disk_reads_completed_total", .factor = 1.0 },
-  { .metric = "node_disk_reads_merged_total", .factor = 1.0 },
-  { .metric = "node_disk_read_bytes_total", .factor = SECTOR_SIZE },
-  { .metric = "node_disk_read_time_seconds_total", .factor = 0.001 },
-  { .metric = "node_disk_writes_completed_total", .factor = 1.0 },
-  { .metric = "node_disk_writes_merged_total", .factor = 1.0 },
-  { .metric = "node_disk_written_bytes_total", .factor = SECTOR_SIZE },
-  { .metric = "node_disk_write_time_seconds_total", .factor = 0.001 },
-  { .metric = "node_disk_io_now", .factor = 1.0 },
-  { .metric = "node_disk_io_time_seconds_total", .factor = 0.001 },
-  { .metric = "node_disk_io_time_weighted_seconds_total", .factor = 0.001 },
-  { .metric = "node_disk_discards_completed_total", .factor = 1.0 },
-  { .metric = "node_disk_discards_merged_total", .factor = 1.0 },
-  { .metric = "node_disk_discarded_sectors_total", .factor = 1.0 },
-  { .metric = "node_disk_discard_time_seconds_total", .factor = 0.001 },
-};
-#define NCOLUMNS (sizeof columns / sizeof *columns)
-
 static void diskstats_collect(scrape_req *req, void *ctx_ptr) {
   struct diskstats_context *ctx = ctx_ptr;
 
@@ -100,61 +110,75 @@ static void diskstats_collect(scrape_req *req, void *ctx_ptr) {
     LABEL_END,
   };
 
-  char buf[BUF_SIZE];
-
-  FILE *f;
+  arena *scratch = scrape_arena(req);
 
-  // emit metrics for all known columns of /proc/diskstats for included devices
+  // read the known columns of /proc/diskstats for included devices
 
-  f = fopen(PATH("/proc/diskstats"), "r");
-  if (!f)
+  char *data = pfile_read(ctx->diskstats, scratch, 0);
+  if (!data)
     return;
 
-  while (fgets_line(buf, sizeof buf, f)) {
-    char *p;
+  struct diskstats_device *devices = arena_get(scratch, line_count(data) * sizeof *devices);
+  unsigned ndevices = 0;
 
-    // skip first two columns (device node numbers)
+  for (char *pos = data, *line; (line = next_line(&pos)); ) {
+    // split into device node numbers, device name and the known columns
 
-    strtok_r(buf, " ", &p);
-    strtok_r(0, " ", &p);
-
-    // extract device name
-
-    char *dev = strtok_r(0, " ", &p);
-    if (!dev || *dev == '\0')
+    char *fields[3 + NCOLUMNS];
+    size_t nfields = split_fields(line, fields, sizeof fields / sizeof *fields);
+    if (nfields < 3)
       continue;
-    labels[0].value = dev;
+    char *dev = fields[2];
+    char **values = fields + 3;
+    size_t nvalues = nfields - 3;
 
     // filter
 
     if (ctx->include) {
-      if (!slist_matches(ctx->include, dev))
+      if (!matcher_matches(ctx->include, dev))
         continue;
     } else if (ctx->exclude) {
-      if (slist_matches(ctx->exclude, dev))
+      if (matcher_matches(ctx->exclude, dev))
         continue;
     }
     if (ctx->filter_unused) {
-      char *tail = dev + strlen(dev) + 1;
-      if (tail < buf + sizeof buf && strspn(tail, " 0\n") == strlen(tail))
-        continue;  // only spaces, zeros and newlines: unused device
+      size_t v = 0;
+      while (v < nvalues && strspn(values[v], "0") == strlen(values[v]))
+        v++;
+      if (v == nvalues)
+        continue;  // only zeros: unused device
     }
 
-    // emit metrics while known columns last
+    struct diskstats_device *d = &devices[ndevices++];
+    d->name = dev;
 
-    for (size_t c = 0; c < NCOLUMNS; c++) {
-      char *v = strtok_r(0, " \n", &p);
-      if (!v || *v == '\0')
-        break;
+    // parse values of the known columns
 
-      char *end;
-      double d = strtod(v, &end);
-      if (*end != '\0')
-        continue;
-
-      scrape_write(req, columns[c].metric, labels, d * columns[c].factor);
+    d->valid = 0;
+    for (d->ncolumns = 0; d->ncolumns < nvalues; d->ncolumns++) {
+      char *end = parse_u64(values[d->ncolumns], &d->values[d->ncolumns]);
+      if (end && *end == '\0')
+        d->valid |= (uint32_t) 1 << d->ncolumns;
     }
   }
 
-  fclose(f);
+  // emit metrics one column at a time, so that each metric family is written together
+
+  for (size_t c = 0; c < NCOLUMNS; c++) {
+    bool meta_written = false;
+    for (unsigned i = 0; i < ndevices; i++) {
+      struct diskstats_device *d = &devices[i];
+      if (!(d->valid & (uint32_t) 1 << c))
+        continue;
+      if (!meta_written) {
+        scrape_write_meta(req, &columns[c].meta);
+        meta_written = true;
+      }
+      labels[0].value = d->name;
+      if (columns[c].millis)
+        scrape_write(req, columns[c].meta.name, labels, d->values[c] / 1000.0);
+      else
+        scrape_write_u64(req, columns[c].meta.name, labels, d->values[c] * columns[c].mult);
+    }
+  }
 }
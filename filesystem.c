@@ -22,9 +22,6 @@
 #include "scrape.h"
 #include "util.h"
 
-// size of input buffer for paths and lines
-#define BUF_SIZE 256
-
 static void *filesystem_init(int argc, char *argv[]);
 static void filesystem_collect(scrape_req *req, void *ctx);
 
@@ -35,14 +32,42 @@ const struct collector filesystem_collector = {
   .has_args = true,
 };
 
+enum {
+  fs_avail_bytes,
+  fs_files,
+  fs_files_free,
+  fs_free_bytes,
+  fs_readonly,
+  fs_size_bytes,
+  max_fs_metric,
+};
+
+static const struct metric_meta fs_metas[max_fs_metric] = {
+  [fs_avail_bytes] = METRIC_META("node_filesystem_avail_bytes", "gauge", "Filesystem space available to non-root users in bytes."),
+  [fs_files] = METRIC_META("node_filesystem_files", "gauge", "Filesystem total file nodes."),
+  [fs_files_free] = METRIC_META("node_filesystem_files_free", "gauge", "Filesystem total free file nodes."),
+  [fs_free_bytes] = METRIC_META("node_filesystem_free_bytes", "gauge", "Filesystem free space in bytes."),
+  [fs_readonly] = METRIC_META("node_filesystem_readonly", "gauge", "Filesystem read-only status."),
+  [fs_size_bytes] = METRIC_META("node_filesystem_size_bytes", "gauge", "Filesystem size in bytes."),
+};
+
+/** Values read for a mount, kept until all the mounts have been read. */
+struct filesystem_mount {
+  char *dev;
+  char *fstype;
+  char *mount;
+  double values[max_fs_metric];
+};
+
 struct filesystem_context {
-  struct slist *include_device;
-  struct slist *exclude_device;
-  struct slist *include_mount;
-  struct slist *exclude_mount;
-  struct slist *include_type;
-  struct slist *exclude_type;
+  matcher *include_device;
+  matcher *exclude_device;
+  matcher *include_mount;
+  matcher *exclude_mount;
+  matcher *include_type;
+  matcher *exclude_type;
   int (*statvfs_func)(const char *path, struct statvfs *buf);
+  pfile *mounts;
 };
 
 static void *filesystem_init(int argc, char *argv[]) {
@@ -57,17 +82,17 @@ static void *filesystem_init(int argc, char *argv[]) {
 
   for (int arg = 0; arg < argc; arg++) {
     if (strncmp(argv[arg], "include-device=", 15) == 0) {
-      ctx->include_device = slist_split(&argv[arg][15], ",");
+      ctx->include_device = matcher_split(&argv[arg][15], ",");
     } else if (strncmp(argv[arg], "exclude-device=", 15) == 0) {
-      ctx->exclude_device = slist_split(&argv[arg][15], ",");
+      ctx->exclude_device = matcher_split(&argv[arg][15], ",");
     } else if (strncmp(argv[arg], "include-mount=", 14) == 0) {
-      ctx->include_mount = slist_split(&argv[arg][14], ",");
+      ctx->include_mount = matcher_split(&argv[arg][14], ",");
     } else if (strncmp(argv[arg], "exclude-mount=", 14) == 0) {
-      ctx->exclude_mount = slist_split(&argv[arg][14], ",");
+      ctx->exclude_mount = matcher_split(&argv[arg][14], ",");
     } else if (strncmp(argv[arg], "include-type=", 13) == 0) {
-      ctx->include_type = slist_split(&argv[arg][13], ",");
+      ctx->include_type = matcher_split(&argv[arg][13], ",");
     } else if (strncmp(argv[arg], "exclude-type=", 13) == 0) {
-      ctx->exclude_type = slist_split(&argv[arg][13], ",");
+      ctx->exclude_type = matcher_split(&argv[arg][13], ",");
     } else {
       fprintf(stderr, "unknown argument for filesystem collector: %s", argv[arg]);
       return 0;
@@ -75,6 +100,7 @@ static void *filesystem_init(int argc, char *argv[]) {
   }
 
   ctx->statvfs_func = statvfs;
+  ctx->mounts = pfile_open(PATH("/proc/mounts"));
   return ctx;
 }
 
@@ -89,74 +115,86 @@ static void filesystem_collect(scrape_req *req, void *ctx_ptr) {
     { .key = "mountpoint", .value = 0 },
     LABEL_END,
   };
-  char **dev = &labels[0].value;
-  char **fstype = &labels[1].value;
-  char **mount = &labels[2].value;
 
-  char buf[BUF_SIZE];
-
-  FILE *f;
   struct statvfs fs;
 
+  arena *scratch = scrape_arena(req);
+
   // loop over /proc/mounts to get visible mounts
 
-  f = fopen(PATH("/proc/mounts"), "r");
-  if (!f)
+  char *data = pfile_read(ctx->mounts, scratch, 0);
+  if (!data)
     return;
 
-  while (fgets_line(buf, sizeof buf, f)) {
+  struct filesystem_mount *mounts = arena_get(scratch, line_count(data) * sizeof *mounts);
+  unsigned nmounts = 0;
+
+  for (char *pos = data, *line; (line = next_line(&pos)); ) {
     // extract device, mountpoint and filesystem type
 
-    char *p;
-    *dev = strtok_r(buf, " ", &p);
-    if (!*dev)
-      continue;
-    *mount = strtok_r(0, " ", &p);
-    if (!*mount)
-      continue;
-    *fstype = strtok_r(0, " ", &p);
-    if (!*fstype)
+    char *fields[3];
+    if (split_fields(line, fields, 3) < 3)
       continue;
+    char *dev = fields[0];
+    char *mount = fields[1];
+    char *fstype = fields[2];
 
     if (ctx->include_device) {
-      if (!slist_matches(ctx->include_device, *dev))
+      if (!matcher_matches(ctx->include_device, dev))
         continue;
     } else {
-      if (**dev != '/')
+      if (*dev != '/')
         continue;
-      if (ctx->exclude_device && slist_matches(ctx->exclude_device, *dev))
+      if (ctx->exclude_device && matcher_matches(ctx->exclude_device, dev))
         continue;
     }
     if (ctx->include_mount) {
-      if (!slist_matches(ctx->include_mount, *mount))
+      if (!matcher_matches(ctx->include_mount, mount))
         continue;
     } else if (ctx->exclude_mount) {
-      if (slist_matches(ctx->exclude_mount, *mount))
+      if (matcher_matches(ctx->exclude_mount, mount))
         continue;
     }
     if (ctx->include_type) {
-      if (!slist_matches(ctx->include_type, *fstype))
+      if (!matcher_matches(ctx->include_type, fstype))
         continue;
     } else if (ctx->exclude_type) {
-      if (slist_matches(ctx->exclude_type, *fstype))
+      if (matcher_matches(ctx->exclude_type, fstype))
         continue;
     }
 
-    // report metrics from statfs
+    // read metrics from statfs
 
-    if (ctx->statvfs_func(*mount, &fs) != 0)
+    if (ctx->statvfs_func(mount, &fs) != 0)
       continue;
 
+    struct filesystem_mount *m = &mounts[nmounts++];
+    m->dev = dev;
+    m->fstype = fstype;
+    m->mount = mount;
+
     double bs = fs.f_frsize;
-    scrape_write(req, "node_filesystem_avail_bytes", labels, fs.f_bavail * bs);
-    scrape_write(req, "node_filesystem_files", labels, fs.f_files);
-    scrape_write(req, "node_filesystem_files_free", labels, fs.f_ffree);
-    scrape_write(req, "node_filesystem_free_bytes", labels, fs.f_bfree * bs);
-    scrape_write(req, "node_filesystem_readonly", labels, fs.f_flag & ST_RDONLY ? 1.0 : 0.0);
-    scrape_write(req, "node_filesystem_size_bytes", labels, fs.f_blocks * bs);
+    m->values[fs_avail_bytes] = fs.f_bavail * bs;
+    m->values[fs_files] = fs.f_files;
+    m->values[fs_files_free] = fs.f_ffree;
+    m->values[fs_free_bytes] = fs.f_bfree * bs;
+    m->values[fs_readonly] = fs.f_flag & ST_RDONLY ? 1.0 : 0.0;
+    m->values[fs_size_bytes] = fs.f_blocks * bs;
   }
 
-  fclose(f);
+  // emit metrics one family at a time, so that each is written together with its metadata
+
+  if (nmounts == 0)
+    return;
+  for (unsigned f = 0; f < max_fs_metric; f++) {
+    scrape_write_meta(req, &fs_metas[f]);
+    for (unsigned i = 0; i < nmounts; i++) {
+      labels[0].value = mounts[i].dev;
+      labels[1].value = mounts[i].fstype;
+      labels[2].value = mounts[i].mount;
+      scrape_write(req, fs_metas[f].name, labels, mounts[i].values[f]);
+    }
+  }
 }
 
 #ifdef NANO_EXPORTER_TEST
@@ -0,0 +1,620 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gzip.h"
+#include "util.h"
+
+// This is a compact DEFLATE (RFC 1951) encoder, modeled after the "slow" (lazy matching) strategy
+// of zlib: LZ77 matches are found using hash chains over a 32k sliding window, and the resulting
+// symbols are emitted in blocks using either the fixed or a dynamic Huffman code, whichever is
+// smaller. Stored blocks are never used, since metrics text always compresses.
+
+// LZ77 parameters
+#define WSIZE 32768
+#define WMASK (WSIZE - 1)
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MIN_LOOKAHEAD (MAX_MATCH + MIN_MATCH + 1)
+#define MAX_DIST (WSIZE - MIN_LOOKAHEAD)
+// matches of length 3 are discarded if they are farther than this
+#define TOO_FAR 4096
+
+// Huffman coding parameters
+#define SYM_MAX 16384
+#define L_CODES 286
+#define D_CODES 30
+#define BL_CODES 19
+#define MAX_BITS 15
+#define MAX_BL_BITS 7
+#define END_BLOCK 256
+
+struct gzip_stream {
+  // compression parameters
+  unsigned good_length;
+  unsigned max_lazy;
+  unsigned nice_length;
+  unsigned max_chain;
+  // sliding window and hash chains; a position of 0 marks the end of a chain
+  uint8_t window[2 * WSIZE];
+  uint16_t head[HASH_SIZE];
+  uint16_t prev[WSIZE];
+  // LZ77 state
+  unsigned strstart;
+  unsigned lookahead;
+  unsigned match_start;
+  unsigned match_length;
+  unsigned prev_match;
+  unsigned prev_length;
+  bool match_available;
+  // symbols of the current block: literals have dist 0, matches store the length minus MIN_MATCH
+  uint8_t sym_lit[SYM_MAX];
+  uint16_t sym_dist[SYM_MAX];
+  unsigned sym_count;
+  // bit output buffer
+  uint64_t bits;
+  unsigned nbits;
+  // gzip trailer data
+  uint32_t crc;
+  uint32_t size;
+};
+
+static const struct {
+  unsigned short good_length, max_lazy, nice_length, max_chain;
+} levels[10] = {
+  [1] = { 4, 4, 8, 4 },
+  [2] = { 4, 5, 16, 8 },
+  [3] = { 4, 6, 32, 32 },
+  [4] = { 4, 4, 16, 16 },
+  [5] = { 8, 16, 32, 32 },
+  [6] = { 8, 16, 128, 128 },
+  [7] = { 8, 32, 128, 256 },
+  [8] = { 32, 128, 258, 1024 },
+  [9] = { 32, 258, 258, 4096 },
+};
+
+static const uint16_t len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[D_CODES] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t dist_extra[D_CODES] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+static const uint8_t bl_order[BL_CODES] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+static const uint8_t bl_extra[BL_CODES] = {
+  [16] = 2, [17] = 3, [18] = 7,
+};
+
+// tables computed by gzip_init_tables, exactly once, as compressors may be allocated concurrently
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint8_t len_sym[MAX_MATCH - MIN_MATCH + 1];
+static uint8_t dist_sym[512];
+static uint8_t fixed_lit_len[L_CODES + 2];
+static uint16_t fixed_lit_code[L_CODES + 2];
+static uint8_t fixed_dist_len[D_CODES];
+static uint16_t fixed_dist_code[D_CODES];
+static uint32_t crc_table[256];
+
+static void huff_codes(const uint8_t *len, unsigned n, uint16_t *code);
+
+static void gzip_init_tables(void) {
+  for (unsigned c = 0; c < 29; c++)
+    for (unsigned l = len_base[c]; l < len_base[c] + (1u << len_extra[c]) && l <= MAX_MATCH; l++)
+      len_sym[l - MIN_MATCH] = c;
+  for (unsigned c = 0; c < D_CODES; c++) {
+    for (unsigned d = dist_base[c] - 1; d < dist_base[c] - 1 + (1u << dist_extra[c]); d++) {
+      if (d < 256)
+        dist_sym[d] = c;
+      else
+        dist_sym[256 + (d >> 7)] = c;
+    }
+  }
+
+  for (unsigned i = 0; i < L_CODES + 2; i++)
+    fixed_lit_len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  huff_codes(fixed_lit_len, L_CODES + 2, fixed_lit_code);
+  for (unsigned i = 0; i < D_CODES; i++)
+    fixed_dist_len[i] = 5;
+  huff_codes(fixed_dist_len, D_CODES, fixed_dist_code);
+
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static unsigned d_code(unsigned dist) {
+  dist--;
+  return dist < 256 ? dist_sym[dist] : dist_sym[256 + (dist >> 7)];
+}
+
+// Huffman code construction
+
+/** Computes Huffman code lengths for \p n symbols, returning the longest length. */
+static unsigned huff_build(const uint32_t *freq, unsigned n, unsigned *depth_out) {
+  unsigned leaves[L_CODES], nleaves = 0;
+  uint32_t weight[2 * L_CODES];
+  unsigned parent[2 * L_CODES], depth[2 * L_CODES];
+
+  // sort the used symbols by increasing frequency
+
+  for (unsigned i = 0; i < n; i++) {
+    depth_out[i] = 0;
+    if (!freq[i])
+      continue;
+    unsigned j = nleaves++;
+    while (j > 0 && freq[leaves[j - 1]] > freq[i]) {
+      leaves[j] = leaves[j - 1];
+      j--;
+    }
+    leaves[j] = i;
+  }
+  for (unsigned i = 0; i < nleaves; i++)
+    weight[i] = freq[leaves[i]];
+
+  // combine the two lightest nodes until only the root is left; new internal nodes are created
+  // in order of increasing weight, so two queues (leaves and internal nodes) suffice
+
+  unsigned next_leaf = 0, next_node = nleaves, nnodes = nleaves;
+  while (nnodes < 2 * nleaves - 1) {
+    unsigned pick[2];
+    for (int k = 0; k < 2; k++) {
+      if (next_leaf < nleaves && (next_node >= nnodes || weight[next_leaf] <= weight[next_node]))
+        pick[k] = next_leaf++;
+      else
+        pick[k] = next_node++;
+    }
+    weight[nnodes] = weight[pick[0]] + weight[pick[1]];
+    parent[pick[0]] = parent[pick[1]] = nnodes;
+    nnodes++;
+  }
+
+  unsigned max_depth = 0;
+  depth[nnodes - 1] = 0;
+  for (unsigned i = nnodes - 1; i-- > 0; )
+    depth[i] = depth[parent[i]] + 1;
+  for (unsigned i = 0; i < nleaves; i++) {
+    depth_out[leaves[i]] = depth[i];
+    if (depth[i] > max_depth)
+      max_depth = depth[i];
+  }
+  return max_depth;
+}
+
+/** Computes Huffman code lengths limited to \p max_bits for \p n symbols. */
+static void huff_lengths(const uint32_t *freq_in, unsigned n, unsigned max_bits, uint8_t *len) {
+  uint32_t freq[L_CODES];
+  unsigned depth[L_CODES];
+  unsigned used = 0;
+
+  for (unsigned i = 0; i < n; i++) {
+    freq[i] = freq_in[i];
+    if (freq[i])
+      used++;
+  }
+  // the format requires at least one bit per code, so make sure there are at least two codes
+  for (unsigned i = 0; used < 2; i++) {
+    if (!freq[i]) {
+      freq[i] = 1;
+      used++;
+    }
+  }
+
+  // if the tree is too deep, flatten the frequency distribution until it's not
+  while (huff_build(freq, n, depth) > max_bits)
+    for (unsigned i = 0; i < n; i++)
+      if (freq[i])
+        freq[i] = (freq[i] >> 1) | 1;
+
+  for (unsigned i = 0; i < n; i++)
+    len[i] = depth[i];
+}
+
+/** Assigns canonical (bit-reversed, for LSB-first output) codes for the lengths in \p len. */
+static void huff_codes(const uint8_t *len, unsigned n, uint16_t *code) {
+  unsigned count[MAX_BITS + 1] = {0}, next[MAX_BITS + 1];
+
+  for (unsigned i = 0; i < n; i++)
+    count[len[i]]++;
+  count[0] = 0;
+  unsigned c = 0;
+  for (unsigned bits = 1; bits <= MAX_BITS; bits++) {
+    c = (c + count[bits - 1]) << 1;
+    next[bits] = c;
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    if (!len[i])
+      continue;
+    unsigned v = next[len[i]]++, r = 0;
+    for (unsigned b = 0; b < len[i]; b++, v >>= 1)
+      r = (r << 1) | (v & 1);
+    code[i] = r;
+  }
+}
+
+// bit output
+
+static void put_bits(gzip_stream *z, bbuf *out, uint32_t value, unsigned n) {
+  z->bits |= (uint64_t) value << z->nbits;
+  z->nbits += n;
+  if (z->nbits >= 32) {
+    uint8_t b[4] = { z->bits, z->bits >> 8, z->bits >> 16, z->bits >> 24 };
+    bbuf_put(out, b, 4);
+    z->bits >>= 32;
+    z->nbits -= 32;
+  }
+}
+
+static void put_align(gzip_stream *z, bbuf *out) {
+  while (z->nbits > 0) {
+    bbuf_putc(out, z->bits & 0xff);
+    z->bits >>= 8;
+    z->nbits = z->nbits > 8 ? z->nbits - 8 : 0;
+  }
+  z->bits = 0;
+}
+
+static void put_u32(bbuf *out, uint32_t v) {
+  uint8_t b[4] = { v, v >> 8, v >> 16, v >> 24 };
+  bbuf_put(out, b, 4);
+}
+
+// block output
+
+/** Run-length encodes the code lengths \p lens, returning the number of symbols in \p sym. */
+static unsigned rle_lengths(const uint8_t *lens, unsigned n, uint8_t *sym, uint8_t *extra) {
+  unsigned nsym = 0;
+
+  for (unsigned i = 0; i < n; ) {
+    uint8_t l = lens[i];
+    unsigned run = 1;
+    while (i + run < n && lens[i + run] == l)
+      run++;
+    i += run;
+
+    if (l == 0) {
+      while (run >= 11) {
+        unsigned r = run > 138 ? 138 : run;
+        sym[nsym] = 18; extra[nsym++] = r - 11;
+        run -= r;
+      }
+      if (run >= 3) {
+        sym[nsym] = 17; extra[nsym++] = run - 3;
+        run = 0;
+      }
+    } else {
+      sym[nsym] = l; extra[nsym++] = 0;
+      run--;
+      while (run >= 3) {
+        unsigned r = run > 6 ? 6 : run;
+        sym[nsym] = 16; extra[nsym++] = r - 3;
+        run -= r;
+      }
+    }
+    while (run > 0) {
+      sym[nsym] = l; extra[nsym++] = 0;
+      run--;
+    }
+  }
+
+  return nsym;
+}
+
+static void put_symbols(gzip_stream *z, bbuf *out, const uint8_t *lit_len, const uint16_t *lit_code, const uint8_t *dist_len, const uint16_t *dist_code) {
+  for (unsigned i = 0; i < z->sym_count; i++) {
+    unsigned lit = z->sym_lit[i], dist = z->sym_dist[i];
+    if (dist == 0) {
+      put_bits(z, out, lit_code[lit], lit_len[lit]);
+      continue;
+    }
+    unsigned lc = len_sym[lit];
+    put_bits(z, out, lit_code[257 + lc], lit_len[257 + lc]);
+    if (len_extra[lc])
+      put_bits(z, out, lit + MIN_MATCH - len_base[lc], len_extra[lc]);
+    unsigned dc = d_code(dist);
+    put_bits(z, out, dist_code[dc], dist_len[dc]);
+    if (dist_extra[dc])
+      put_bits(z, out, dist - dist_base[dc], dist_extra[dc]);
+  }
+  put_bits(z, out, lit_code[END_BLOCK], lit_len[END_BLOCK]);
+}
+
+static void emit_block(gzip_stream *z, bbuf *out, bool last) {
+  uint32_t lit_freq[L_CODES] = {0}, dist_freq[D_CODES] = {0};
+  uint8_t lit_len[L_CODES], dist_len[D_CODES];
+  uint16_t lit_code[L_CODES], dist_code[D_CODES];
+
+  for (unsigned i = 0; i < z->sym_count; i++) {
+    if (z->sym_dist[i] == 0) {
+      lit_freq[z->sym_lit[i]]++;
+    } else {
+      lit_freq[257 + len_sym[z->sym_lit[i]]]++;
+      dist_freq[d_code(z->sym_dist[i])]++;
+    }
+  }
+  lit_freq[END_BLOCK] = 1;
+
+  huff_lengths(lit_freq, L_CODES, MAX_BITS, lit_len);
+  huff_lengths(dist_freq, D_CODES, MAX_BITS, dist_len);
+
+  // encode the code lengths for the dynamic block header
+
+  unsigned hlit = L_CODES, hdist = D_CODES, hclen = BL_CODES;
+  while (hlit > 257 && lit_len[hlit - 1] == 0)
+    hlit--;
+  while (hdist > 1 && dist_len[hdist - 1] == 0)
+    hdist--;
+
+  uint8_t lens[L_CODES + D_CODES], rle_sym[L_CODES + D_CODES], rle_extra[L_CODES + D_CODES];
+  memcpy(lens, lit_len, hlit);
+  memcpy(lens + hlit, dist_len, hdist);
+  unsigned nrle = rle_lengths(lens, hlit + hdist, rle_sym, rle_extra);
+
+  uint32_t bl_freq[BL_CODES] = {0};
+  uint8_t bl_len[BL_CODES];
+  uint16_t bl_code[BL_CODES];
+  for (unsigned i = 0; i < nrle; i++)
+    bl_freq[rle_sym[i]]++;
+  huff_lengths(bl_freq, BL_CODES, MAX_BL_BITS, bl_len);
+  huff_codes(bl_len, BL_CODES, bl_code);
+  while (hclen > 4 && bl_len[bl_order[hclen - 1]] == 0)
+    hclen--;
+
+  // pick the smaller of the dynamic and fixed encodings (extra bits are the same for both)
+
+  uint64_t dynamic_bits = 5 + 5 + 4 + 3 * hclen, fixed_bits = 0;
+  for (unsigned i = 0; i < nrle; i++)
+    dynamic_bits += bl_len[rle_sym[i]] + bl_extra[rle_sym[i]];
+  for (unsigned i = 0; i < L_CODES; i++) {
+    dynamic_bits += (uint64_t) lit_freq[i] * lit_len[i];
+    fixed_bits += (uint64_t) lit_freq[i] * fixed_lit_len[i];
+  }
+  for (unsigned i = 0; i < D_CODES; i++) {
+    dynamic_bits += (uint64_t) dist_freq[i] * dist_len[i];
+    fixed_bits += (uint64_t) dist_freq[i] * fixed_dist_len[i];
+  }
+
+  if (fixed_bits <= dynamic_bits) {
+    put_bits(z, out, (last ? 1 : 0) | (1 << 1), 3);
+    put_symbols(z, out, fixed_lit_len, fixed_lit_code, fixed_dist_len, fixed_dist_code);
+  } else {
+    huff_codes(lit_len, L_CODES, lit_code);
+    huff_codes(dist_len, D_CODES, dist_code);
+    put_bits(z, out, (last ? 1 : 0) | (2 << 1), 3);
+    put_bits(z, out, hlit - 257, 5);
+    put_bits(z, out, hdist - 1, 5);
+    put_bits(z, out, hclen - 4, 4);
+    for (unsigned i = 0; i < hclen; i++)
+      put_bits(z, out, bl_len[bl_order[i]], 3);
+    for (unsigned i = 0; i < nrle; i++) {
+      put_bits(z, out, bl_code[rle_sym[i]], bl_len[rle_sym[i]]);
+      if (bl_extra[rle_sym[i]])
+        put_bits(z, out, rle_extra[i], bl_extra[rle_sym[i]]);
+    }
+    put_symbols(z, out, lit_len, lit_code, dist_len, dist_code);
+  }
+
+  z->sym_count = 0;
+}
+
+static void tally(gzip_stream *z, bbuf *out, unsigned lit, unsigned dist) {
+  z->sym_lit[z->sym_count] = lit;
+  z->sym_dist[z->sym_count] = dist;
+  if (++z->sym_count == SYM_MAX)
+    emit_block(z, out, false);
+}
+
+// LZ77 matching
+
+static unsigned insert_string(gzip_stream *z, unsigned pos) {
+  const uint8_t *p = z->window + pos;
+  uint32_t h = ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16) * 2654435761u;
+  h >>= 32 - HASH_BITS;
+  unsigned match = z->head[h];
+  z->prev[pos & WMASK] = match;
+  z->head[h] = pos;
+  return match;
+}
+
+static unsigned longest_match(gzip_stream *z, unsigned cur_match) {
+  unsigned chain = z->max_chain;
+  unsigned best_len = z->prev_length;
+  unsigned max_len = z->lookahead < MAX_MATCH ? z->lookahead : MAX_MATCH;
+  unsigned nice_len = z->nice_length < max_len ? z->nice_length : max_len;
+  unsigned limit = z->strstart > MAX_DIST ? z->strstart - MAX_DIST : 0;
+  const uint8_t *scan = z->window + z->strstart;
+
+  if (best_len >= max_len)
+    return max_len;
+  if (z->prev_length >= z->good_length)
+    chain >>= 2;
+
+  do {
+    const uint8_t *m = z->window + cur_match;
+    if (m[best_len] != scan[best_len] || m[0] != scan[0] || m[1] != scan[1])
+      continue;
+    unsigned len = 2;
+    while (len < max_len && m[len] == scan[len])
+      len++;
+    if (len > best_len) {
+      z->match_start = cur_match;
+      best_len = len;
+      if (len >= nice_len)
+        break;
+    }
+  } while ((cur_match = z->prev[cur_match & WMASK]) > limit && --chain != 0);
+
+  return best_len;
+}
+
+static void slide_window(gzip_stream *z) {
+  memmove(z->window, z->window + WSIZE, WSIZE);
+  z->match_start -= WSIZE;
+  z->strstart -= WSIZE;
+  for (unsigned i = 0; i < HASH_SIZE; i++)
+    z->head[i] = z->head[i] >= WSIZE ? z->head[i] - WSIZE : 0;
+  for (unsigned i = 0; i < WSIZE; i++)
+    z->prev[i] = z->prev[i] >= WSIZE ? z->prev[i] - WSIZE : 0;
+}
+
+static void compress(gzip_stream *z, bbuf *out, bool flush) {
+  while (true) {
+    if (z->lookahead < MIN_LOOKAHEAD && !flush)
+      return;  // wait for more input
+    if (z->lookahead == 0)
+      break;
+
+    unsigned hash_head = 0;
+    if (z->lookahead >= MIN_MATCH)
+      hash_head = insert_string(z, z->strstart);
+
+    // find the longest match, unless the previous one was already good enough
+
+    z->prev_length = z->match_length;
+    z->prev_match = z->match_start;
+    z->match_length = MIN_MATCH - 1;
+
+    if (hash_head != 0 && z->prev_length < z->max_lazy && z->strstart - hash_head < MAX_DIST) {
+      z->match_length = longest_match(z, hash_head);
+      if (z->match_length == MIN_MATCH && z->strstart - z->match_start > TOO_FAR)
+        z->match_length = MIN_MATCH - 1;
+    }
+
+    // emit the previous match if it's at least as good as the current one; otherwise defer
+
+    if (z->prev_length >= MIN_MATCH && z->match_length <= z->prev_length) {
+      unsigned max_insert = z->strstart + z->lookahead - MIN_MATCH;
+      tally(z, out, z->prev_length - MIN_MATCH, z->strstart - 1 - z->prev_match);
+      z->lookahead -= z->prev_length - 1;
+      for (unsigned n = z->prev_length - 2; n > 0; n--)
+        if (++z->strstart <= max_insert)
+          insert_string(z, z->strstart);
+      z->match_available = false;
+      z->match_length = MIN_MATCH - 1;
+      z->strstart++;
+    } else if (z->match_available) {
+      tally(z, out, z->window[z->strstart - 1], 0);
+      z->strstart++;
+      z->lookahead--;
+    } else {
+      z->match_available = true;
+      z->strstart++;
+      z->lookahead--;
+    }
+  }
+
+  if (z->match_available) {
+    tally(z, out, z->window[z->strstart - 1], 0);
+    z->match_available = false;
+  }
+}
+
+// public API
+
+gzip_stream *gzip_alloc(int level) {
+  pthread_once(&tables_once, gzip_init_tables);
+
+  if (level < 1)
+    level = 1;
+  else if (level > 9)
+    level = 9;
+
+  gzip_stream *z = must_malloc(sizeof *z);
+  z->good_length = levels[level].good_length;
+  z->max_lazy = levels[level].max_lazy;
+  z->nice_length = levels[level].nice_length;
+  z->max_chain = levels[level].max_chain;
+  return z;
+}
+
+void gzip_free(gzip_stream *z) {
+  free(z);
+}
+
+void gzip_start(gzip_stream *z, bbuf *out) {
+  memset(z->head, 0, sizeof z->head);
+  z->strstart = 0;
+  z->lookahead = 0;
+  z->match_start = 0;
+  z->match_length = z->prev_length = MIN_MATCH - 1;
+  z->match_available = false;
+  z->sym_count = 0;
+  z->bits = 0;
+  z->nbits = 0;
+  z->crc = 0xffffffffu;
+  z->size = 0;
+
+  // magic, CM = deflate, no flags, no mtime, no extra flags, OS = Unix
+  static const uint8_t header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+  bbuf_put(out, header, sizeof header);
+}
+
+void gzip_write(gzip_stream *z, const void *data_ptr, size_t len, bbuf *out) {
+  const uint8_t *data = data_ptr;
+
+  while (len > 0) {
+    if (z->strstart >= WSIZE + MAX_DIST)
+      slide_window(z);
+
+    size_t n = 2 * WSIZE - z->strstart - z->lookahead;
+    if (n > len)
+      n = len;
+
+    uint8_t *dst = z->window + z->strstart + z->lookahead;
+    memcpy(dst, data, n);
+    uint32_t crc = z->crc;
+    for (size_t i = 0; i < n; i++)
+      crc = crc_table[(crc ^ dst[i]) & 0xff] ^ (crc >> 8);
+    z->crc = crc;
+    z->size += n;
+    z->lookahead += n;
+    data += n;
+    len -= n;
+
+    compress(z, out, false);
+  }
+}
+
+void gzip_finish(gzip_stream *z, bbuf *out) {
+  compress(z, out, true);
+  emit_block(z, out, true);
+  put_align(z, out);
+  put_u32(out, z->crc ^ 0xffffffffu);
+  put_u32(out, z->size);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANO_EXPORTER_GZIP_H_
+#define NANO_EXPORTER_GZIP_H_ 1
+
+#include <stddef.h>
+
+#include "util.h"
+
+/** Opaque type for the state of a streaming gzip (RFC 1952) compressor. */
+typedef struct gzip_stream gzip_stream;
+
+/** Allocates a new compressor using compression \p level (1-9). */
+gzip_stream *gzip_alloc(int level);
+/** Frees all the storage associated with \p z. */
+void gzip_free(gzip_stream *z);
+
+/** Starts a new gzip member, writing its header to \p out. */
+void gzip_start(gzip_stream *z, bbuf *out);
+/**
+ * Compresses \p len bytes from \p data, appending any finished output to \p out.
+ *
+ * Some of the input may be held back in the compressor state until more data is written, or the
+ * stream is finished.
+ */
+void gzip_write(gzip_stream *z, const void *data, size_t len, bbuf *out);
+/** Compresses any remaining input, and writes the end of the gzip member to \p out. */
+void gzip_finish(gzip_stream *z, bbuf *out);
+
+#endif // NANO_EXPORTER_GZIP_H_
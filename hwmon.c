@@ -16,13 +16,13 @@
 
 #define _POSIX_C_SOURCE 200809L
 
-#include <dirent.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "readbatch.h"
 #include "scrape.h"
 #include "util.h"
 
@@ -30,26 +30,30 @@
 #define BUF_SIZE 256
 // size of input buffer for labels
 #define LABEL_SIZE 32
+// size of input buffer for sensor values
+#define VALUE_SIZE 32
 
+static void *hwmon_init(int argc, char *argv[]);
 static void hwmon_collect(scrape_req *req, void *ctx);
 
 const struct collector hwmon_collector = {
   .name = "hwmon",
   .collect = hwmon_collect,
+  .init = hwmon_init,
 };
 
 static double hwmon_conv_millis(const char *text) {
-  char *endptr;
-  double value = strtod(text, &endptr);
-  if (*endptr == '\n' || *endptr == '\0')
-    return value / 1000;
+  int64_t value;
+  char *end = parse_i64(text, &value);
+  if (end && (*end == '\n' || *end == '\0'))
+    return value / 1000.0;
   return NAN;
 }
 
 static double hwmon_conv_id(const char *text) {
-  char *endptr;
-  double value = strtod(text, &endptr);
-  if (*endptr == '\n' || *endptr == '\0')
+  uint64_t value;
+  char *end = parse_u64(text, &value);
+  if (end && (*end == '\n' || *end == '\0'))
     return value;
   return NAN;
 }
@@ -62,7 +66,7 @@ static double hwmon_conv_flag(const char *text) {
 
 struct metric_type {
   const char *suffix;
-  const char *metric;
+  struct metric_meta meta;
   double (*conv)(const char *text);
 };
 
@@ -77,22 +81,26 @@ static const struct metric_data metrics[] = {
     .types = (const struct metric_type[]){
       {
         .suffix = "_input",
-        .metric = "node_hwmon_in_volts",
+        .meta = METRIC_META("node_hwmon_in_volts", "gauge",
+                            "Hardware monitor for voltage (input)."),
         .conv = hwmon_conv_millis,
       },
       {
         .suffix = "_min",
-        .metric = "node_hwmon_in_min_volts",
+        .meta = METRIC_META("node_hwmon_in_min_volts", "gauge",
+                            "Hardware monitor for voltage (min)."),
         .conv = hwmon_conv_millis,
       },
       {
         .suffix = "_max",
-        .metric = "node_hwmon_in_max_volts",
+        .meta = METRIC_META("node_hwmon_in_max_volts", "gauge",
+                            "Hardware monitor for voltage (max)."),
         .conv = hwmon_conv_millis,
       },
       {
         .suffix = "_alarm",
-        .metric = "node_hwmon_in_alarm",
+        .meta = METRIC_META("node_hwmon_in_alarm", "gauge",
+                            "Hardware sensor alarm status (in)."),
         .conv = hwmon_conv_flag,
       },
       { .suffix = 0 },
@@ -103,17 +111,20 @@ static const struct metric_data metrics[] = {
     .types = (const struct metric_type[]){
       {
         .suffix = "_input",
-        .metric = "node_hwmon_fan_rpm",
+        .meta = METRIC_META("node_hwmon_fan_rpm", "gauge",
+                            "Hardware monitor for fan revolutions per minute (input)."),
         .conv = hwmon_conv_id,
       },
       {
         .suffix = "_min",
-        .metric = "node_hwmon_fan_min_rpm",
+        .meta = METRIC_META("node_hwmon_fan_min_rpm", "gauge",
+                            "Hardware monitor for fan revolutions per minute (min)."),
         .conv = hwmon_conv_id,
       },
       {
         .suffix = "_alarm",
-        .metric = "node_hwmon_fan_alarm",
+        .meta = METRIC_META("node_hwmon_fan_alarm", "gauge",
+                            "Hardware sensor alarm status (fan)."),
         .conv = hwmon_conv_flag,
       },
       { .suffix = 0 },
@@ -124,7 +135,8 @@ static const struct metric_data metrics[] = {
     .types = (const struct metric_type[]){
       {
         .suffix = "_input",
-        .metric = "node_hwmon_temp_celsius",
+        .meta = METRIC_META("node_hwmon_temp_celsius", "gauge",
+                            "Hardware monitor for temperature (input)."),
         .conv = hwmon_conv_millis,
       },
       { .suffix = 0 },
@@ -133,16 +145,55 @@ static const struct metric_data metrics[] = {
   { .prefix = 0 },
 };
 
-static void hwmon_name(const char *path, char *dst, size_t dst_len) {
+/** Sensor file queued for reading. */
+struct hwmon_file {
+  const struct metric_type *type;
+  char sensor[LABEL_SIZE];
+  char path[BUF_SIZE];
+  char value[VALUE_SIZE];
+};
+
+/** Sensor value read, kept until all the chips have been read. */
+struct hwmon_reading {
+  struct hwmon_reading *next;
+  const struct metric_type *type;
+  char *chip;
+  char sensor[LABEL_SIZE];
+  double value;
+};
+
+/** List of sensor values read during a scrape, allocated from the scrape arena. */
+struct hwmon_readings {
+  arena *scratch;
+  struct hwmon_reading *head;
+  struct hwmon_reading **tail;
+};
+
+struct hwmon_context {
+  readbatch *batch;
+  struct hwmon_file files[READBATCH_MAX];
+  unsigned nfiles;
+};
+
+static void *hwmon_init(int argc, char *argv[]) {
+  (void) argc; (void) argv;
+
+  struct hwmon_context *ctx = must_malloc(sizeof *ctx);
+  ctx->batch = readbatch_alloc();
+  ctx->nfiles = 0;
+  return ctx;
+}
+
+static void hwmon_name(arena *scratch, const char *path, char *dst, size_t dst_len) {
   char buf[BUF_SIZE];
-  FILE *f;
-  size_t len;
+  ssize_t len;
 
   // if the path is a symlink to "../../devices/X/Y/...", use X/Y as the name,
   // except if it is "virtual/hwmon"
 
-  len = readlink(path, buf, sizeof buf);
+  len = readlink(path, buf, sizeof buf - 1);
   if (len > 14 && memcmp(buf, "../../devices/", 14) == 0) {
+    buf[len] = '\0';
     char *start = buf + 14;
     char *end = strchr(start, '/');
     if (end)
@@ -158,23 +209,13 @@ static void hwmon_name(const char *path, char *dst, size_t dst_len) {
   // try to use the 'name' file
 
   snprintf(buf, sizeof buf, "%s/name", path);
-  f = fopen(buf, "r");
-  if (f) {
-    bool found = false;
-    if (fgets(buf, sizeof buf, f)) {
-      len = strlen(buf);
-      if (len > 0 && buf[len-1] == '\n') {
-        len--;
-        buf[len] = '\0';
-      }
-      if (len > 0) {
-        snprintf(dst, dst_len, "hwmon/%s", buf);
-        found = true;
-      }
-    }
-    fclose(f);
-    if (found)
+  char *data = arena_read_file(scratch, buf, 0);
+  if (data) {
+    char *name = next_line(&data);
+    if (name && *name != '\0') {
+      snprintf(dst, dst_len, "hwmon/%s", name);
       return;
+    }
   }
 
   // give up, just call this unknown
@@ -183,75 +224,110 @@ static void hwmon_name(const char *path, char *dst, size_t dst_len) {
   snprintf(dst, dst_len, "unknown");
 }
 
-static void hwmon_collect(scrape_req *req, void *ctx) {
-  (void) ctx;
+/** Reads all the queued sensor files of the chip \p chip, and keeps their values. */
+static void hwmon_flush(struct hwmon_context *ctx, struct hwmon_readings *readings, char *chip) {
+  readbatch_run(ctx->batch);
+
+  for (unsigned i = 0; i < ctx->nfiles; i++) {
+    struct hwmon_file *file = &ctx->files[i];
+    if (readbatch_len(ctx->batch, i) < 0)
+      continue;
+    double value = file->type->conv(file->value);
+    if (isnan(value))
+      continue;
+
+    struct hwmon_reading *r = arena_get(readings->scratch, sizeof *r);
+    r->next = 0;
+    r->type = file->type;
+    r->chip = chip;
+    strcpy(r->sensor, file->sensor);
+    r->value = value;
+    *readings->tail = r;
+    readings->tail = &r->next;
+  }
+
+  ctx->nfiles = 0;
+}
+
+static void hwmon_collect(scrape_req *req, void *ctx_ptr) {
+  struct hwmon_context *ctx = ctx_ptr;
 
   // buffers
 
   char chip_label[LABEL_SIZE];
-  char sensor_label[LABEL_SIZE];
 
   struct label labels[] = {
-    { .key = "chip", .value = chip_label },
-    { .key = "sensor", .value = sensor_label },
+    { .key = "chip", .value = 0 },  // value filled by code
+    { .key = "sensor", .value = 0 },  // value filled by code
     LABEL_END,
   };
 
   char path[BUF_SIZE];
-  char buf[BUF_SIZE];
-
-  FILE *f;
 
-  DIR *root;
-  struct dirent *dent;
+  arena *scratch = scrape_arena(req);
+  struct hwmon_readings readings = { .scratch = scratch, .head = 0, .tail = &readings.head };
 
   // iterate over all hwmon instances in /sys/class/hwmon
 
-  root = opendir(PATH("/sys/class/hwmon"));
-  if (!root)
+  char **chips = arena_read_dir(scratch, PATH("/sys/class/hwmon"));
+  if (!chips)
     return;
 
-  while ((dent = readdir(root))) {
-    if (strncmp(dent->d_name, "hwmon", 5) != 0)
+  for (char **chip = chips; *chip; chip++) {
+    if (strncmp(*chip, "hwmon", 5) != 0)
       continue;
-    snprintf(path, sizeof path, PATH("/sys/class/hwmon/%s"), dent->d_name);
+    snprintf(path, sizeof path, PATH("/sys/class/hwmon/%s"), *chip);
 
-    hwmon_name(path, chip_label, sizeof chip_label);
+    hwmon_name(scratch, path, chip_label, sizeof chip_label);
 
-    DIR *dir = opendir(path);
-    if (!dir)
+    char **names = arena_read_dir(scratch, path);
+    if (!names)
       continue;
+    char *chip_name = arena_get(scratch, strlen(chip_label) + 1);
+    strcpy(chip_name, chip_label);
 
-    while ((dent = readdir(dir))) {
+    for (char **name = names; *name; name++) {
       for (const struct metric_data *metric = metrics; metric->prefix; metric++) {
-        if (strncmp(dent->d_name, metric->prefix, strlen(metric->prefix)) != 0)
+        if (strncmp(*name, metric->prefix, strlen(metric->prefix)) != 0)
           continue;
-        char *suffix = strchr(dent->d_name, '_');
+        char *suffix = strchr(*name, '_');
         if (!suffix)
           continue;
 
-        snprintf(sensor_label, sizeof sensor_label, "%.*s", (int)(suffix - dent->d_name), dent->d_name);
-
         for (const struct metric_type *type = metric->types; type->suffix; type++) {
           if (strcmp(suffix, type->suffix) != 0)
             continue;
 
-          snprintf(buf, sizeof buf, "%s/%s", path, dent->d_name);
-          f = fopen(buf, "r");
-          if (!f)
-            continue;
-          if (fgets(buf, sizeof buf, f)) {
-            double value = type->conv(buf);
-            if (!isnan(value))
-              scrape_write(req, type->metric, labels, value);
-          }
-          fclose(f);
+          if (ctx->nfiles == READBATCH_MAX)
+            hwmon_flush(ctx, &readings, chip_name);
+          struct hwmon_file *file = &ctx->files[ctx->nfiles++];
+          file->type = type;
+          snprintf(file->sensor, sizeof file->sensor, "%.*s", (int)(suffix - *name), *name);
+          snprintf(file->path, sizeof file->path, "%s/%s", path, *name);
+          readbatch_add(ctx->batch, file->path, file->value, sizeof file->value);
         }
       }
     }
 
-    closedir(dir);
+    hwmon_flush(ctx, &readings, chip_name);
   }
 
-  closedir(root);
+  // emit metrics one type at a time, so that each metric family is written together
+
+  for (const struct metric_data *metric = metrics; metric->prefix; metric++) {
+    for (const struct metric_type *type = metric->types; type->suffix; type++) {
+      bool meta_written = false;
+      for (struct hwmon_reading *r = readings.head; r; r = r->next) {
+        if (r->type != type)
+          continue;
+        if (!meta_written) {
+          scrape_write_meta(req, &type->meta);
+          meta_written = true;
+        }
+        labels[0].value = r->chip;
+        labels[1].value = r->sensor;
+        scrape_write(req, type->meta.name, labels, r->value);
+      }
+    }
+  }
 }
@@ -16,6 +16,7 @@
 
 #define _POSIX_C_SOURCE 200809L
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -47,13 +48,26 @@ static const struct collector *collectors[] = {
 
 
 struct config {
-  const char *port;
+  struct scrape_config scrape;
   bool daemonize;
   const char *pidfile;
 };
 
 const struct config default_config = {
-  .port = "9100",
+  .scrape = {
+    .port = "9100",
+    .gzip_level = 6,
+    .gzip_min_size = 1024,
+    .coalesce_ms = 0,
+    .collect_interval_ms = 0,
+    .timestamps = false,
+    .header_timeout_ms = 10000,
+    .response_timeout_ms = 30000,
+    .idle_timeout_ms = 120000,
+    .max_connections = 256,
+    .collector_threads = 1,
+    .workers = 1,
+  },
   .daemonize = true,
   .pidfile = 0,
 };
@@ -66,6 +80,8 @@ struct collector_ctx {
 
 static bool initialize(int argc, char *argv[], struct config *cfg, struct collector_ctx *ctx);
 static bool daemonize(struct config *cfg);
+static bool parse_number(const char *arg, const char *value, unsigned long max, unsigned long *out);
+static bool parse_duration(const char *arg, const char *value, unsigned *millis);
 
 int main(int argc, char *argv[]) {
   struct config cfg = default_config;
@@ -74,7 +90,7 @@ int main(int argc, char *argv[]) {
   if (!initialize(argc, argv, &cfg, &ctx))
     return 1;
 
-  scrape_server *server = scrape_listen(cfg.port);
+  scrape_server *server = scrape_listen(&cfg.scrape);
   if (!server)
     return 1;
 
@@ -133,7 +149,7 @@ static bool initialize(int argc, char *argv[], struct config *cfg, struct collec
 
     // TODO --help
     if (strncmp(argv[arg], "--port=", 7) == 0) {
-      cfg->port = &argv[arg][7];
+      cfg->scrape.port = &argv[arg][7];
       goto next_arg;
     } else if (strcmp(argv[arg], "--foreground") == 0) {
       cfg->daemonize = false;
@@ -141,6 +157,69 @@ static bool initialize(int argc, char *argv[], struct config *cfg, struct collec
     } else if (strncmp(argv[arg], "--pidfile=", 10) == 0) {
       cfg->pidfile = &argv[arg][10];
       goto next_arg;
+    } else if (strncmp(argv[arg], "--gzip-level=", 13) == 0) {
+      unsigned long level;
+      if (!parse_number(argv[arg], &argv[arg][13], 9, &level))
+        return false;
+      cfg->scrape.gzip_level = level;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--gzip-min-size=", 16) == 0) {
+      unsigned long size;
+      if (!parse_number(argv[arg], &argv[arg][16], (size_t) -1, &size))
+        return false;
+      cfg->scrape.gzip_min_size = size;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--coalesce-ms=", 14) == 0) {
+      unsigned long ms;
+      if (!parse_number(argv[arg], &argv[arg][14], (unsigned) -1, &ms))
+        return false;
+      cfg->scrape.coalesce_ms = ms;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--collect-interval=", 19) == 0) {
+      if (!parse_duration(argv[arg], &argv[arg][19], &cfg->scrape.collect_interval_ms))
+        return false;
+      goto next_arg;
+    } else if (strcmp(argv[arg], "--collect-timestamps") == 0) {
+      cfg->scrape.timestamps = true;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--header-timeout=", 17) == 0) {
+      if (!parse_duration(argv[arg], &argv[arg][17], &cfg->scrape.header_timeout_ms))
+        return false;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--response-timeout=", 19) == 0) {
+      if (!parse_duration(argv[arg], &argv[arg][19], &cfg->scrape.response_timeout_ms))
+        return false;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--idle-timeout=", 15) == 0) {
+      if (!parse_duration(argv[arg], &argv[arg][15], &cfg->scrape.idle_timeout_ms))
+        return false;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--max-connections=", 18) == 0) {
+      unsigned long n;
+      if (!parse_number(argv[arg], &argv[arg][18], (unsigned) -1, &n))
+        return false;
+      cfg->scrape.max_connections = n;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--collector-threads=", 20) == 0) {
+      unsigned long n;
+      if (!parse_number(argv[arg], &argv[arg][20], 64, &n))
+        return false;
+      if (n == 0) {
+        fprintf(stderr, "invalid argument: %s (need at least one thread)\n", argv[arg]);
+        return false;
+      }
+      cfg->scrape.collector_threads = n;
+      goto next_arg;
+    } else if (strncmp(argv[arg], "--workers=", 10) == 0) {
+      unsigned long n;
+      if (!parse_number(argv[arg], &argv[arg][10], 64, &n))
+        return false;
+      if (n == 0) {
+        fprintf(stderr, "invalid argument: %s (need at least one worker)\n", argv[arg]);
+        return false;
+      }
+      cfg->scrape.workers = n;
+      goto next_arg;
     }
 
     fprintf(stderr, "unknown argument: %s\n", argv[arg]);
@@ -243,3 +322,36 @@ static bool daemonize(struct config *cfg) {
 
   return true;
 }
+
+static bool parse_number(const char *arg, const char *value, unsigned long max, unsigned long *out) {
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(value, &end, 10);
+  if (*value < '0' || *value > '9' || *end != '\0' || errno != 0 || n > max) {
+    fprintf(stderr, "invalid argument: %s (expected a number between 0 and %lu)\n", arg, max);
+    return false;
+  }
+  *out = n;
+  return true;
+}
+
+static bool parse_duration(const char *arg, const char *value, unsigned *millis) {
+  static const struct { const char *suffix; unsigned long scale; } units[] = {
+    { "ms", 1 }, { "s", 1000 }, { "", 1000 }, { "m", 60000 },
+  };
+
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(value, &end, 10);
+  if (*value >= '0' && *value <= '9' && errno == 0 && n > 0) {
+    for (size_t u = 0; u < sizeof units / sizeof *units; u++) {
+      if (strcmp(end, units[u].suffix) == 0 && n <= (unsigned) -1 / units[u].scale) {
+        *millis = n * units[u].scale;
+        return true;
+      }
+    }
+  }
+
+  fprintf(stderr, "invalid argument: %s (expected a duration such as 500ms, 5s or 1m)\n", arg);
+  return false;
+}
@@ -17,13 +17,14 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "scrape.h"
 #include "util.h"
 
-// size of input buffer for paths and lines
+// size of buffer for metric names
 #define BUF_SIZE 256
 
 // prefix to add to /proc/meminfo lines; must fit in BUF_SIZE
@@ -34,61 +35,125 @@
 #define BYTES_SUFFIX "_bytes"
 #define BYTES_SUFFIX_LEN (sizeof BYTES_SUFFIX - 1)
 
+static void *meminfo_init(int argc, char *argv[]);
 static void meminfo_collect(scrape_req *req, void *ctx);
 
 const struct collector meminfo_collector = {
   .name = "meminfo",
   .collect = meminfo_collect,
+  .init = meminfo_init,
 };
 
-static void meminfo_collect(scrape_req *req, void *ctx) {
-  (void) ctx;
+// All /proc/meminfo fields are gauges, but their names are only known from the file, so the
+// metadata is rendered for the fields present at startup, in the order of the file. Fields that
+// only appear later are written without metadata.
 
-  // buffers
+struct meminfo_context {
+  pfile *meminfo;
+  struct metric_meta *metas;
+  size_t nmetas;
+};
 
-  char buf[BUF_SIZE] = METRIC_PREFIX;
+/**
+ * Parses a line of /proc/meminfo into a metric name in \p buf and its value. Returns `false` if the
+ * line is not a valid field.
+ */
+static bool meminfo_parse(char *line, char buf[BUF_SIZE], uint64_t *value) {
+  char *p = line;
+  char *metric_end = buf + METRIC_PREFIX_LEN;
+  while (*p != '\0' && *p != ':' && metric_end < buf + BUF_SIZE - 1) {
+    *metric_end++ = isalnum((unsigned char)*p) ? *p : '_';
+    p++;
+  }
+  if (*p != ':')
+    return false;
 
-  FILE *f;
+  while (metric_end > buf + METRIC_PREFIX_LEN && metric_end[-1] == '_')
+    --metric_end;
+  *metric_end = '\0';
 
-  // convert /proc/meminfo to metrics format
+  do p++; while (*p == ' ');
 
-  f = fopen(PATH("/proc/meminfo"), "r");
-  if (!f)
-    return;
+  p = parse_u64(p, value);
+  if (!p || (*p != '\0' && *p != ' '))
+    return false;
 
-  while (fgets_line(buf + METRIC_PREFIX_LEN, sizeof buf - METRIC_PREFIX_LEN, f)) {
-    char *p = buf + METRIC_PREFIX_LEN;
-    while (*p != '\0' && *p != ':') {
-      if (!isalnum((unsigned char)*p))
-        *p = '_';
-      p++;
+  if (*p == ' ') {
+    do p++; while (*p == ' ');
+    if (p[0] == 'k' && p[1] == 'B') {
+      if ((metric_end - buf) + BYTES_SUFFIX_LEN >= BUF_SIZE)
+        return false;
+      strcpy(metric_end, BYTES_SUFFIX);
+      *value *= 1024;
     }
-    if (*p != ':')
-      continue;
-    char *metric_end = p;
+  }
 
-    while (metric_end > buf + METRIC_PREFIX_LEN && metric_end[-1] == '_')
-      --metric_end;
-    *metric_end = '\0';
+  return true;
+}
 
-    do p++; while (*p == ' ');
+static void *meminfo_init(int argc, char *argv[]) {
+  (void) argc; (void) argv;
+
+  struct meminfo_context *ctx = must_malloc(sizeof *ctx);
+  ctx->meminfo = pfile_open(PATH("/proc/meminfo"));
+  ctx->metas = 0;
+  ctx->nmetas = 0;
+
+  arena *mem = arena_alloc(4096);
+  char *data = pfile_read(ctx->meminfo, mem, 0);
+  if (data) {
+    char buf[BUF_SIZE] = METRIC_PREFIX;
+    uint64_t value;
+
+    ctx->metas = must_malloc(line_count(data) * sizeof *ctx->metas);
+    for (char *pos = data, *line; (line = next_line(&pos)); ) {
+      if (!meminfo_parse(line, buf, &value))
+        continue;
+      const char *field = buf + METRIC_PREFIX_LEN;
+      int len = snprintf(0, 0, "# HELP %s Memory information field %s.\n# TYPE %s gauge\n", buf, field, buf);
+      char *text = must_malloc(len + 1);
+      snprintf(text, len + 1, "# HELP %s Memory information field %s.\n# TYPE %s gauge\n", buf, field, buf);
+      ctx->metas[ctx->nmetas++] = (struct metric_meta){ .name = must_strdup(buf), .text = text, .len = len };
+    }
+  }
+  arena_free(mem);
 
-    double value = strtod(p, &p);
-    if (*p != '\0' && *p != '\n' && *p != ' ')
-      continue;
+  return ctx;
+}
 
-    if (*p == ' ') {
-      do p++; while (*p == ' ');
-      if (p[0] == 'k' && p[1] == 'B') {
-        if ((metric_end - buf) + BYTES_SUFFIX_LEN >= sizeof buf)
-          continue;
-        strcpy(metric_end, BYTES_SUFFIX);
-        value *= 1024.0;
-      }
+/** Finds the metadata of \p name, looking from \p *next on, and moves \p *next past it. */
+static const struct metric_meta *meminfo_find_meta(struct meminfo_context *ctx, const char *name, size_t *next) {
+  for (size_t i = *next; i < ctx->nmetas; i++) {
+    if (strcmp(ctx->metas[i].name, name) == 0) {
+      *next = i + 1;
+      return &ctx->metas[i];
     }
-
-    scrape_write(req, buf, 0, value);
   }
+  return 0;
+}
+
+static void meminfo_collect(scrape_req *req, void *ctx_ptr) {
+  struct meminfo_context *ctx = ctx_ptr;
+
+  // buffers
+
+  char buf[BUF_SIZE] = METRIC_PREFIX;
+  size_t next_meta = 0;
 
-  fclose(f);
+  // convert /proc/meminfo to metrics format
+
+  char *data = pfile_read(ctx->meminfo, scrape_arena(req), 0);
+  if (!data)
+    return;
+
+  for (char *pos = data, *line; (line = next_line(&pos)); ) {
+    uint64_t value;
+    if (!meminfo_parse(line, buf, &value))
+      continue;
+
+    const struct metric_meta *meta = meminfo_find_meta(ctx, buf, &next_meta);
+    if (meta)
+      scrape_write_meta(req, meta);
+    scrape_write_u64(req, buf, 0, value);
+  }
 }
@@ -24,11 +24,14 @@
 #include "scrape.h"
 #include "util.h"
 
-// size of input buffer for paths and lines
+// initial size of the memory the header is read into
 #define BUF_SIZE 256
 // maximum number of columns in the file
 #define MAX_COLUMNS 32
 
+// metadata of the metric of a column: metric name, statistic name (in two parts), metric name
+#define META_FORMAT "# HELP %s Network device statistic %s%s.\n# TYPE %s counter\n"
+
 // default list of interfaces to exclude
 #define DEFAULT_EXCLUDE "lo"
 
@@ -42,49 +45,61 @@ const struct collector netdev_collector = {
   .has_args = true,
 };
 
+/** Values read for an interface, kept until all the interfaces have been read. */
+struct netdev_device {
+  char *name;
+  uint64_t values[MAX_COLUMNS];
+  // bit mask of the columns that held a valid number
+  uint32_t valid;
+  size_t ncolumns;
+};
+
 struct netdev_context {
   size_t ncolumns;
-  char *columns[MAX_COLUMNS];
-  struct slist *include;
-  struct slist *exclude;
+  struct metric_meta columns[MAX_COLUMNS];
+  matcher *include;
+  matcher *exclude;
+  pfile *dev;
 };
 
 static void *netdev_init(int argc, char *argv[]) {
   // parse header from /proc/net/dev and prepare metric names
 
-  FILE *f = fopen(PATH("/proc/net/dev"), "r");
-  if (!f) {
-    perror("fopen /proc/net/dev");
+  arena *scratch = arena_alloc(BUF_SIZE);
+  char *data = arena_read_file(scratch, PATH("/proc/net/dev"), 0);
+  if (!data) {
+    perror("read /proc/net/dev");
+    arena_free(scratch);
     return 0;
   }
 
-  char buf[BUF_SIZE];
-  char *p;
-
-  fgets_line(buf, sizeof buf, f);
-  p = fgets_line(buf, sizeof buf, f);
-  fclose(f);
-  if (!p) {
+  next_line(&data);
+  char *header = next_line(&data);
+  if (!header) {
     fprintf(stderr, "second header line in /proc/net/dev missing\n");
+    arena_free(scratch);
     return 0;
   }
 
+  // the line has three parts separated by '|': interface, receive columns, transmit columns
   static const char *const prefixes[2] = { "node_network_receive_", "node_network_transmit_" };
   char *parts[2];
-  char *saveptr;
-
-  strtok_r(buf, "|", &saveptr);
-  parts[0] = strtok_r(0, "|", &saveptr);
-  parts[1] = strtok_r(0, "|", &saveptr);
-  p = strtok_r(0, "|", &saveptr);
-  if (!parts[0] || !parts[1] || p) {
+  char *p = strchr(header, '|');
+  parts[0] = p ? p + 1 : 0;
+  p = parts[0] ? strchr(parts[0], '|') : 0;
+  parts[1] = p ? p + 1 : 0;
+  p = parts[1] ? strchr(parts[1], '|') : 0;
+  if (!parts[1] || p) {
     fprintf(stderr, "too %s parts in /proc/net/dev header\n", p ? "many" : "few");
+    arena_free(scratch);
     return 0;
   }
+  parts[1][-1] = '\0';  // end the receive columns at the second '|'
 
   struct netdev_context *ctx = malloc(sizeof *ctx);
   if (!ctx) {
     perror("malloc");
+    arena_free(scratch);
     return 0;
   }
 
@@ -92,26 +107,45 @@ static void *netdev_init(int argc, char *argv[]) {
   for (int part = 0; part < 2; part++) {
     size_t prefix_len = strlen(prefixes[part]);
 
-    for (p = strtok_r(parts[part], " \n", &saveptr); p; p = strtok_r(0, " \n", &saveptr)) {
-      if (ctx->ncolumns >= MAX_COLUMNS) {
-        fprintf(stderr, "too many columns in /proc/net/dev\n");
-        goto cleanup;
-      }
+    // one more than fits, to detect too many columns
+    char *names[MAX_COLUMNS + 1];
+    size_t nnames = split_fields(parts[part], names, MAX_COLUMNS + 1 - ctx->ncolumns);
+    if (ctx->ncolumns + nnames > MAX_COLUMNS) {
+      fprintf(stderr, "too many columns in /proc/net/dev\n");
+      goto cleanup;
+    }
 
-      size_t header_len = strlen(p);
+    for (size_t i = 0; i < nnames; i++) {
+      const char *name = names[i];
+      size_t header_len = strlen(name);
       size_t metric_len = prefix_len + header_len + 6;  // 6 for "_total"
 
-      ctx->columns[ctx->ncolumns] = malloc(metric_len + 1);
-      if (!ctx->columns[ctx->ncolumns]) {
+      char *metric = malloc(metric_len + 1);
+      if (!metric) {
+        perror("malloc");
+        goto cleanup;
+      }
+      snprintf(metric, metric_len + 1, "%s%s_total", prefixes[part], name);
+
+      // the metadata text of the column is rendered once, here
+      const char *stat = prefixes[part] + 13;  // 13 for "node_network_"
+      int text_len = snprintf(0, 0, META_FORMAT, metric, stat, name, metric);
+      char *text = malloc(text_len + 1);
+      if (!text) {
         perror("malloc");
+        free(metric);
         goto cleanup;
       }
+      snprintf(text, text_len + 1, META_FORMAT, metric, stat, name, metric);
 
-      snprintf(ctx->columns[ctx->ncolumns], metric_len + 1, "%s%s_total", prefixes[part], p);
+      ctx->columns[ctx->ncolumns] = (struct metric_meta){ .name = metric, .text = text, .len = text_len };
       ctx->ncolumns++;
     }
   }
 
+  arena_free(scratch);
+  scratch = 0;
+
   // parse command-line arguments
 
   ctx->include = 0;
@@ -120,11 +154,11 @@ static void *netdev_init(int argc, char *argv[]) {
 
   for (int arg = 0; arg < argc; arg++) {
     if (strncmp(argv[arg], "include=", 8) == 0) {
-      ctx->include = slist_split(argv[arg] + 8, ",");
+      ctx->include = matcher_split(argv[arg] + 8, ",");
       continue;
     }
     if (strncmp(argv[arg], "exclude=", 8) == 0) {
-      ctx->exclude = slist_split(argv[arg] + 8, ",");
+      ctx->exclude = matcher_split(argv[arg] + 8, ",");
       continue;
     }
 
@@ -133,13 +167,18 @@ static void *netdev_init(int argc, char *argv[]) {
   }
 
   if (!exclude_set)
-    ctx->exclude = slist_split(DEFAULT_EXCLUDE, ",");
+    ctx->exclude = matcher_split(DEFAULT_EXCLUDE, ",");
 
+  ctx->dev = pfile_open(PATH("/proc/net/dev"));
   return ctx;
 
 cleanup:
-  for (size_t i = 0; i < ctx->ncolumns; i++)
-    free(ctx->columns[i]);
+  if (scratch)
+    arena_free(scratch);
+  for (size_t i = 0; i < ctx->ncolumns; i++) {
+    free((char *) ctx->columns[i].name);
+    free((char *) ctx->columns[i].text);
+  }
   free(ctx);
   return 0;
 }
@@ -154,21 +193,23 @@ static void netdev_collect(scrape_req *req, void *ctx_ptr) {
     LABEL_END,
   };
 
-  char buf[BUF_SIZE];
-
-  FILE *f;
+  arena *scratch = scrape_arena(req);
 
   // read network stats from /proc/net/dev
 
-  f = fopen(PATH("/proc/net/dev"), "r");
-  if (!f)
+  char *data = pfile_read(ctx->dev, scratch, 0);
+  if (!data)
     return;
 
-  fgets_line(buf, sizeof buf, f);
-  fgets_line(buf, sizeof buf, f);  // skipped header
+  struct netdev_device *devices = arena_get(scratch, line_count(data) * sizeof *devices);
+  unsigned ndevices = 0;
+
+  char *pos = data, *line;
+  next_line(&pos);
+  next_line(&pos);  // skipped header
 
-  while (fgets_line(buf, sizeof buf, f)) {
-    char *dev = buf;
+  while ((line = next_line(&pos))) {
+    char *dev = line;
     while (*dev == ' ')
       dev++;
 
@@ -176,27 +217,43 @@ static void netdev_collect(scrape_req *req, void *ctx_ptr) {
     if (!p)
       continue;
     *p = '\0';
-    labels[0].value = dev;
     p++;
 
     if (ctx->include) {
-      if (!slist_matches(ctx->include, dev))
+      if (!matcher_matches(ctx->include, dev))
         continue;
     } else if (ctx->exclude) {
-      if (slist_matches(ctx->exclude, dev))
+      if (matcher_matches(ctx->exclude, dev))
         continue;
     }
 
-    char *saveptr;
-    p = strtok_r(p, " \n", &saveptr);
-    for (size_t i = 0; i < ctx->ncolumns && p; i++, p = strtok_r(0, " \n", &saveptr)) {
-      char *endptr;
-      double value = strtod(p, &endptr);
-      if (*endptr != '\0')
-        continue;
-      scrape_write(req, ctx->columns[i], labels, value);
+    struct netdev_device *d = &devices[ndevices++];
+    d->name = dev;
+
+    char *values[MAX_COLUMNS];
+    d->ncolumns = split_fields(p, values, ctx->ncolumns);
+    d->valid = 0;
+    for (size_t c = 0; c < d->ncolumns; c++) {
+      char *end = parse_u64(values[c], &d->values[c]);
+      if (end && *end == '\0')
+        d->valid |= (uint32_t) 1 << c;
     }
   }
 
-  fclose(f);
+  // emit metrics one column at a time, so that each metric family is written together
+
+  for (size_t c = 0; c < ctx->ncolumns; c++) {
+    bool meta_written = false;
+    for (unsigned i = 0; i < ndevices; i++) {
+      struct netdev_device *d = &devices[i];
+      if (!(d->valid & (uint32_t) 1 << c))
+        continue;
+      if (!meta_written) {
+        scrape_write_meta(req, &ctx->columns[c]);
+        meta_written = true;
+      }
+      labels[0].value = d->name;
+      scrape_write_u64(req, ctx->columns[c].name, labels, d->values[c]);
+    }
+  }
 }
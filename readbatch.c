@@ -0,0 +1,394 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// batch backend: plain reads, or io_uring(7) on Linux if NANO_EXPORTER_URING is defined
+#if defined(__linux__) && defined(NANO_EXPORTER_URING)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define USE_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+#include "readbatch.h"
+#include "util.h"
+
+// each file needs a read and a close in the same submission
+#define RING_ENTRIES (2 * READBATCH_MAX)
+
+struct readbatch_file {
+  const char *path;
+  char *buf;
+  size_t size;
+  int fd;
+  ssize_t len;
+};
+
+struct readbatch {
+  struct readbatch_file files[READBATCH_MAX];
+  unsigned nfiles;
+  bool done;
+#ifdef USE_URING
+  // ring file descriptor, or -1 to use the fallback
+  int ring_fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+static void batch_read_plain(struct readbatch_file *file);
+
+#ifdef USE_URING
+static bool ring_init(readbatch *batch);
+static void ring_free(readbatch *batch);
+static bool ring_run(readbatch *batch);
+#endif
+
+readbatch *readbatch_alloc(void) {
+  readbatch *batch = must_malloc(sizeof *batch);
+  batch->nfiles = 0;
+  batch->done = false;
+#ifdef USE_URING
+  if (!ring_init(batch))
+    batch->ring_fd = -1;
+#endif
+  return batch;
+}
+
+void readbatch_free(readbatch *batch) {
+#ifdef USE_URING
+  ring_free(batch);
+#endif
+  free(batch);
+}
+
+bool readbatch_add(readbatch *batch, const char *path, char *buf, size_t size) {
+  if (batch->done) {
+    batch->nfiles = 0;
+    batch->done = false;
+  }
+  if (batch->nfiles == READBATCH_MAX)
+    return false;
+
+  struct readbatch_file *file = &batch->files[batch->nfiles++];
+  file->path = path;
+  file->buf = buf;
+  file->size = size;
+  file->fd = -1;
+  file->len = -1;
+  return true;
+}
+
+void readbatch_run(readbatch *batch) {
+  batch->done = true;
+  if (batch->nfiles == 0)
+    return;
+
+#ifdef USE_URING
+  if (batch->ring_fd != -1 && ring_run(batch))
+    return;
+#endif
+
+  for (unsigned i = 0; i < batch->nfiles; i++)
+    batch_read_plain(&batch->files[i]);
+}
+
+ssize_t readbatch_len(readbatch *batch, unsigned i) {
+  return i < batch->nfiles ? batch->files[i].len : -1;
+}
+
+static void batch_read_plain(struct readbatch_file *file) {
+  file->buf[0] = '\0';
+
+  int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  ssize_t len;
+  do
+    len = read(fd, file->buf, file->size - 1);
+  while (len == -1 && errno == EINTR);
+  if (len >= 0) {
+    file->buf[len] = '\0';
+    file->len = len;
+  }
+
+  close(fd);
+}
+
+#ifdef USE_URING
+
+// io_uring backend
+
+// A batch takes two trips through the ring: first all the files are opened, and then each opened
+// file is read and closed, with the close hard-linked after the read so it runs even if the read
+// fails or comes up short.
+
+enum ring_op {
+  ring_op_open,
+  ring_op_read,
+  ring_op_close,
+};
+
+#define RING_USER_DATA(op, i) (((__u64) (i) << 2) | (op))
+
+static bool ring_init(readbatch *batch) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+
+  int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (fd == -1)
+    return false;  // not supported, or disabled by policy
+  batch->ring_fd = fd;
+  batch->sq_ring = batch->cq_ring = batch->sqes = MAP_FAILED;
+
+  // check that the kernel supports all the needed operations
+
+  size_t probe_size = sizeof (struct io_uring_probe) + IORING_OP_LAST * sizeof (struct io_uring_probe_op);
+  struct io_uring_probe *probe = must_malloc(probe_size);
+  memset(probe, 0, probe_size);
+  bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+  static const unsigned needed_ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+  for (unsigned i = 0; supported && i < sizeof needed_ops / sizeof *needed_ops; i++) {
+    unsigned op = needed_ops[i];
+    supported = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  if (!supported || !(params.features & IORING_FEAT_NODROP)) {
+    ring_free(batch);
+    return false;
+  }
+
+  // map the rings
+
+  batch->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  batch->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (batch->cq_ring_size > batch->sq_ring_size)
+      batch->sq_ring_size = batch->cq_ring_size;
+    batch->cq_ring_size = 0;
+  }
+
+  batch->sq_ring = mmap(0, batch->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (batch->sq_ring == MAP_FAILED) {
+    ring_free(batch);
+    return false;
+  }
+  if (batch->cq_ring_size > 0) {
+    batch->cq_ring = mmap(0, batch->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (batch->cq_ring == MAP_FAILED) {
+      ring_free(batch);
+      return false;
+    }
+  }
+  batch->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  batch->sqes = mmap(0, batch->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (batch->sqes == MAP_FAILED) {
+    ring_free(batch);
+    return false;
+  }
+
+  char *sq = batch->sq_ring;
+  char *cq = batch->cq_ring_size > 0 ? batch->cq_ring : batch->sq_ring;
+  batch->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  batch->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  batch->sq_array = (unsigned *) (sq + params.sq_off.array);
+  batch->cq_head = (unsigned *) (cq + params.cq_off.head);
+  batch->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  batch->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  batch->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return true;
+}
+
+static void ring_free(readbatch *batch) {
+  if (batch->ring_fd == -1)
+    return;
+  if (batch->sqes != MAP_FAILED)
+    munmap(batch->sqes, batch->sqes_size);
+  if (batch->cq_ring != MAP_FAILED && batch->cq_ring_size > 0)
+    munmap(batch->cq_ring, batch->cq_ring_size);
+  if (batch->sq_ring != MAP_FAILED)
+    munmap(batch->sq_ring, batch->sq_ring_size);
+  close(batch->ring_fd);
+  batch->ring_fd = -1;
+}
+
+/** Queues a submission, returning the entry to fill. The ring is never full: see RING_ENTRIES. */
+static struct io_uring_sqe *ring_sqe(readbatch *batch, unsigned *tail) {
+  unsigned index = *tail & batch->sq_mask;
+  struct io_uring_sqe *sqe = &batch->sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  batch->sq_array[index] = index;
+  ++*tail;
+  return sqe;
+}
+
+/**
+ * Submits the queued entries, and waits for and handles all their completions.
+ *
+ * Returns `false` if the ring failed. Any entries not yet submitted by then are dropped, but the
+ * ones already submitted are waited for, since they still refer to the file buffers.
+ */
+static bool ring_submit(readbatch *batch, unsigned tail, unsigned count) {
+  __atomic_store_n(batch->sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned submitted = 0;
+  unsigned completed = 0;
+  bool ok = true;
+
+  while (completed < (ok ? count : submitted)) {
+    unsigned to_submit = ok ? count - submitted : 0;
+    unsigned to_wait = (ok ? count : submitted) - completed;
+    int ret = syscall(__NR_io_uring_enter, batch->ring_fd, to_submit, to_wait, IORING_ENTER_GETEVENTS, 0, 0);
+    if (ret == -1) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      perror("io_uring_enter");
+      if (!ok) {
+        // can't even wait: forget the file descriptors rather than risk closing reused ones
+        for (unsigned i = 0; i < batch->nfiles; i++)
+          batch->files[i].fd = -1;
+        return false;
+      }
+      ok = false;
+      continue;
+    }
+    submitted += ret;
+
+    unsigned head = *batch->cq_head;
+    unsigned cq_tail = __atomic_load_n(batch->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++, completed++) {
+      struct io_uring_cqe *cqe = &batch->cqes[head & batch->cq_mask];
+      struct readbatch_file *file = &batch->files[cqe->user_data >> 2];
+      switch ((enum ring_op) (cqe->user_data & 3)) {
+        case ring_op_open:
+          file->fd = cqe->res >= 0 ? cqe->res : -1;
+          break;
+        case ring_op_read:
+          if (cqe->res >= 0) {
+            file->buf[cqe->res] = '\0';
+            file->len = cqe->res;
+          }
+          break;
+        case ring_op_close:
+          if (cqe->res < 0 && cqe->res != -EBADF)
+            close(file->fd);  // canceled, so close it the old-fashioned way
+          file->fd = -1;
+          break;
+      }
+    }
+    __atomic_store_n(batch->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return ok;
+}
+
+/**
+ * Reads the batch through the ring. Returns `false` if the ring failed, in which case it's freed
+ * and the batch is left for the fallback to read again from the start.
+ */
+static bool ring_run(readbatch *batch) {
+  unsigned tail = *batch->sq_tail;
+  unsigned count = 0;
+
+  for (unsigned i = 0; i < batch->nfiles; i++) {
+    struct readbatch_file *file = &batch->files[i];
+    file->buf[0] = '\0';
+
+    struct io_uring_sqe *sqe = ring_sqe(batch, &tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (__u64) (uintptr_t) file->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = RING_USER_DATA(ring_op_open, i);
+    count++;
+  }
+  if (!ring_submit(batch, tail, count))
+    goto failed;
+
+  count = 0;
+  for (unsigned i = 0; i < batch->nfiles; i++) {
+    struct readbatch_file *file = &batch->files[i];
+    if (file->fd == -1)
+      continue;
+
+    struct io_uring_sqe *sqe = ring_sqe(batch, &tail);
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->fd = file->fd;
+    sqe->addr = (__u64) (uintptr_t) file->buf;
+    sqe->len = file->size - 1;
+    sqe->off = 0;
+    sqe->user_data = RING_USER_DATA(ring_op_read, i);
+
+    sqe = ring_sqe(batch, &tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = file->fd;
+    sqe->user_data = RING_USER_DATA(ring_op_close, i);
+    count += 2;
+  }
+  if (count > 0 && !ring_submit(batch, tail, count))
+    goto failed;
+  return true;
+
+failed:
+  for (unsigned i = 0; i < batch->nfiles; i++) {
+    struct readbatch_file *file = &batch->files[i];
+    if (file->fd != -1)
+      close(file->fd);
+    file->fd = -1;
+    file->len = -1;
+  }
+  ring_free(batch);
+  return false;
+}
+
+#endif // USE_URING
+
+#ifdef NANO_EXPORTER_TEST
+/** Returns `true` if \p batch reads through io_uring, rather than with plain system calls. */
+bool readbatch_test_uses_ring(readbatch *batch) {
+#ifdef USE_URING
+  return batch->ring_fd != -1;
+#else
+  (void) batch;
+  return false;
+#endif
+}
+#endif // NANO_EXPORTER_TEST
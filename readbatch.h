@@ -0,0 +1,63 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANO_EXPORTER_READBATCH_H_
+#define NANO_EXPORTER_READBATCH_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Maximum number of files that can be queued in a single batch. */
+#define READBATCH_MAX 64
+
+/**
+ * Opaque type for reading the contents of many small files (such as sysfs attributes) at once.
+ *
+ * The files are read one by one with plain system calls. If built with NANO_EXPORTER_URING on
+ * Linux, they are instead opened, read and closed with io_uring, taking two system calls for the
+ * entire batch, unless io_uring is not available or the ring ever fails.
+ *
+ * A batch object must only be used from one thread at a time.
+ */
+typedef struct readbatch readbatch;
+
+/** Allocates a new, empty batch. */
+readbatch *readbatch_alloc(void);
+/** Frees all the storage associated with \p batch. */
+void readbatch_free(readbatch *batch);
+
+/**
+ * Queues the file at \p path to be read into buffer \p buf of \p size bytes.
+ *
+ * Both \p path and \p buf must stay valid until readbatch_run() returns. The first call after a
+ * readbatch_run() starts a new batch. Returns `false` if the batch is already full.
+ */
+bool readbatch_add(readbatch *batch, const char *path, char *buf, size_t size);
+/**
+ * Reads all the queued files.
+ *
+ * At most `size - 1` bytes are read from the start of each file, and the buffer contents are
+ * always terminated by a '\0' byte, even if reading the file failed.
+ */
+void readbatch_run(readbatch *batch);
+/**
+ * Returns the number of bytes read into the buffer of the \p i'th (counting from 0) queued file,
+ * or -1 if the file could not be opened or read.
+ */
+ssize_t readbatch_len(readbatch *batch, unsigned i);
+
+#endif // NANO_EXPORTER_READBATCH_H_
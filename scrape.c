@@ -15,6 +15,8 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+// for SO_REUSEPORT
+#define _DEFAULT_SOURCE
 
 #include <ctype.h>
 #include <errno.h>
@@ -22,32 +24,61 @@
 #include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+// event loop backend: epoll(7) on Linux, poll(2) elsewhere or if NANO_EXPORTER_POLL is defined
+#if defined(__linux__) && !defined(NANO_EXPORTER_POLL)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+#include <poll.h>
+
+#include "gzip.h"
 #include "scrape.h"
 #include "util.h"
 
+// initial size of collector output buffers, before the usual size of the output has been learned
 #define BUF_INITIAL 1024
+// amount of collector output buffered before it's sent as a chunk, even in the middle of a collector
 #define BUF_MAX 65536
+// amount of collector output held back for a client that isn't keeping up, before waiting for it
+#define BUF_PARK_MAX (4 * BUF_MAX)
+// initial size of the scratch memory arena of a request
+#define SCRATCH_INITIAL 4096
+// initial size of the memory arena for the files shared during a collection pass
+#define PASS_INITIAL 16384
 
 #define MAX_LISTEN_SOCKETS 4
 #define MAX_BACKLOG 16
-#define MAX_REQUESTS 16
+#define MAX_EVENTS 64
 
-#define TIMEOUT_SEC 30
-#define TIMEOUT_NSEC 0
+// number of idle request buffers and compressors kept for reuse by new connections
+#define BUF_CACHE_SIZE 8
+#define GZIP_CACHE_SIZE 2
+
+// size of the socket input buffer
+#define HTTP_IN_SIZE 1024
+// longest header line that is inspected; longer lines are skipped
+#define HTTP_HEADER_MAX 256
+// size of the formatted response headers
+#define HTTP_HEAD_SIZE 256
+// size of a formatted chunk size line
+#define HTTP_CHUNK_HEAD_SIZE 24
 
 enum req_state {
   req_state_inactive,
   req_state_read,
-  req_state_write_headers,
   req_state_write_metrics,
   req_state_write_error,
 };
@@ -56,195 +87,895 @@ enum http_parse_state {
   http_read_start,
   http_read_path,
   http_read_version,
-  http_skip_headers_1,
-  http_skip_headers_2,
+  http_read_header_start,
+  http_read_header,
+  http_skip_header,
+};
+
+enum timeout_kind {
+  timeout_header,
+  timeout_response,
+  timeout_idle,
+  max_timeout,
+};
+
+/** Files read during a collection pass, shared by all of its collectors. */
+struct scrape_pass {
+  // held while looking up or reading a file, as the collectors of a pass may run concurrently
+  pthread_mutex_t lock;
+  arena *mem;
+  struct pass_file *files;
+};
+
+struct pass_file {
+  struct pass_file *next;
+  const char *path;
+  // lines of the file, or a null pointer if it could not be read
+  const char *const *lines;
+};
+
+struct timeout_queue {
+  scrape_req *head;
+  scrape_req *tail;
+};
+
+/** Rendered response body shared by all scrapes within the coalescing window. */
+struct scrape_snapshot {
+  // requests currently sending from this snapshot
+  unsigned refs;
+  // time when the collection pass started
+  struct timespec time;
+  bbuf *body;
+  // compressed copy of the body, if large enough to compress
+  bbuf *gzip_body;
+};
+
+/** Worker threads for running the collectors of a pass in parallel. */
+struct collect_pool {
+  pthread_t *threads;
+  unsigned nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  bool stop;
+  // collectors of the current pass: next to start, number finished, and total (0 between passes)
+  unsigned next;
+  unsigned finished;
+  unsigned total;
+  // output of each collector, written through its own request object
+  scrape_req *reqs;
+  bbuf **bufs;
+  // learned output size of each collector
+  size_t *buf_sizes;
 };
 
 struct scrape_req {
+  // worker serving the request
+  struct scrape_server *srv;
   enum req_state state;
-  union {
-    enum http_parse_state parse_state;
-    unsigned collector;
-  };
+  // index in the server's request table, and link in its free list
+  unsigned slot;
+  scrape_req *next_free;
+  enum http_parse_state parse_state;
+  bool keep_alive;
+  bool accept_gzip;
+  int socket;
+  // response body state
+  unsigned collector;
+  bool head_sent;
+  bool compress;
   bbuf *buf;
-  char *io;
-  size_t io_size;
+  // most collector output held in buf at once during the current response
+  size_t buf_peak;
+  bbuf *gzip_buf;
+  gzip_stream *gzip;
+  // unsent output of a chunk flushed in the middle of a collector, while the client catches up
+  bbuf *pending;
+  // buffer collector output is written to: either buf, or the body of a snapshot being collected
+  bbuf *out;
+  // scratch memory of the collector, allocated on first use and reset for every collector
+  arena *scratch;
+  // files shared by the collectors of the current pass, allocated on first use; for the requests
+  // of the collector pool, this points to the pass of the request that started the pass
+  struct scrape_pass *pass;
+  struct scrape_snapshot *snapshot;
+  // timestamp (in milliseconds since the epoch) attached to written samples, or 0 for none
+  long long timestamp;
+  // pending output
+  struct iovec iov[4];
+  struct iovec *iov_next;
+  int iov_count;
+  char head[HTTP_HEAD_SIZE];
+  char chunk_head[HTTP_CHUNK_HEAD_SIZE];
+  // received but not yet parsed input
+  char in[HTTP_IN_SIZE];
+  size_t in_pos;
+  size_t in_len;
+  // deadline, and links in the corresponding timeout queue
+  enum timeout_kind timeout_kind;
   struct timespec timeout;
+  scrape_req *timeout_prev;
+  scrape_req *timeout_next;
+};
+
+/** State shared by all the workers serving the same port. */
+struct scrape_shared {
+  struct scrape_config cfg;
+  // all workers, the first one running in the thread that called scrape_serve
+  struct scrape_server **workers;
+  unsigned nworkers;
+  pthread_t *worker_threads;
+  unsigned nworker_threads;
+  // written to by a worker whose event loop stops, to make all the others stop as well
+  int stop_pipe[2];
+  // connection statistics of all workers, also read by the collector threads
+  atomic_uint active_reqs;
+  atomic_ulong refused_reqs;
+  // collectors being served
+  unsigned ncoll;
+  const struct collector **coll;
+  void **coll_ctx;
+  // whether scrapes are served from snapshots rather than streamed from the collectors
+  bool use_snapshots;
+  // most recently collected snapshot, and the number of collection passes made so far
+  struct scrape_snapshot *snapshot;
+  struct scrape_snapshot *spare;
+  unsigned long passes;
+  // learned size of a snapshot body
+  size_t body_size;
+  // protects the snapshot and spare pointers, snapshot reference counts, passes and collect_stop
+  pthread_mutex_t snapshot_lock;
+  // held for the duration of a collection pass, so the collectors only ever run one pass at a time
+  pthread_mutex_t collect_lock;
+  gzip_stream *collect_gzip;
+  // background collection thread state
+  bool collect_running;
+  bool collect_stop;
+  pthread_t collect_thread;
+  pthread_cond_t collect_wake;
+  struct scrape_req collect_req;
+  // collector thread pool, if enabled
+  struct collect_pool *pool;
 };
 
+/** A worker, running an event loop on its own set of listening sockets. */
 struct scrape_server {
-  struct scrape_req reqs[MAX_REQUESTS];
-  struct pollfd fds[MAX_LISTEN_SOCKETS + MAX_REQUESTS];
-  nfds_t nfds_listen;
+  struct scrape_shared *shared;
+  struct scrape_config cfg;
+  int listen_fds[MAX_LISTEN_SOCKETS];
+  unsigned nlisten;
+  // connection pool: all allocated requests by slot, and the inactive ones in a LIFO free list
+  scrape_req **reqs;
+  unsigned nreqs;
+  unsigned reqs_size;
+  scrape_req *free_reqs;
+  // buffers and compressors released by closed connections
+  bbuf *buf_cache[BUF_CACHE_SIZE];
+  unsigned nbuf_cache;
+  // learned size of the buffer of a response streamed from the collectors
+  size_t buf_size;
+  gzip_stream *gzip_cache[GZIP_CACHE_SIZE];
+  unsigned ngzip_cache;
+  // active requests in order of increasing deadline, one queue per timeout kind
+  struct timeout_queue timeouts[max_timeout];
+  long timeout_millis[max_timeout];
+  // time as of the latest event loop wakeup
+  struct timespec now;
+#ifdef USE_EPOLL
+  int epoll_fd;
+#else
+  // listening sockets, the stop pipe, and then requests by slot
+  struct pollfd *fds;
   nfds_t nfds_req;
+#endif
 };
 
-static void req_start(struct scrape_server *srv, int socket);
-static void req_close(struct scrape_server *srv, unsigned r);
-static void req_process(struct scrape_server *srv, unsigned r, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
+static bool event_init(struct scrape_server *srv);
+static void event_resize(struct scrape_server *srv);
+static bool event_add(struct scrape_server *srv, scrape_req *req);
+static void event_del(struct scrape_server *srv, scrape_req *req);
+static void event_want_read(struct scrape_server *srv, scrape_req *req);
+static void event_want_write(struct scrape_server *srv, scrape_req *req);
+static bool event_dispatch(struct scrape_server *srv, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
+
+static const struct collector server_collector;
 
-static void timeout_start(scrape_req *req);
-static bool timeout_test(scrape_req *req);
-static int timeout_next_millis(scrape_req *reqs);
+static void req_accept(struct scrape_server *srv, int listen_fd);
+static void req_start(struct scrape_server *srv, int socket);
+static void req_close(struct scrape_server *srv, scrape_req *req);
+static scrape_req *req_alloc(struct scrape_server *srv);
+static void req_free(struct scrape_server *srv, scrape_req *req);
+static void req_collect(struct scrape_server *srv, scrape_req *req, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
+static void req_collect_snapshot(struct scrape_server *srv, scrape_req *req, bool gzip, unsigned ncoll);
+static bool req_read(struct scrape_server *srv, scrape_req *req);
+static bool req_write(struct scrape_server *srv, scrape_req *req);
+static void req_process(struct scrape_server *srv, scrape_req *req, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
+static bool req_queue_output(struct scrape_server *srv, scrape_req *req, bool last);
+static void req_queue_chunk(scrape_req *req, int iov, bbuf *out, bool last);
+static void req_flush(scrape_req *req);
+static bool req_send(scrape_req *req);
+static bool req_wait(struct scrape_server *srv, scrape_req *req);
+static void req_park(struct scrape_server *srv, scrape_req *req);
+static void req_advance(scrape_req *req, size_t wrote);
+
+static struct scrape_snapshot *snapshot_acquire(struct scrape_server *srv, scrape_req *req);
+static void snapshot_release(struct scrape_shared *sh, scrape_req *req);
+static void snapshot_collect(struct scrape_shared *sh, scrape_req *req, const struct timespec *now);
+static void snapshot_retire(struct scrape_shared *sh, struct scrape_snapshot *snap);
+static void snapshot_free(struct scrape_snapshot *snap);
+static long long timestamp_millis(void);
+
+static bool pool_start(struct scrape_shared *sh);
+static void pool_stop(struct scrape_shared *sh);
+static void pool_collect(struct scrape_shared *sh, bbuf *body, long long timestamp, struct scrape_pass *pass);
+static void *pool_main(void *arg);
+
+static bool collect_start(struct scrape_shared *sh);
+static void collect_stop(struct scrape_shared *sh);
+static void *collect_main(void *arg);
+
+static struct scrape_server *worker_alloc(struct scrape_shared *sh);
+static bool worker_bind(struct scrape_server *srv, struct addrinfo *addrs);
+static void worker_run(struct scrape_server *srv);
+static void *worker_main(void *arg);
+static void worker_free(struct scrape_server *srv);
+static struct scrape_shared *shared_alloc(const struct scrape_config *cfg);
+static void shared_set_collectors(struct scrape_shared *sh, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
+static void shared_free(struct scrape_shared *sh);
+
+static void buf_learn(struct scrape_server *srv, scrape_req *req);
+
+static struct scrape_pass *pass_alloc(void);
+static void pass_reset(struct scrape_pass *pass);
+static void pass_free(struct scrape_pass *pass);
+
+static bbuf *cache_get_buf(struct scrape_server *srv);
+static void cache_put_buf(struct scrape_server *srv, bbuf *buf);
+static gzip_stream *cache_get_gzip(struct scrape_server *srv);
+static void cache_put_gzip(struct scrape_server *srv, gzip_stream *z);
+
+static void timeout_clock(struct scrape_server *srv);
+static void timeout_start(struct scrape_server *srv, scrape_req *req, enum timeout_kind kind);
+static void timeout_stop(struct scrape_server *srv, scrape_req *req);
+static bool timeout_passed(struct scrape_server *srv, scrape_req *req);
+static void timeout_expire(struct scrape_server *srv);
+static int timeout_next_millis(struct scrape_server *srv);
 
 // TCP socket server
 
-scrape_server *scrape_listen(const char *port) {
-  scrape_server *srv = must_malloc(sizeof *srv);
+scrape_server *scrape_listen(const struct scrape_config *cfg) {
+  struct scrape_shared *sh = shared_alloc(cfg);
 
-  srv->nfds_listen = 0;
-  srv->nfds_req = 0;
-  for (unsigned i = 0; i < MAX_REQUESTS; i++) {
-    srv->reqs[i].state = req_state_inactive;
-    srv->reqs[i].buf = 0;
+#ifndef SO_REUSEPORT
+  if (cfg->workers > 1) {
+    fprintf(stderr, "SO_REUSEPORT is not supported, so only one worker can be used\n");
+    shared_free(sh);
+    return 0;
   }
+#endif
 
-  int ret;
+  if (cfg->workers > 1 && pipe(sh->stop_pipe) == -1) {
+    perror("pipe");
+    sh->stop_pipe[0] = sh->stop_pipe[1] = -1;
+    shared_free(sh);
+    return 0;
+  }
 
-  {
-    struct addrinfo hints = {
-      .ai_family = AF_UNSPEC,
-      .ai_socktype = SOCK_STREAM,
-      .ai_protocol = 0,
-      .ai_flags = AI_PASSIVE | AI_ADDRCONFIG,
-    };
-    struct addrinfo *addrs;
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_protocol = 0,
+    .ai_flags = AI_PASSIVE | AI_ADDRCONFIG,
+  };
+  struct addrinfo *addrs;
 
-    ret = getaddrinfo(0, port, &hints, &addrs);
-    if (ret != 0) {
-      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
-      return false;
+  int ret = getaddrinfo(0, cfg->port, &hints, &addrs);
+  if (ret != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+    shared_free(sh);
+    return 0;
+  }
+
+  while (sh->nworkers < cfg->workers) {
+    struct scrape_server *srv = worker_alloc(sh);
+    sh->workers[sh->nworkers++] = srv;
+    if (!worker_bind(srv, addrs)) {
+      fprintf(stderr, "failed to bind any sockets\n");
+      freeaddrinfo(addrs);
+      shared_free(sh);
+      return 0;
     }
+  }
 
-    for (struct addrinfo *a = addrs; a && srv->nfds_listen < MAX_LISTEN_SOCKETS; a = a->ai_next) {
-      int s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
-      if (s == -1) {
-        perror("socket");
-        continue;
-      }
+  freeaddrinfo(addrs);
+  return sh->workers[0];
+}
 
-      setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (int[]){1}, sizeof (int));
-#if defined(IPPROTO_IPV6) && defined(IPV6_V6ONLY) && defined(AF_INET6)
-      if (a->ai_family == AF_INET6)
-        setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (int[]){1}, sizeof (int));
-#endif
+void scrape_serve(scrape_server *srv, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
+  struct scrape_shared *sh = srv->shared;
 
-      ret = bind(s, a->ai_addr, a->ai_addrlen);
-      if (ret == -1) {
-        perror("bind");
-        close(s);
-        continue;
-      }
+  shared_set_collectors(sh, ncoll, coll, coll_ctx);
 
-      ret = listen(s, MAX_BACKLOG);
-      if (ret == -1) {
-        perror("listen");
-        close(s);
-        continue;
-      }
+  for (unsigned i = 0; i < sh->nworkers; i++)
+    if (!event_init(sh->workers[i]))
+      return;
 
-      srv->fds[srv->nfds_listen].fd = s;
-      srv->fds[srv->nfds_listen].events = POLLIN;
-      srv->nfds_listen++;
+  if (sh->cfg.collector_threads > 1 && !pool_start(sh))
+    return;
+
+  if (sh->cfg.collect_interval_ms > 0) {
+    scrape_req *req = &sh->collect_req;
+    req->state = req_state_write_metrics;
+    req->buf = 0;
+    req->snapshot = 0;
+    if (!collect_start(sh))
+      return;
+  }
+
+  // all workers but the first run on threads of their own
+  sh->worker_threads = must_malloc((sh->nworkers - 1) * sizeof *sh->worker_threads);
+  while (sh->nworker_threads < sh->nworkers - 1) {
+    struct scrape_server *worker = sh->workers[sh->nworker_threads + 1];
+    int ret = pthread_create(&sh->worker_threads[sh->nworker_threads], 0, worker_main, worker);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+      return;
     }
+    sh->nworker_threads++;
   }
 
-  if (srv->nfds_listen == 0) {
-    fprintf(stderr, "failed to bind any sockets\n");
-    return 0;
+  worker_run(srv);
+}
+
+void scrape_close(scrape_server *srv) {
+  struct scrape_shared *sh = srv->shared;
+
+  if (sh->nworker_threads > 0) {
+    if (write(sh->stop_pipe[1], "", 1) == -1)
+      perror("write");
+    for (unsigned t = 0; t < sh->nworker_threads; t++)
+      pthread_join(sh->worker_threads[t], 0);
   }
+  collect_stop(sh);
+  pool_stop(sh);
+  shared_free(sh);
+}
+
+// workers
+
+// With more than one worker, each worker binds its own listening sockets to the same port using
+// SO_REUSEPORT, so the kernel spreads incoming connections over them, and runs its own event loop
+// on a separate thread. The collectors are only run for the shared snapshots, one pass at a time,
+// so their contexts are never touched by more than one worker at once.
+
+static struct scrape_server *worker_alloc(struct scrape_shared *sh) {
+  struct scrape_server *srv = must_malloc(sizeof *srv);
+
+  srv->shared = sh;
+  srv->cfg = sh->cfg;
+  srv->nlisten = 0;
+  for (unsigned i = 0; i < max_timeout; i++)
+    srv->timeouts[i].head = srv->timeouts[i].tail = 0;
+  srv->timeout_millis[timeout_header] = sh->cfg.header_timeout_ms;
+  srv->timeout_millis[timeout_response] = sh->cfg.response_timeout_ms;
+  srv->timeout_millis[timeout_idle] = sh->cfg.idle_timeout_ms;
+  srv->reqs = 0;
+  srv->nreqs = srv->reqs_size = 0;
+  srv->free_reqs = 0;
+  srv->nbuf_cache = srv->ngzip_cache = 0;
+  srv->buf_size = BUF_INITIAL;
+#ifdef USE_EPOLL
+  srv->epoll_fd = -1;
+#else
+  srv->fds = 0;
+#endif
 
   return srv;
 }
 
-void scrape_serve(scrape_server *srv, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
-  int ret;
+/** Opens the listening sockets of a worker. Returns `false` if none could be bound. */
+static bool worker_bind(struct scrape_server *srv, struct addrinfo *addrs) {
+  for (struct addrinfo *a = addrs; a && srv->nlisten < MAX_LISTEN_SOCKETS; a = a->ai_next) {
+    int s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (s == -1) {
+      perror("socket");
+      continue;
+    }
 
-  while (1) {
-    ret = poll(srv->fds, srv->nfds_listen + srv->nfds_req, timeout_next_millis(srv->reqs));
-    if (ret == -1) {
-      perror("poll");
-      break;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (int[]){1}, sizeof (int));
+#ifdef SO_REUSEPORT
+    if (srv->cfg.workers > 1 && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (int[]){1}, sizeof (int)) == -1) {
+      perror("setsockopt(SO_REUSEPORT)");
+      close(s);
+      continue;
     }
+#endif
+#if defined(IPPROTO_IPV6) && defined(IPV6_V6ONLY) && defined(AF_INET6)
+    if (a->ai_family == AF_INET6)
+      setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (int[]){1}, sizeof (int));
+#endif
 
-    // handle incoming connections
+    if (bind(s, a->ai_addr, a->ai_addrlen) == -1) {
+      perror("bind");
+      close(s);
+      continue;
+    }
 
-    for (nfds_t i = 0; i < srv->nfds_listen; i++) {
-      if (srv->fds[i].revents == 0)
-        continue;
-      if (srv->fds[i].revents != POLLIN) {
-        fprintf(stderr, "poll .revents = %d\n", srv->fds[i].revents);
-        return;
-      }
+    if (listen(s, MAX_BACKLOG) == -1) {
+      perror("listen");
+      close(s);
+      continue;
+    }
 
-      int s = accept(srv->fds[i].fd, 0, 0);
-      if (s == -1) {
-        perror("accept");
-        continue;
-      }
+    srv->listen_fds[srv->nlisten++] = s;
+  }
+
+  return srv->nlisten > 0;
+}
+
+/** Runs the event loop of a worker until it fails, or the loop of another worker has stopped. */
+static void worker_run(struct scrape_server *srv) {
+  struct scrape_shared *sh = srv->shared;
+
+  timeout_clock(srv);
+  while (event_dispatch(srv, sh->ncoll, sh->coll, sh->coll_ctx))
+    timeout_expire(srv);
+
+  // the pipe is never read from, so it stays readable for all the other workers
+  if (sh->stop_pipe[1] != -1 && write(sh->stop_pipe[1], "", 1) == -1)
+    perror("write");
+}
+
+static void *worker_main(void *arg) {
+  worker_run(arg);
+  return 0;
+}
+
+static void worker_free(struct scrape_server *srv) {
+  for (unsigned i = 0; i < srv->nlisten; i++)
+    close(srv->listen_fds[i]);
+  for (unsigned r = 0; r < srv->nreqs; r++) {
+    if (srv->reqs[r]->state != req_state_inactive)
+      req_close(srv, srv->reqs[r]);
+    if (srv->reqs[r]->scratch)
+      arena_free(srv->reqs[r]->scratch);
+    if (srv->reqs[r]->pass)
+      pass_free(srv->reqs[r]->pass);
+    free(srv->reqs[r]);
+  }
+  free(srv->reqs);
+  for (unsigned i = 0; i < srv->nbuf_cache; i++)
+    bbuf_free(srv->buf_cache[i]);
+  for (unsigned i = 0; i < srv->ngzip_cache; i++)
+    gzip_free(srv->gzip_cache[i]);
+#ifdef USE_EPOLL
+  if (srv->epoll_fd != -1)
+    close(srv->epoll_fd);
+#else
+  free(srv->fds);
+#endif
+  free(srv);
+}
+
+/** Allocates the state shared by all workers, with no workers yet. */
+static struct scrape_shared *shared_alloc(const struct scrape_config *cfg) {
+  struct scrape_shared *sh = must_malloc(sizeof *sh);
+
+  sh->cfg = *cfg;
+  sh->workers = must_malloc(cfg->workers * sizeof *sh->workers);
+  sh->nworkers = 0;
+  sh->worker_threads = 0;
+  sh->nworker_threads = 0;
+  sh->stop_pipe[0] = sh->stop_pipe[1] = -1;
+  atomic_init(&sh->active_reqs, 0);
+  atomic_init(&sh->refused_reqs, 0);
+  sh->ncoll = 0;
+  sh->coll = 0;
+  sh->coll_ctx = 0;
+  // collectors can't run concurrently with themselves, so several workers must share snapshots
+  sh->use_snapshots = cfg->coalesce_ms > 0 || cfg->collect_interval_ms > 0 || cfg->collector_threads > 1 || cfg->workers > 1;
+  sh->snapshot = 0;
+  sh->spare = 0;
+  sh->passes = 0;
+  sh->body_size = BUF_INITIAL;
+  pthread_mutex_init(&sh->snapshot_lock, 0);
+  pthread_mutex_init(&sh->collect_lock, 0);
+  sh->collect_gzip = 0;
+  sh->collect_running = false;
+  sh->collect_req.scratch = 0;
+  sh->collect_req.pass = 0;
+  sh->pool = 0;
+  return sh;
+}
 
-      req_start(srv, s);
+/** Sets the collectors to run for scrapes. */
+static void shared_set_collectors(struct scrape_shared *sh, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
+  // the server's own metrics are written by an extra collector, after all the others
+  sh->ncoll = ncoll + 1;
+  sh->coll = must_malloc(sh->ncoll * sizeof *sh->coll);
+  sh->coll_ctx = must_malloc(sh->ncoll * sizeof *sh->coll_ctx);
+  for (unsigned c = 0; c < ncoll; c++) {
+    sh->coll[c] = coll[c];
+    sh->coll_ctx[c] = coll_ctx[c];
+  }
+  sh->coll[ncoll] = &server_collector;
+  sh->coll_ctx[ncoll] = sh;
+}
+
+/** Frees the workers and all shared state. Any threads must have been stopped already. */
+static void shared_free(struct scrape_shared *sh) {
+  for (unsigned i = 0; i < sh->nworkers; i++)
+    worker_free(sh->workers[i]);
+  free(sh->workers);
+  free(sh->worker_threads);
+  free(sh->coll);
+  free(sh->coll_ctx);
+  if (sh->snapshot)
+    snapshot_free(sh->snapshot);
+  if (sh->spare)
+    snapshot_free(sh->spare);
+  if (sh->collect_gzip)
+    gzip_free(sh->collect_gzip);
+  if (sh->collect_req.scratch)
+    arena_free(sh->collect_req.scratch);
+  if (sh->collect_req.pass)
+    pass_free(sh->collect_req.pass);
+  pthread_mutex_destroy(&sh->collect_lock);
+  pthread_mutex_destroy(&sh->snapshot_lock);
+  if (sh->stop_pipe[0] != -1) {
+    close(sh->stop_pipe[0]);
+    close(sh->stop_pipe[1]);
+  }
+  free(sh);
+}
+
+// event loop: epoll backend
+
+#ifdef USE_EPOLL
+
+static bool event_init(struct scrape_server *srv) {
+  srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (srv->epoll_fd == -1) {
+    perror("epoll_create1");
+    return false;
+  }
+
+  // listening sockets are level-triggered, and marked by a pointer into the listen_fds array
+  for (unsigned i = 0; i < srv->nlisten; i++) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &srv->listen_fds[i] };
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fds[i], &ev) == -1) {
+      perror("epoll_ctl");
+      return false;
     }
+  }
 
-    // handle ongoing requests
+  int stop_fd = srv->shared->stop_pipe[0];
+  if (stop_fd != -1) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &srv->shared->stop_pipe[0] };
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) == -1) {
+      perror("epoll_ctl");
+      return false;
+    }
+  }
 
-    for (nfds_t i = srv->nfds_listen; i < srv->nfds_listen + srv->nfds_req; i++) {
-      unsigned r = i - srv->nfds_listen;
+  return true;
+}
 
-      if (timeout_test(&srv->reqs[r])) {
-        req_close(srv, r);
-        continue;
-      }
+static bool event_add(struct scrape_server *srv, scrape_req *req) {
+  // requests are edge-triggered: req_process always reads or writes until EAGAIN
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = req };
+  if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, req->socket, &ev) == -1) {
+    perror("epoll_ctl");
+    return false;
+  }
+  return true;
+}
 
-      if (srv->fds[i].fd < 0 || srv->fds[i].revents == 0)
-        continue;
+static void event_resize(struct scrape_server *srv) {
+  (void) srv;  // the epoll set has no per-request storage
+}
+
+static void event_del(struct scrape_server *srv, scrape_req *req) {
+  (void) srv; (void) req;  // closing the socket removes it from the epoll set
+}
+
+static void event_want_read(struct scrape_server *srv, scrape_req *req) {
+  (void) srv; (void) req;  // always registered for EPOLLIN
+}
+
+static void event_want_write(struct scrape_server *srv, scrape_req *req) {
+  (void) srv; (void) req;  // always registered for EPOLLOUT
+}
+
+static bool event_dispatch(struct scrape_server *srv, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
+  struct epoll_event events[MAX_EVENTS];
 
-      if ((srv->fds[i].revents & ~(POLLIN | POLLOUT)) != 0)
-        req_close(srv, r);
-      else
-        req_process(srv, r, ncoll, coll, coll_ctx);
+  int n = epoll_wait(srv->epoll_fd, events, MAX_EVENTS, timeout_next_millis(srv));
+  if (n == -1 && errno != EINTR) {
+    perror("epoll_wait");
+    return false;
+  }
+  timeout_clock(srv);
+
+  for (int i = 0; i < n; i++) {
+    void *ptr = events[i].data.ptr;
+
+    if (ptr == &srv->shared->stop_pipe[0])
+      return false;  // another worker stopped
+
+    if ((int *) ptr >= srv->listen_fds && (int *) ptr < srv->listen_fds + srv->nlisten) {
+      if (events[i].events != EPOLLIN) {
+        fprintf(stderr, "epoll .events = %u\n", (unsigned) events[i].events);
+        return false;
+      }
+      req_accept(srv, *(int *) ptr);
+      continue;
     }
+
+    scrape_req *req = ptr;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      req_close(srv, req);
+    else
+      req_process(srv, req, ncoll, coll, coll_ctx);
   }
+
+  return true;
 }
 
-void scrape_close(scrape_server *srv) {
-  for (nfds_t i = 0; i < srv->nfds_listen; i++)
-    close(srv->fds[i].fd);
-  for (unsigned r = 0; r < MAX_REQUESTS; r++)
-    if (srv->reqs[r].state != req_state_inactive)
-      req_close(srv, r);
-  if (srv->reqs[0].buf)
-    bbuf_free(srv->reqs[0].buf);
-  free(srv);
+#else // USE_EPOLL
+
+// event loop: poll backend
+
+static bool event_init(struct scrape_server *srv) {
+  srv->fds = must_malloc((srv->nlisten + 1) * sizeof *srv->fds);
+  for (unsigned i = 0; i < srv->nlisten; i++) {
+    srv->fds[i].fd = srv->listen_fds[i];
+    srv->fds[i].events = POLLIN;
+  }
+  // without other workers, there is no stop pipe, and the entry is ignored
+  srv->fds[srv->nlisten].fd = srv->shared->stop_pipe[0];
+  srv->fds[srv->nlisten].events = POLLIN;
+  srv->nfds_req = 0;
+  return true;
+}
+
+/** Returns the poll entry of request slot \p r, after the listening sockets and the stop pipe. */
+static struct pollfd *event_req_fd(struct scrape_server *srv, unsigned r) {
+  return &srv->fds[srv->nlisten + 1 + r];
+}
+
+static void event_resize(struct scrape_server *srv) {
+  srv->fds = must_realloc(srv->fds, (srv->nlisten + 1 + srv->reqs_size) * sizeof *srv->fds);
+}
+
+static bool event_add(struct scrape_server *srv, scrape_req *req) {
+  nfds_t r = req->slot;
+  if (r >= srv->nfds_req)
+    srv->nfds_req = r + 1;
+
+  struct pollfd *pfd = event_req_fd(srv, r);
+  pfd->fd = req->socket;
+  pfd->events = POLLIN;
+  pfd->revents = POLLIN;  // pretend, to do the first read immediately
+  return true;
+}
+
+static void event_del(struct scrape_server *srv, scrape_req *req) {
+  event_req_fd(srv, req->slot)->fd = -1;
+  while (srv->nfds_req > 0 && event_req_fd(srv, srv->nfds_req - 1)->fd < 0)
+    srv->nfds_req--;
+}
+
+static void event_want_read(struct scrape_server *srv, scrape_req *req) {
+  event_req_fd(srv, req->slot)->events = POLLIN;
+}
+
+static void event_want_write(struct scrape_server *srv, scrape_req *req) {
+  event_req_fd(srv, req->slot)->events = POLLOUT;
+}
+
+static bool event_dispatch(struct scrape_server *srv, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
+  int ret = poll(srv->fds, srv->nlisten + 1 + srv->nfds_req, timeout_next_millis(srv));
+  if (ret == -1 && errno != EINTR) {
+    perror("poll");
+    return false;
+  }
+  timeout_clock(srv);
+  if (ret == -1)
+    return true;
+
+  // handle incoming connections
+
+  for (nfds_t i = 0; i < srv->nlisten; i++) {
+    if (srv->fds[i].revents == 0)
+      continue;
+    if (srv->fds[i].revents != POLLIN) {
+      fprintf(stderr, "poll .revents = %d\n", srv->fds[i].revents);
+      return false;
+    }
+    req_accept(srv, srv->fds[i].fd);
+  }
+
+  if (srv->fds[srv->nlisten].revents != 0)
+    return false;  // another worker stopped
+
+  // handle ongoing requests
+
+  for (nfds_t r = 0; r < srv->nfds_req; r++) {
+    scrape_req *req = srv->reqs[r];
+    struct pollfd *pfd = event_req_fd(srv, r);
+
+    if (pfd->fd < 0 || pfd->revents == 0)
+      continue;
+
+    if ((pfd->revents & ~(POLLIN | POLLOUT)) != 0)
+      req_close(srv, req);
+    else
+      req_process(srv, req, ncoll, coll, coll_ctx);
+  }
+
+  return true;
 }
 
+#endif // USE_EPOLL
+
 // scrape write API implementation
 
-void scrape_write(scrape_req *req, const char *metric, const struct label *labels, double value) {
+/**
+ * Returns `true` if output can be written to \p req, first sending what has been buffered if
+ * there is enough of it.
+ */
+static bool scrape_writable(scrape_req *req) {
   if (req->state != req_state_write_metrics)
-    return;
+    return false;
+  if (req->out == req->buf && bbuf_len(req->buf) >= BUF_MAX)
+    req_flush(req);
+  return req->state == req_state_write_metrics;
+}
 
-  bbuf_puts(req->buf, metric);
+/** Starts a sample written to \p req with the series name: the metric, and its labels if any. */
+static void write_series(scrape_req *req, const char *metric, const struct label *labels) {
+  bbuf_puts(req->out, metric);
 
   if (labels && labels->key) {
-    bbuf_putc(req->buf, '{');
+    bbuf_putc(req->out, '{');
     for (const struct label *l = labels; l->key; l++) {
       if (l != labels)
-        bbuf_putc(req->buf, ',');
-      bbuf_putf(req->buf, "%s=\"%s\"", l->key, l->value);
+        bbuf_putc(req->out, ',');
+      bbuf_put_label(req->out, l->key, l->value);
     }
-    bbuf_putc(req->buf, '}');
+    bbuf_putc(req->out, '}');
+  }
+}
+
+/** Ends the sample being written to \p req with its timestamp, if any, and a newline. */
+static void write_timestamp(scrape_req *req) {
+  if (req->timestamp) {
+    bbuf_putc(req->out, ' ');
+    bbuf_put_i64(req->out, req->timestamp);
   }
+  bbuf_putc(req->out, '\n');
+}
+
+void scrape_write(scrape_req *req, const char *metric, const struct label *labels, double value) {
+  if (!scrape_writable(req))
+    return;
 
-  bbuf_putf(req->buf, " %.16g\n", value);
+  write_series(req, metric, labels);
+  bbuf_putc(req->out, ' ');
+  bbuf_put_double(req->out, value);
+  write_timestamp(req);
+}
+
+void scrape_write_u64(scrape_req *req, const char *metric, const struct label *labels, uint64_t value) {
+  if (!scrape_writable(req))
+    return;
+
+  write_series(req, metric, labels);
+  bbuf_putc(req->out, ' ');
+  bbuf_put_u64(req->out, value);
+  write_timestamp(req);
 }
 
 void scrape_write_raw(scrape_req *req, const void *buf, size_t len) {
-  bbuf_put(req->buf, buf, len);
+  if (!scrape_writable(req))
+    return;
+  bbuf_put(req->out, buf, len);
+}
+
+void scrape_write_meta(scrape_req *req, const struct metric_meta *meta) {
+  scrape_write_raw(req, meta->text, meta->len);
+}
+
+arena *scrape_arena(scrape_req *req) {
+  if (!req->scratch)
+    req->scratch = arena_alloc(SCRATCH_INITIAL);
+  return req->scratch;
+}
+
+const char *const *scrape_read_lines(scrape_req *req, pfile *f) {
+  if (!req->pass)
+    req->pass = pass_alloc();
+  struct scrape_pass *pass = req->pass;
+  const char *path = pfile_path(f);
+
+  pthread_mutex_lock(&pass->lock);
+  struct pass_file *file;
+  for (file = pass->files; file; file = file->next)
+    if (strcmp(file->path, path) == 0)
+      break;
+  if (!file) {
+    file = arena_get(pass->mem, sizeof *file);
+    file->path = path;
+    char *data = pfile_read(f, pass->mem, 0);
+    file->lines = data ? (const char *const *) arena_split_lines(pass->mem, data) : 0;
+    file->next = pass->files;
+    pass->files = file;
+  }
+  pthread_mutex_unlock(&pass->lock);
+
+  return file->lines;
+}
+
+static struct scrape_pass *pass_alloc(void) {
+  struct scrape_pass *pass = must_malloc(sizeof *pass);
+  pthread_mutex_init(&pass->lock, 0);
+  pass->mem = arena_alloc(PASS_INITIAL);
+  pass->files = 0;
+  return pass;
+}
+
+/** Forgets the files read during the previous pass, so that they are read again. */
+static void pass_reset(struct scrape_pass *pass) {
+  arena_reset(pass->mem);
+  pass->files = 0;
+}
+
+static void pass_free(struct scrape_pass *pass) {
+  arena_free(pass->mem);
+  pthread_mutex_destroy(&pass->lock);
+  free(pass);
+}
+
+/** Runs the collector \p coll with context \p ctx, writing its output through \p req. */
+static void collect_run(scrape_req *req, const struct collector *coll, void *ctx) {
+  if (req->scratch)
+    arena_reset(req->scratch);
+  coll->collect(req, ctx);
+}
+
+// server metrics
+
+static const struct metric_meta server_connections_meta = METRIC_META(
+    "nano_exporter_connections", "gauge", "Number of currently open scrape connections.");
+static const struct metric_meta server_refused_meta = METRIC_META(
+    "nano_exporter_connections_refused_total", "counter",
+    "Total number of scrape connections refused for being over the limit.");
+
+static void server_collect(scrape_req *req, void *ctx) {
+  struct scrape_shared *sh = ctx;
+  scrape_write_meta(req, &server_connections_meta);
+  scrape_write(req, server_connections_meta.name, 0, atomic_load_explicit(&sh->active_reqs, memory_order_relaxed));
+  scrape_write_meta(req, &server_refused_meta);
+  scrape_write(req, server_refused_meta.name, 0, atomic_load_explicit(&sh->refused_reqs, memory_order_relaxed));
 }
 
+static const struct collector server_collector = {
+  .name = "server",
+  .collect = server_collect,
+};
+
 // request state management
 
+static void req_accept(struct scrape_server *srv, int listen_fd) {
+  int s = accept(listen_fd, 0, 0);
+  if (s == -1) {
+    perror("accept");
+    return;
+  }
+  req_start(srv, s);
+}
+
 static void req_start(struct scrape_server *srv, int s) {
   int flags = fcntl(s, F_GETFL);
   if (flags == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
@@ -253,47 +984,195 @@ static void req_start(struct scrape_server *srv, int s) {
     return;
   }
 
-  unsigned r = 0;
-  while (r < MAX_REQUESTS && srv->reqs[r].state != req_state_inactive)
-    r++;
-  if (r == MAX_REQUESTS) {
+  // the connection limit applies to all workers together
+  struct scrape_shared *sh = srv->shared;
+  scrape_req *req = 0;
+  if (atomic_fetch_add_explicit(&sh->active_reqs, 1, memory_order_relaxed) < srv->cfg.max_connections)
+    req = req_alloc(srv);
+  if (!req) {
+    atomic_fetch_sub_explicit(&sh->active_reqs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&sh->refused_reqs, 1, memory_order_relaxed);
     close(s);
     return;
   }
 
-  if (r >= srv->nfds_req)
-    srv->nfds_req = r + 1;
-
-  scrape_req *req = &srv->reqs[r];
-  struct pollfd *pfd = &srv->fds[srv->nfds_listen + r];
+  req->socket = s;
+  if (!event_add(srv, req)) {
+    req_free(srv, req);
+    atomic_fetch_sub_explicit(&sh->active_reqs, 1, memory_order_relaxed);
+    close(s);
+    return;
+  }
 
   req->state = req_state_read;
   req->parse_state = http_read_start;
-  if (!req->buf)
-    req->buf = bbuf_alloc(BUF_INITIAL, BUF_MAX);
-  timeout_start(req);
+  req->keep_alive = true;
+  req->accept_gzip = false;
+  req->in_pos = req->in_len = 0;
+  req->buf = cache_get_buf(srv);
+  req->buf_peak = 0;
+  req->gzip_buf = 0;
+  req->gzip = 0;
+  req->pending = 0;
+  req->out = req->buf;
+  req->snapshot = 0;
+  timeout_start(srv, req, timeout_header);
+}
 
-  pfd->fd = s;
-  pfd->events = POLLIN;
-  pfd->revents = POLLIN;  // pretend, to do the first read immediately
+static void req_close(struct scrape_server *srv, scrape_req *req) {
+  req->state = req_state_inactive;
+  snapshot_release(srv->shared, req);
+  buf_learn(srv, req);
+  cache_put_buf(srv, req->buf);
+  if (req->gzip_buf)
+    cache_put_buf(srv, req->gzip_buf);
+  if (req->pending)
+    cache_put_buf(srv, req->pending);
+  if (req->gzip)
+    cache_put_gzip(srv, req->gzip);
+
+  timeout_stop(srv, req);
+  event_del(srv, req);
+  close(req->socket);
+  req_free(srv, req);
+  atomic_fetch_sub_explicit(&srv->shared->active_reqs, 1, memory_order_relaxed);
 }
 
-static void req_close(struct scrape_server *srv, unsigned r) {
-  srv->reqs[r].state = req_state_inactive;
-  if (r == 0) {
-    // keep the reqs[0] buffer for reuse
-    bbuf_reset(srv->reqs[0].buf);
+/** Takes a request from the free list, or grows the pool, unless at the connection limit. */
+static scrape_req *req_alloc(struct scrape_server *srv) {
+  scrape_req *req = srv->free_reqs;
+  if (req) {
+    srv->free_reqs = req->next_free;
+    return req;
+  }
+
+  if (srv->nreqs >= srv->cfg.max_connections)
+    return 0;
+
+  if (srv->nreqs == srv->reqs_size) {
+    srv->reqs_size = srv->reqs_size ? 2 * srv->reqs_size : 16;
+    if (srv->reqs_size > srv->cfg.max_connections)
+      srv->reqs_size = srv->cfg.max_connections;
+    srv->reqs = must_realloc(srv->reqs, srv->reqs_size * sizeof *srv->reqs);
+    event_resize(srv);
+  }
+
+  req = must_malloc(sizeof *req);
+  req->srv = srv;
+  req->state = req_state_inactive;
+  req->slot = srv->nreqs;
+  req->snapshot = 0;
+  req->scratch = 0;
+  req->pass = 0;
+  req->timeout_kind = max_timeout;
+  srv->reqs[srv->nreqs++] = req;
+  return req;
+}
+
+static void req_free(struct scrape_server *srv, scrape_req *req) {
+  req->next_free = srv->free_reqs;
+  srv->free_reqs = req;
+}
+
+// buffer sizing
+
+// Output buffers are resized ahead of each use to the size their contents have needed recently,
+// so they don't go through a series of reallocations while being filled. The learned size jumps up
+// to any larger size seen, and decays slowly when the output shrinks, so that the memory of a
+// one-off large scrape is eventually released.
+
+/** Returns the learned buffer size \p size updated with \p used bytes having been needed. */
+static size_t size_learn(size_t size, size_t used) {
+  if (used >= size)
+    return used;
+  size -= (size - used) / 8;
+  return size > BUF_INITIAL ? size : BUF_INITIAL;
+}
+
+/** Learns the buffer size needed by the response just finished on \p req, if it was streamed. */
+static void buf_learn(struct scrape_server *srv, scrape_req *req) {
+  if (req->buf_peak == 0)
+    return;
+  srv->buf_size = size_learn(srv->buf_size, req->buf_peak);
+  req->buf_peak = 0;
+}
+
+// buffer cache
+
+static bbuf *cache_get_buf(struct scrape_server *srv) {
+  if (srv->nbuf_cache > 0)
+    return srv->buf_cache[--srv->nbuf_cache];
+  // collector output is flushed at BUF_MAX, and held back for a slow client only up to
+  // BUF_PARK_MAX, so the size is bounded even without a limit
+  return bbuf_alloc(BUF_INITIAL, SIZE_MAX);
+}
+
+static void cache_put_buf(struct scrape_server *srv, bbuf *buf) {
+  if (srv->nbuf_cache < BUF_CACHE_SIZE) {
+    bbuf_reset(buf);
+    srv->buf_cache[srv->nbuf_cache++] = buf;
   } else {
-    bbuf_free(srv->reqs[r].buf);
-    srv->reqs[r].buf = 0;
+    bbuf_free(buf);
+  }
+}
+
+static gzip_stream *cache_get_gzip(struct scrape_server *srv) {
+  if (srv->ngzip_cache > 0)
+    return srv->gzip_cache[--srv->ngzip_cache];
+  return gzip_alloc(srv->cfg.gzip_level);
+}
+
+static void cache_put_gzip(struct scrape_server *srv, gzip_stream *z) {
+  if (srv->ngzip_cache < GZIP_CACHE_SIZE)
+    srv->gzip_cache[srv->ngzip_cache++] = z;
+  else
+    gzip_free(z);
+}
+
+static bool req_read(struct scrape_server *srv, scrape_req *req) {
+  ssize_t got = read(req->socket, req->in, sizeof req->in);
+
+  if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return false;  // try again after polling
+  if (got <= 0) {
+    req_close(srv, req);
+    return false;
   }
 
-  nfds_t n = srv->nfds_listen + r;
-  close(srv->fds[n].fd);
+  req->in_pos = 0;
+  req->in_len = got;
 
-  srv->fds[n].fd = -1;
-  while (srv->nfds_req > 0 && srv->fds[srv->nfds_listen + srv->nfds_req - 1].fd < 0)
-    srv->nfds_req--;
+  if (req->timeout_kind == timeout_idle)
+    timeout_start(srv, req, timeout_header);  // next request on a persistent connection started
+  return true;
+}
+
+static bool req_write(struct scrape_server *srv, scrape_req *req) {
+  while (req->iov_count > 0) {
+    ssize_t wrote = writev(req->socket, req->iov_next, req->iov_count);
+
+    if (wrote == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return false;  // try again after polling
+    if (wrote <= 0) {
+      req_close(srv, req);
+      return false;
+    }
+    req_advance(req, wrote);
+  }
+  return true;
+}
+
+/** Removes \p wrote bytes from the start of the pending output. */
+static void req_advance(scrape_req *req, size_t wrote) {
+  while (req->iov_count > 0 && wrote >= req->iov_next->iov_len) {
+    wrote -= req->iov_next->iov_len;
+    req->iov_next++;
+    req->iov_count--;
+  }
+  if (wrote > 0) {
+    req->iov_next->iov_base = (char *) req->iov_next->iov_base + wrote;
+    req->iov_next->iov_len -= wrote;
+  }
 }
 
 enum http_parse_result {
@@ -302,15 +1181,26 @@ enum http_parse_result {
   http_parse_invalid,
 };
 
-static enum http_parse_result http_parse(int socket, enum http_parse_state *state, bbuf *buf);
+static enum http_parse_result http_parse(scrape_req *req);
 
 static const char http_success[] =
     "HTTP/1.1 200 OK\r\n"
     "Server: nano-exporter\r\n"
     "Content-Type: text/plain; charset=UTF-8\r\n"
-    "Connection: close\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "%s"
+    "%s"
     "\r\n"
     ;
+static const char http_gzip[] =
+    "Content-Encoding: gzip\r\n"
+    ;
+static const char http_close[] =
+    "Connection: close\r\n"
+    ;
+static const char http_chunk_end[] = "\r\n";
+static const char http_chunk_end_last[] = "\r\n0\r\n\r\n";
+static const char http_chunk_last[] = "0\r\n\r\n";
 static const char http_error[] =
     "HTTP/1.1 400 Bad Request\r\n"
     "Server: nano-exporter\r\n"
@@ -320,122 +1210,744 @@ static const char http_error[] =
     "This is not a general-purpose HTTP server.\r\n"
     ;
 
-static void req_process(struct scrape_server *srv, unsigned r, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
-  scrape_req *req = &srv->reqs[r];
-  struct pollfd *pfd = &srv->fds[srv->nfds_listen + r];
-
+static void req_process(struct scrape_server *srv, scrape_req *req, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
   if (req->state == req_state_inactive)
     return;
 
-  if (req->state == req_state_read) {
-    enum http_parse_result ret = http_parse(pfd->fd, &req->parse_state, req->buf);
+  while (true) {
+    if (req->state == req_state_read) {
+      enum http_parse_result ret = http_parse(req);
 
-    if (ret == http_parse_incomplete)
-      return;  // try again after polling
+      if (ret == http_parse_incomplete) {
+        if (!req_read(srv, req))
+          return;  // try again after polling, or closed
+        continue;
+      }
 
-    if (ret == http_parse_valid) {
-      req->state = req_state_write_headers;
-      req->io = (char *) http_success;
-      req->io_size = sizeof http_success - 1;
-    } else {
-      req->state = req_state_write_error;
-      req->io = (char *) http_error;
-      req->io_size = sizeof http_error - 1;
+      if (ret == http_parse_valid) {
+        req->state = req_state_write_metrics;
+        req->collector = 0;
+        req->head_sent = false;
+        req->compress = false;
+        req->iov_count = 0;
+        req->timestamp = srv->cfg.timestamps ? timestamp_millis() : 0;
+        if (!srv->shared->use_snapshots)
+          bbuf_fit(req->buf, srv->buf_size);
+        if (req->pass)
+          pass_reset(req->pass);
+      } else {
+        req->state = req_state_write_error;
+        req->iov[0] = (struct iovec){ .iov_base = (char *) http_error, .iov_len = sizeof http_error - 1 };
+        req->iov_next = req->iov;
+        req->iov_count = 1;
+      }
+
+      timeout_start(srv, req, timeout_response);
+      event_want_write(srv, req);
     }
 
-    pfd->events = POLLOUT;
-  }
+    if (!req_write(srv, req))
+      return;  // try again after polling, or closed
 
-rewrite:
-  while (req->io_size > 0) {
-    ssize_t wrote = write(pfd->fd, req->io, req->io_size);
+    if (req->state == req_state_write_metrics && !(req->head_sent && req->collector == ncoll)) {
+      req_collect(srv, req, ncoll, coll, coll_ctx);
+      continue;
+    }
 
-    if (wrote == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-      return;  // try again after polling
-    if (wrote <= 0) {
-      req_close(srv, r);
+    if (req->state == req_state_write_error || !req->keep_alive) {
+      req_close(srv, req);
       return;
     }
 
-    req->io += wrote;
-    req->io_size -= wrote;
+    // wait for the next request on the persistent connection, which may already be buffered
+
+    req->state = req_state_read;
+    req->parse_state = http_read_start;
+    req->accept_gzip = false;
+    buf_learn(srv, req);
+    bbuf_reset(req->buf);
+    snapshot_release(srv->shared, req);
+    timeout_start(srv, req, req->in_pos < req->in_len ? timeout_header : timeout_idle);
+    event_want_read(srv, req);
   }
+}
+
+static void req_collect(struct scrape_server *srv, scrape_req *req, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
+  bool gzip = req->accept_gzip && srv->cfg.gzip_level > 0;
 
-  if (req->state == req_state_write_error) {
-    req_close(srv, r);
+  if (srv->shared->use_snapshots) {
+    req_collect_snapshot(srv, req, gzip, ncoll);
     return;
   }
 
-  if (req->state == req_state_write_headers) {
-    req->state = req_state_write_metrics;
-    req->collector = 0;
+  // the previous chunk has been written
+
+  if (req->head_sent) {
+    bbuf_reset(req->buf);
+    if (req->compress)
+      bbuf_reset(req->gzip_buf);
+  }
+
+  // run collectors until there is a chunk to send, or the response is complete
+
+  while (true) {
+    if (req->collector < ncoll) {
+      collect_run(req, coll[req->collector], coll_ctx[req->collector]);
+      req->collector++;
+      if (req->state != req_state_write_metrics)
+        return;  // sending output in the middle of the collector failed
+    }
+    bool last = req->collector == ncoll;
+
+    if (!req->head_sent && gzip && !last && bbuf_len(req->buf) < srv->cfg.gzip_min_size)
+      continue;  // not yet known if the response is large enough to compress
+
+    if (req_queue_output(srv, req, last))
+      break;
+  }
+}
+
+/** Sends the whole response body from a shared snapshot, collecting a new one if needed. */
+static void req_collect_snapshot(struct scrape_server *srv, scrape_req *req, bool gzip, unsigned ncoll) {
+  struct scrape_snapshot *snap = snapshot_acquire(srv, req);
+  bbuf *out = snap->body;
+
+  req->compress = gzip && snap->gzip_body && bbuf_len(snap->gzip_body) > 0;
+  if (req->compress)
+    out = snap->gzip_body;
+
+  int head_len = snprintf(
+      req->head, sizeof req->head, http_success,
+      req->compress ? http_gzip : "", req->keep_alive ? "" : http_close);
+  req->iov[0] = (struct iovec){ .iov_base = req->head, .iov_len = head_len };
+  req->head_sent = true;
+  req->collector = ncoll;
+
+  req_queue_chunk(req, 1, out, true);
+}
+
+/**
+ * Queues the collector output buffered so far as a chunk, preceded by the response head if not yet
+ * sent. Returns `false` if there is nothing to send yet, because the compressor held on to all of
+ * the output. Any head already queued stays queued.
+ */
+static bool req_queue_output(struct scrape_server *srv, scrape_req *req, bool last) {
+  bbuf *out = req->buf;
+
+  if (bbuf_len(req->buf) > req->buf_peak)
+    req->buf_peak = bbuf_len(req->buf);
+
+  if (!req->head_sent) {
+    bool gzip = req->accept_gzip && srv->cfg.gzip_level > 0;
+    req->compress = gzip && bbuf_len(req->buf) >= srv->cfg.gzip_min_size;
+    if (req->compress) {
+      if (!req->gzip)
+        req->gzip = cache_get_gzip(srv);
+      if (!req->gzip_buf)
+        req->gzip_buf = cache_get_buf(srv);
+      bbuf_reset(req->gzip_buf);
+      gzip_start(req->gzip, req->gzip_buf);
+    }
+
+    int head_len = snprintf(
+        req->head, sizeof req->head, http_success,
+        req->compress ? http_gzip : "", req->keep_alive ? "" : http_close);
+    req->iov[req->iov_count++] = (struct iovec){ .iov_base = req->head, .iov_len = head_len };
+    req->head_sent = true;
   }
 
-  while (req->collector < ncoll) {
+  if (req->compress) {
+    size_t len;
+    char *data = bbuf_get(req->buf, &len);
+    gzip_write(req->gzip, data, len, req->gzip_buf);
     bbuf_reset(req->buf);
-    coll[req->collector]->collect(req, coll_ctx[req->collector]);
-    req->collector++;
+    if (last)
+      gzip_finish(req->gzip, req->gzip_buf);
+    out = req->gzip_buf;
+  }
+
+  if (!last && bbuf_len(out) == 0)
+    return false;
+  req_queue_chunk(req, req->iov_count, out, last);
+  return true;
+}
+
+/**
+ * Queues the contents of \p out as a chunk after the first \p iov already queued vectors.
+ *
+ * If \p last is set, the chunk is followed by the last-chunk marker that ends the response.
+ */
+static void req_queue_chunk(scrape_req *req, int iov, bbuf *out, bool last) {
+  size_t len;
+  char *data = bbuf_get(out, &len);
+
+  if (len > 0) {
+    int chunk_head_len = snprintf(req->chunk_head, sizeof req->chunk_head, "%zx\r\n", len);
+    req->iov[iov++] = (struct iovec){ .iov_base = req->chunk_head, .iov_len = chunk_head_len };
+    req->iov[iov++] = (struct iovec){ .iov_base = data, .iov_len = len };
+    req->iov[iov++] = last
+        ? (struct iovec){ .iov_base = (char *) http_chunk_end_last, .iov_len = sizeof http_chunk_end_last - 1 }
+        : (struct iovec){ .iov_base = (char *) http_chunk_end, .iov_len = sizeof http_chunk_end - 1 };
+  } else {
+    req->iov[iov++] = (struct iovec){ .iov_base = (char *) http_chunk_last, .iov_len = sizeof http_chunk_last - 1 };
+  }
+
+  req->iov_next = req->iov;
+  req->iov_count = iov;
+}
+
+// Collectors can't be suspended, so a collector writing more than BUF_MAX bytes has its output sent
+// while it's still running, as far as the socket takes it without blocking. If the client isn't
+// keeping up, the unsent part is parked in a buffer of its own, and the rest of the collector's
+// output piles up in the request buffer, until the collector returns and the response continues
+// from the event loop. Once the parked and buffered output reach BUF_PARK_MAX together, the worker
+// instead waits for the socket to take the parked part, up to the response deadline, so a slow
+// client can't make a single collector's output pile up without bound.
+
+/** Sends the output buffered so far for a response being streamed from the collectors. */
+static void req_flush(scrape_req *req) {
+  struct scrape_server *srv = req->srv;
+
+  if (req->iov_count > 0) {
+    // output parked by an earlier flush must go first
+    if (!req_send(req))
+      goto failed;
+    size_t held = bbuf_len(req->buf) + (req->pending ? bbuf_len(req->pending) : 0);
+    if (req->iov_count > 0 && held < BUF_PARK_MAX)
+      return;
+    if (req->iov_count > 0 && !req_wait(srv, req))
+      goto failed;
+  }
+
+  if (!req->head_sent && req->accept_gzip && srv->cfg.gzip_level > 0 && bbuf_len(req->buf) < srv->cfg.gzip_min_size)
+    return;  // not yet known if the response is large enough to compress
+  if (!req_queue_output(srv, req, false))
+    return;
+
+  if (!req_send(req))
+    goto failed;
+  if (req->iov_count > 0)
+    req_park(srv, req);
+  bbuf_reset(req->buf);
+  if (req->compress)
+    bbuf_reset(req->gzip_buf);
+  return;
+
+failed:
+  req->state = req_state_write_error;
+  req->iov_count = 0;
+}
+
+/** Writes as much of the pending output as the socket takes without blocking. Returns `false` on failure. */
+static bool req_send(scrape_req *req) {
+  while (req->iov_count > 0) {
+    ssize_t wrote = writev(req->socket, req->iov_next, req->iov_count);
+
+    if (wrote == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;  // the rest is sent from the event loop
+    if (wrote == -1 && errno == EINTR)
+      continue;
+    if (wrote <= 0)
+      return false;
+    req_advance(req, wrote);
+  }
+  return true;
+}
+
+/**
+ * Writes all of the pending output, waiting for the socket to become writable as needed, but not
+ * past the response deadline. Returns `false` on failure, or if the deadline passed.
+ */
+static bool req_wait(struct scrape_server *srv, scrape_req *req) {
+  while (req->iov_count > 0) {
+    int millis = -1;
+    if (req->timeout.tv_sec != 0 || req->timeout.tv_nsec != 0) {
+      timeout_clock(srv);
+      if (timeout_passed(srv, req))
+        return false;
+      long long left = (long long) (req->timeout.tv_sec - srv->now.tv_sec) * 1000
+          + (req->timeout.tv_nsec - srv->now.tv_nsec) / 1000000 + 1;
+      millis = left < INT_MAX ? left : INT_MAX;
+    }
+
+    struct pollfd fd = { .fd = req->socket, .events = POLLOUT };
+    int ret = poll(&fd, 1, millis);
+    if (ret == -1 && errno != EINTR)
+      return false;
+    if (ret == 1 && !(fd.revents & POLLOUT))
+      return false;  // error or hangup
+    if (!req_send(req))
+      return false;
+  }
+  return true;
+}
+
+/** Copies the pending output to the parking buffer of \p req, so the collector buffers can be reused. */
+static void req_park(struct scrape_server *srv, scrape_req *req) {
+  if (!req->pending)
+    req->pending = cache_get_buf(srv);
+  bbuf_reset(req->pending);
+  for (int i = 0; i < req->iov_count; i++)
+    bbuf_put(req->pending, req->iov_next[i].iov_base, req->iov_next[i].iov_len);
+
+  size_t len;
+  char *data = bbuf_get(req->pending, &len);
+  req->iov[0] = (struct iovec){ .iov_base = data, .iov_len = len };
+  req->iov_next = req->iov;
+  req->iov_count = 1;
+}
+
+// snapshot collection
+
+// With a nonzero coalescing window, a collection pass renders the full response body into a
+// snapshot. Any scrape that starts within the window after the pass started is served from the
+// same snapshot (and its compressed copy), instead of running the collectors again. A scrape that
+// had to wait for a pass started by another worker is also served its results.
+//
+// With a collection interval, a background thread instead renders a new snapshot into a back
+// buffer on a timer, and swaps it in as the front buffer when done, so scrapes never wait for the
+// collectors.
+//
+// A snapshot replaced while still being sent is retired when the last request using it releases
+// it. One retired snapshot is kept as the spare, to be reused as the next back buffer.
+
+static bool snapshot_fresh(struct scrape_server *srv, struct scrape_snapshot *snap) {
+  struct timespec *now = &srv->now;
+  struct timespec *t = &snap->time;
+  if (t->tv_sec == 0 && t->tv_nsec == 0)
+    return false;  // can't tell the time
+  long long millis = now->tv_sec - t->tv_sec;
+  millis *= 1000;
+  millis += (now->tv_nsec - t->tv_nsec) / 1000000;
+  return millis >= 0 && millis < srv->cfg.coalesce_ms;
+}
+
+static struct scrape_snapshot *snapshot_acquire(struct scrape_server *srv, scrape_req *req) {
+  struct scrape_shared *sh = srv->shared;
+
+  pthread_mutex_lock(&sh->snapshot_lock);
+  if (!sh->cfg.collect_interval_ms && (!sh->snapshot || !snapshot_fresh(srv, sh->snapshot))) {
+    unsigned long passes = sh->passes;
+    pthread_mutex_unlock(&sh->snapshot_lock);
+    pthread_mutex_lock(&sh->collect_lock);
+    if (sh->passes == passes)
+      snapshot_collect(sh, req, &srv->now);
+    pthread_mutex_unlock(&sh->collect_lock);
+    pthread_mutex_lock(&sh->snapshot_lock);
+  }
+  struct scrape_snapshot *snap = sh->snapshot;
+  snap->refs++;
+  pthread_mutex_unlock(&sh->snapshot_lock);
+
+  req->snapshot = snap;
+  return snap;
+}
+
+static void snapshot_release(struct scrape_shared *sh, scrape_req *req) {
+  struct scrape_snapshot *snap = req->snapshot;
+  if (!snap)
+    return;
+
+  req->snapshot = 0;
+  pthread_mutex_lock(&sh->snapshot_lock);
+  if (--snap->refs == 0 && snap != sh->snapshot)
+    snapshot_retire(sh, snap);
+  pthread_mutex_unlock(&sh->snapshot_lock);
+}
+
+/**
+ * Runs all the collectors into a new snapshot using \p req, and makes it the current one.
+ *
+ * The snapshot is also compressed (if large enough) before it is published, so that requests never
+ * modify a published snapshot. Must be called with the collect lock held.
+ */
+static void snapshot_collect(struct scrape_shared *sh, scrape_req *req, const struct timespec *now) {
+  pthread_mutex_lock(&sh->snapshot_lock);
+  struct scrape_snapshot *snap = sh->spare;
+  sh->spare = 0;
+  pthread_mutex_unlock(&sh->snapshot_lock);
+
+  if (!snap) {
+    snap = must_malloc(sizeof *snap);
+    snap->refs = 0;
+    snap->body = bbuf_alloc(sh->body_size, SIZE_MAX);
+    snap->gzip_body = 0;
+  } else {
+    bbuf_reset(snap->body);
+    bbuf_fit(snap->body, sh->body_size);
+    if (snap->gzip_body)
+      bbuf_reset(snap->gzip_body);
+  }
+
+  snap->time = *now;
+  req->timestamp = sh->cfg.timestamps ? timestamp_millis() : 0;
+  if (!req->pass)
+    req->pass = pass_alloc();
+  else
+    pass_reset(req->pass);
+  if (sh->pool) {
+    pool_collect(sh, snap->body, req->timestamp, req->pass);
+  } else {
+    req->out = snap->body;
+    for (unsigned c = 0; c < sh->ncoll; c++)
+      collect_run(req, sh->coll[c], sh->coll_ctx[c]);
+    req->out = req->buf;
+  }
+  sh->body_size = size_learn(sh->body_size, bbuf_len(snap->body));
+
+  if (sh->cfg.gzip_level > 0 && bbuf_len(snap->body) >= sh->cfg.gzip_min_size) {
+    if (!snap->gzip_body)
+      snap->gzip_body = bbuf_alloc(BUF_INITIAL, SIZE_MAX);
+    if (!sh->collect_gzip)
+      sh->collect_gzip = gzip_alloc(sh->cfg.gzip_level);
+    size_t len;
+    char *data = bbuf_get(snap->body, &len);
+    gzip_start(sh->collect_gzip, snap->gzip_body);
+    gzip_write(sh->collect_gzip, data, len, snap->gzip_body);
+    gzip_finish(sh->collect_gzip, snap->gzip_body);
+  }
+
+  pthread_mutex_lock(&sh->snapshot_lock);
+  struct scrape_snapshot *old = sh->snapshot;
+  sh->snapshot = snap;
+  sh->passes++;
+  if (old && old->refs == 0)
+    snapshot_retire(sh, old);
+  pthread_mutex_unlock(&sh->snapshot_lock);
+}
+
+/** Keeps an unused snapshot as the spare, or frees it. Must be called with the lock held. */
+static void snapshot_retire(struct scrape_shared *sh, struct scrape_snapshot *snap) {
+  if (!sh->spare)
+    sh->spare = snap;
+  else
+    snapshot_free(snap);
+}
+
+static void snapshot_free(struct scrape_snapshot *snap) {
+  bbuf_free(snap->body);
+  if (snap->gzip_body)
+    bbuf_free(snap->gzip_body);
+  free(snap);
+}
 
-    if (bbuf_len(req->buf) > 0) {
-      req->io = bbuf_get(req->buf, &req->io_size);
-      goto rewrite;
+static long long timestamp_millis(void) {
+  struct timespec t;
+  if (clock_gettime(CLOCK_REALTIME, &t) == -1)
+    return 0;
+  return (long long) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// collector thread pool
+
+// Each collector of a pass writes into its own buffer, through its own request object, so the
+// collectors can run concurrently. The thread starting the pass works through the collectors along
+// with the pool threads, waits for all of them to finish, and then joins the buffers in order.
+
+static bool pool_start(struct scrape_shared *sh) {
+  struct collect_pool *pool = must_malloc(sizeof *pool);
+
+  pool->nthreads = 0;
+  pool->threads = must_malloc((sh->cfg.collector_threads - 1) * sizeof *pool->threads);
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->work, 0);
+  pthread_cond_init(&pool->done, 0);
+  pool->stop = false;
+  pool->next = pool->finished = pool->total = 0;
+  pool->reqs = must_malloc(sh->ncoll * sizeof *pool->reqs);
+  pool->bufs = must_malloc(sh->ncoll * sizeof *pool->bufs);
+  pool->buf_sizes = must_malloc(sh->ncoll * sizeof *pool->buf_sizes);
+  for (unsigned c = 0; c < sh->ncoll; c++) {
+    pool->reqs[c].state = req_state_write_metrics;
+    pool->reqs[c].buf = 0;
+    pool->reqs[c].scratch = 0;
+    pool->reqs[c].pass = 0;
+    pool->bufs[c] = bbuf_alloc(BUF_INITIAL, SIZE_MAX);
+    pool->buf_sizes[c] = BUF_INITIAL;
+  }
+  sh->pool = pool;
+
+  // the thread starting a pass also runs collectors, so one less is needed in the pool
+  while (pool->nthreads < sh->cfg.collector_threads - 1) {
+    int ret = pthread_create(&pool->threads[pool->nthreads], 0, pool_main, sh);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+      return false;
     }
+    pool->nthreads++;
+  }
+
+  return true;
+}
+
+static void pool_stop(struct scrape_shared *sh) {
+  struct collect_pool *pool = sh->pool;
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (unsigned t = 0; t < pool->nthreads; t++)
+    pthread_join(pool->threads[t], 0);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  for (unsigned c = 0; c < sh->ncoll; c++) {
+    bbuf_free(pool->bufs[c]);
+    if (pool->reqs[c].scratch)
+      arena_free(pool->reqs[c].scratch);
+  }
+  free(pool->bufs);
+  free(pool->buf_sizes);
+  free(pool->reqs);
+  free(pool->threads);
+  free(pool);
+  sh->pool = 0;
+}
+
+/** Runs collectors of the current pass until none are left. Called with the pool lock held. */
+static void pool_work(struct scrape_shared *sh) {
+  struct collect_pool *pool = sh->pool;
+
+  while (pool->next < pool->total) {
+    unsigned c = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    collect_run(&pool->reqs[c], sh->coll[c], sh->coll_ctx[c]);
+    pthread_mutex_lock(&pool->lock);
+    if (++pool->finished == pool->total)
+      pthread_cond_signal(&pool->done);
+  }
+}
+
+/**
+ * Runs all the collectors on the pool, appending their output to \p body in order. The collectors
+ * share the files read in \p pass.
+ */
+static void pool_collect(struct scrape_shared *sh, bbuf *body, long long timestamp, struct scrape_pass *pass) {
+  struct collect_pool *pool = sh->pool;
+
+  for (unsigned c = 0; c < sh->ncoll; c++) {
+    bbuf_reset(pool->bufs[c]);
+    bbuf_fit(pool->bufs[c], pool->buf_sizes[c]);
+    pool->reqs[c].out = pool->bufs[c];
+    pool->reqs[c].timestamp = timestamp;
+    pool->reqs[c].pass = pass;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->next = pool->finished = 0;
+  pool->total = sh->ncoll;
+  pthread_cond_broadcast(&pool->work);
+  pool_work(sh);
+  while (pool->finished < pool->total)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pool->next = pool->total = 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  for (unsigned c = 0; c < sh->ncoll; c++) {
+    size_t len;
+    char *data = bbuf_get(pool->bufs[c], &len);
+    bbuf_put(body, data, len);
+    pool->buf_sizes[c] = size_learn(pool->buf_sizes[c], len);
+  }
+}
+
+static void *pool_main(void *arg) {
+  struct scrape_shared *sh = arg;
+  struct collect_pool *pool = sh->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->stop && pool->next >= pool->total)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->stop)
+      break;
+    pool_work(sh);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+// background collection thread
+
+static bool collect_start(struct scrape_shared *sh) {
+  // the first snapshot is collected up front, so there is always one to serve
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+    perror("clock_gettime");
+    return false;
+  }
+  pthread_mutex_lock(&sh->collect_lock);
+  snapshot_collect(sh, &sh->collect_req, &now);
+  pthread_mutex_unlock(&sh->collect_lock);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sh->collect_wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  sh->collect_stop = false;
+  int ret = pthread_create(&sh->collect_thread, 0, collect_main, sh);
+  if (ret != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+    pthread_cond_destroy(&sh->collect_wake);
+    return false;
   }
+  sh->collect_running = true;
+  return true;
+}
+
+static void collect_stop(struct scrape_shared *sh) {
+  if (!sh->collect_running)
+    return;
+
+  pthread_mutex_lock(&sh->snapshot_lock);
+  sh->collect_stop = true;
+  pthread_cond_signal(&sh->collect_wake);
+  pthread_mutex_unlock(&sh->snapshot_lock);
 
-  req_close(srv, r);
+  pthread_join(sh->collect_thread, 0);
+  pthread_cond_destroy(&sh->collect_wake);
+  sh->collect_running = false;
+}
+
+static void *collect_main(void *arg) {
+  struct scrape_shared *sh = arg;
+  scrape_req *req = &sh->collect_req;
+  struct timespec next = sh->snapshot->time;
+
+  while (true) {
+    // the next pass starts an interval after the previous one started, or right away if overdue
+    next.tv_sec += sh->cfg.collect_interval_ms / 1000;
+    next.tv_nsec += (long) (sh->cfg.collect_interval_ms % 1000) * 1000000;
+    if (next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0
+        && (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)))
+      next = now;
+
+    pthread_mutex_lock(&sh->snapshot_lock);
+    int ret = 0;
+    while (!sh->collect_stop && ret != ETIMEDOUT)
+      ret = pthread_cond_timedwait(&sh->collect_wake, &sh->snapshot_lock, &next);
+    bool stop = sh->collect_stop;
+    pthread_mutex_unlock(&sh->snapshot_lock);
+    if (stop)
+      return 0;
+
+    pthread_mutex_lock(&sh->collect_lock);
+    snapshot_collect(sh, req, &next);
+    pthread_mutex_unlock(&sh->collect_lock);
+  }
 }
 
 // timeout implementation
 
-static void timeout_start(scrape_req *req) {
+// A request is always waiting for exactly one kind of deadline: for the request headers to be
+// received (starting from the first byte), for the response to be fully written, or for the next
+// request to start on an idle persistent connection. A client trickling in a request byte by byte
+// does not extend the header deadline.
+//
+// All requests waiting for the same kind of timeout get the same deadline relative to when they
+// started waiting, so each queue is kept in deadline order simply by appending at the tail. This
+// makes starting, stopping and expiring a timeout O(1), with no heap or timer wheel needed no
+// matter how many connections there are.
+
+static void timeout_clock(struct scrape_server *srv) {
+  if (clock_gettime(CLOCK_MONOTONIC, &srv->now) == -1)
+    srv->now.tv_sec = srv->now.tv_nsec = 0;
+}
+
+static void timeout_start(struct scrape_server *srv, scrape_req *req, enum timeout_kind kind) {
   struct timespec *t = &req->timeout;
 
-  if (clock_gettime(CLOCK_MONOTONIC, t) != -1) {
-    t->tv_sec += TIMEOUT_SEC;
-    t->tv_nsec += TIMEOUT_NSEC;
+  if (req->timeout_kind != max_timeout)
+    timeout_stop(srv, req);
+
+  if (srv->now.tv_sec != 0 || srv->now.tv_nsec != 0) {
+    long millis = srv->timeout_millis[kind];
+    t->tv_sec = srv->now.tv_sec + millis / 1000;
+    t->tv_nsec = srv->now.tv_nsec + millis % 1000 * 1000000;
     if (t->tv_nsec >= 1000000000) {
+      t->tv_sec++;
       t->tv_nsec -= 1000000000;
-      t->tv_sec += 1;
     }
   } else {
     t->tv_sec = 0;
     t->tv_nsec = 0;
   }
+
+  struct timeout_queue *q = &srv->timeouts[kind];
+  req->timeout_kind = kind;
+  req->timeout_next = 0;
+  req->timeout_prev = q->tail;
+  if (q->tail)
+    q->tail->timeout_next = req;
+  else
+    q->head = req;
+  q->tail = req;
 }
 
-static bool timeout_test(scrape_req *req) {
-  struct timespec now;
-  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
-    return false;
+static void timeout_stop(struct scrape_server *srv, scrape_req *req) {
+  if (req->timeout_kind == max_timeout)
+    return;
+
+  struct timeout_queue *q = &srv->timeouts[req->timeout_kind];
+  if (req->timeout_prev)
+    req->timeout_prev->timeout_next = req->timeout_next;
+  else
+    q->head = req->timeout_next;
+  if (req->timeout_next)
+    req->timeout_next->timeout_prev = req->timeout_prev;
+  else
+    q->tail = req->timeout_prev;
+  req->timeout_kind = max_timeout;
+}
+
+static bool timeout_passed(struct scrape_server *srv, scrape_req *req) {
+  struct timespec *now = &srv->now;
   struct timespec *t = &req->timeout;
-  return now.tv_sec > t->tv_sec || (now.tv_sec == t->tv_sec && now.tv_nsec > t->tv_nsec);
+  if (t->tv_sec == 0 && t->tv_nsec == 0)
+    return false;  // can't tell the time
+  return now->tv_sec > t->tv_sec || (now->tv_sec == t->tv_sec && now->tv_nsec > t->tv_nsec);
+}
+
+static void timeout_expire(struct scrape_server *srv) {
+  for (unsigned i = 0; i < max_timeout; i++) {
+    struct timeout_queue *q = &srv->timeouts[i];
+    while (q->head && timeout_passed(srv, q->head))
+      req_close(srv, q->head);
+  }
 }
 
-static int timeout_next_millis(scrape_req *reqs) {
-  struct timespec next = { .tv_sec = 0, .tv_nsec = 0 };
+static int timeout_next_millis(struct scrape_server *srv) {
+  struct timespec *next = 0;
 
-  for (unsigned i = 0; i < MAX_REQUESTS; i++) {
-    scrape_req *req = &reqs[i];
-    if (req->state == req_state_inactive)
+  for (unsigned i = 0; i < max_timeout; i++) {
+    if (!srv->timeouts[i].head)
       continue;
-    struct timespec *t = &req->timeout;
+    struct timespec *t = &srv->timeouts[i].head->timeout;
     if (t->tv_sec == 0 && t->tv_nsec == 0)
       continue;
-
-    if ((next.tv_sec == 0 && next.tv_nsec == 0) || t->tv_sec < next.tv_sec || (t->tv_sec == next.tv_sec && t->tv_nsec < next.tv_nsec))
-      next = *t;
+    if (!next || t->tv_sec < next->tv_sec || (t->tv_sec == next->tv_sec && t->tv_nsec < next->tv_nsec))
+      next = t;
   }
 
-  if (next.tv_sec == 0 && next.tv_nsec == 0)
+  if (!next)
     return -1;  // no expiring timeouts
 
-  struct timespec now;
-  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
-    return -1;  // can't tell the time
+  struct timespec *now = &srv->now;
 
-  long long millis = next.tv_sec - now.tv_sec;
+  long long millis = next->tv_sec - now->tv_sec;
   millis *= 1000;
-  millis += (next.tv_nsec - now.tv_nsec) / 1000000;
+  millis += (next->tv_nsec - now->tv_nsec) / 1000000;
   millis += 10;  // cut some slack
 
   if (millis <= 10)
@@ -448,72 +1960,350 @@ static int timeout_next_millis(scrape_req *reqs) {
 
 // HTTP protocol functions
 
-static enum http_parse_result http_parse(int socket, enum http_parse_state *state, bbuf *buf) {
-  unsigned char http_buf[1024];
+static void http_header(scrape_req *req);
 
-  while (true) {
-    ssize_t got = read(socket, &http_buf, sizeof http_buf);
-
-    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-      return http_parse_incomplete;
-    else if (got <= 0)
-      return http_parse_invalid;
+static enum http_parse_result http_parse(scrape_req *req) {
+  bbuf *buf = req->buf;
 
-    for (ssize_t i = 0; i < got; i++) {
-      int c = http_buf[i];
-      if (c == '\r')
-        continue;
+  while (req->in_pos < req->in_len) {
+    int c = (unsigned char) req->in[req->in_pos++];
+    if (c == '\r')
+      continue;
 
-      switch (*state) {
-        case http_read_start:
-          if (c == ' ') {
-            if (bbuf_cmp(buf, "GET") != 0)
-              return http_parse_invalid;
-            *state = http_read_path;
-            bbuf_reset(buf);
-            break;
-          }
-          if (!isalnum(c) || bbuf_len(buf) >= 16)
+    switch (req->parse_state) {
+      case http_read_start:
+        if (c == ' ') {
+          if (bbuf_cmp(buf, "GET") != 0)
             return http_parse_invalid;
-          bbuf_putc(buf, c);
+          req->parse_state = http_read_path;
+          bbuf_reset(buf);
           break;
-
-        case http_read_path:
-          if (c == ' ') {
-            if (bbuf_cmp(buf, "/metrics") != 0)
-              return http_parse_invalid;
-            *state = http_read_version;
-            bbuf_reset(buf);
-            break;
-          }
-          if (!isprint(c) || c == '\n' || bbuf_len(buf) >= 128)
+        }
+        if (!isalnum(c) || bbuf_len(buf) >= 16)
+          return http_parse_invalid;
+        bbuf_putc(buf, c);
+        break;
+
+      case http_read_path:
+        if (c == ' ') {
+          if (bbuf_cmp(buf, "/metrics") != 0)
             return http_parse_invalid;
-          bbuf_putc(buf, c);
+          req->parse_state = http_read_version;
+          bbuf_reset(buf);
           break;
-
-        case http_read_version:
-          if (c == '\n') {
-            if (bbuf_cmp(buf, "HTTP/1.1") != 0)
-              return http_parse_invalid;
-            *state = http_skip_headers_1;
-            bbuf_reset(buf);
-            break;
-          }
-          if (!isgraph(c) || bbuf_len(buf) >= 16)
+        }
+        if (!isprint(c) || c == '\n' || bbuf_len(buf) >= 128)
+          return http_parse_invalid;
+        bbuf_putc(buf, c);
+        break;
+
+      case http_read_version:
+        if (c == '\n') {
+          if (bbuf_cmp(buf, "HTTP/1.1") != 0)
             return http_parse_invalid;
-          bbuf_putc(buf, c);
+          req->parse_state = http_read_header_start;
+          bbuf_reset(buf);
           break;
-
-        case http_skip_headers_1:
-          if (c == '\n')
-            return http_parse_valid;
-          *state = http_skip_headers_2;
+        }
+        if (!isgraph(c) || bbuf_len(buf) >= 16)
+          return http_parse_invalid;
+        bbuf_putc(buf, c);
+        break;
+
+      case http_read_header_start:
+        if (c == '\n')
+          return http_parse_valid;
+        req->parse_state = http_read_header;
+        bbuf_putc(buf, c);
+        break;
+      case http_read_header:
+        if (c == '\n') {
+          http_header(req);
+          req->parse_state = http_read_header_start;
+          bbuf_reset(buf);
           break;
-        case http_skip_headers_2:
-          if (c == '\n')
-            *state = http_skip_headers_1;
+        }
+        if (bbuf_len(buf) >= HTTP_HEADER_MAX) {
+          req->parse_state = http_skip_header;
+          bbuf_reset(buf);
           break;
+        }
+        bbuf_putc(buf, c);
+        break;
+      case http_skip_header:
+        if (c == '\n')
+          req->parse_state = http_read_header_start;
+        break;
+    }
+  }
+
+  return http_parse_incomplete;
+}
+
+/** Returns `true` if the parameters of a list element set its quality value to zero. */
+static bool http_quality_zero(const char *params, size_t len) {
+  char q[8];
+
+  for (size_t i = 0; i < len; i++) {
+    if (params[i] != ';')
+      continue;
+    size_t j = i + 1;
+    while (j < len && (params[j] == ' ' || params[j] == '\t'))
+      j++;
+    if (j + 1 < len && (params[j] == 'q' || params[j] == 'Q') && params[j + 1] == '=') {
+      size_t n = len - (j + 2);
+      if (n >= sizeof q)
+        n = sizeof q - 1;
+      memcpy(q, params + j + 2, n);
+      q[n] = '\0';
+      return strtod(q, 0) <= 0.0;
+    }
+  }
+
+  return false;
+}
+
+/** Returns `true` if the comma-separated header value \p list contains an acceptable \p token. */
+static bool http_list_contains(const char *list, size_t len, const char *token) {
+  const char *end = list + len;
+  size_t token_len = strlen(token);
+
+  while (list < end) {
+    while (list < end && (*list == ' ' || *list == '\t' || *list == ','))
+      list++;
+    const char *name = list;
+    while (list < end && *list != ',' && *list != ';' && *list != ' ' && *list != '\t')
+      list++;
+    size_t name_len = list - name;
+    const char *params = list;
+    while (list < end && *list != ',')
+      list++;
+
+    if (name_len == token_len && strncasecmp(name, token, token_len) == 0 && !http_quality_zero(params, list - params))
+      return true;
+  }
+
+  return false;
+}
+
+static void http_header(scrape_req *req) {
+  size_t len;
+  char *header = bbuf_get(req->buf, &len);
+  char *colon = memchr(header, ':', len);
+  if (!colon)
+    return;
+  size_t name_len = colon - header;
+  char *value = colon + 1;
+  size_t value_len = len - name_len - 1;
+
+  if (name_len == 10 && strncasecmp(header, "Connection", 10) == 0) {
+    if (http_list_contains(value, value_len, "close"))
+      req->keep_alive = false;
+  } else if (name_len == 15 && strncasecmp(header, "Accept-Encoding", 15) == 0) {
+    if (http_list_contains(value, value_len, "gzip"))
+      req->accept_gzip = true;
+  }
+}
+
+#ifdef NANO_EXPORTER_TEST
+/**
+ * Feeds the string \p in to the HTTP parser \p step bytes at a time, as if read from a single
+ * connection, and appends a description of each request it parsed to \p out, separated by ", ":
+ * "valid" (followed by " gzip" and " close" if the headers asked for those), or "invalid". Parsing
+ * stops as the connection would be closed. A trailing "incomplete" means the input ended in the
+ * middle of a request.
+ */
+void scrape_test_parse(const char *in, size_t step, bbuf *out) {
+  scrape_req req = { .parse_state = http_read_start, .keep_alive = true };
+  req.buf = bbuf_alloc(BUF_INITIAL, SIZE_MAX);
+  if (step > sizeof req.in)
+    step = sizeof req.in;
+
+  size_t len = strlen(in);
+  bool done = false;
+  for (size_t pos = 0; pos < len && !done; pos += step) {
+    req.in_pos = 0;
+    req.in_len = len - pos < step ? len - pos : step;
+    memcpy(req.in, in + pos, req.in_len);
+
+    while (!done) {
+      enum http_parse_result ret = http_parse(&req);
+      if (ret == http_parse_incomplete)
+        break;
+      if (bbuf_len(out) > 0)
+        bbuf_puts(out, ", ");
+      if (ret == http_parse_invalid) {
+        bbuf_puts(out, "invalid");
+        done = true;
+        break;
       }
+      bbuf_puts(out, "valid");
+      if (req.accept_gzip)
+        bbuf_puts(out, " gzip");
+      if (!req.keep_alive) {
+        bbuf_puts(out, " close");
+        done = true;
+      }
+      // as in req_process, when waiting for the next request on a persistent connection
+      req.parse_state = http_read_start;
+      req.accept_gzip = false;
+      bbuf_reset(req.buf);
     }
   }
+
+  if (!done && (req.parse_state != http_read_start || bbuf_len(req.buf) > 0))
+    bbuf_puts(out, bbuf_len(out) > 0 ? ", incomplete" : "incomplete");
+  bbuf_free(req.buf);
+}
+
+/**
+ * Sets up a server that listens on no port, for serving sockets passed to scrape_test_connect.
+ * The configuration must not call for snapshots. Freed with scrape_close.
+ */
+scrape_server *scrape_test_server(const struct scrape_config *cfg, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]) {
+  struct scrape_shared *sh = shared_alloc(cfg);
+  sh->workers[sh->nworkers++] = worker_alloc(sh);
+  shared_set_collectors(sh, ncoll, coll, coll_ctx);
+  if (!event_init(sh->workers[0])) {
+    shared_free(sh);
+    return 0;
+  }
+  return sh->workers[0];
+}
+
+/** Starts serving the connected socket \p s on \p srv, as if just accepted. */
+void scrape_test_connect(scrape_server *srv, int s) {
+  timeout_clock(srv);
+  req_start(srv, s);
+}
+
+/** Runs the event loop of \p srv until all of its connections are closed. */
+void scrape_test_run(scrape_server *srv) {
+  struct scrape_shared *sh = srv->shared;
+
+  timeout_clock(srv);
+  while (atomic_load_explicit(&sh->active_reqs, memory_order_relaxed) > 0
+         && event_dispatch(srv, sh->ncoll, sh->coll, sh->coll_ctx))
+    timeout_expire(srv);
+}
+
+// names of the timeout queues in scrape_test_timeouts scripts, in enum timeout_kind order
+static const char test_timeout_kinds[max_timeout + 1] = "hri";
+
+/** Sets the clock of \p srv to \p millis milliseconds and \p nanos nanoseconds after a nonzero start. */
+static void test_clock(struct scrape_server *srv, long millis, long nanos) {
+  srv->now.tv_sec = 1000 + millis / 1000;
+  srv->now.tv_nsec = millis % 1000 * 1000000 + nanos;
+}
+
+/** Appends the requests in each timeout queue, marking it broken if its backward links disagree. */
+static void test_timeout_queues(struct scrape_server *srv, scrape_req *reqs[26], bbuf *out) {
+  for (unsigned k = 0; k < max_timeout; k++) {
+    bbuf_putf(out, k > 0 ? " %c:" : "%c:", test_timeout_kinds[k]);
+    size_t start = bbuf_len(out);
+    for (scrape_req *req = srv->timeouts[k].head; req; req = req->timeout_next)
+      for (unsigned r = 0; r < 26; r++)
+        if (reqs[r] == req)
+          bbuf_putc(out, 'A' + r);
+
+    size_t len;
+    char *names = bbuf_get(out, &len);
+    scrape_req *req;
+    for (req = srv->timeouts[k].tail; req; req = req->timeout_prev) {
+      if (len == start || req->timeout_kind != k || reqs[names[len - 1] - 'A'] != req)
+        break;
+      len--;
+    }
+    if (req || len != start)
+      bbuf_puts(out, " (broken)");
+  }
+}
+
+/**
+ * Runs the timeout operations in \p script on a server with header, response and idle timeouts of
+ * 100, 200 and 300 ms, and a clock that only moves when told to, starting from 0 ms. Requests are
+ * named by capital letters. The operations, separated by spaces, are:
+ *
+ * - "+Xk": connect X if it isn't, and start its timeout of kind k: 'h', 'r' or 'i';
+ * - "-X": stop the timeout of X;
+ * - "@N": set the clock to N ms; "@N+" to one nanosecond after that;
+ * - "!": expire the timeouts, appending "closed:" and the requests closed by it to \p out;
+ * - "?": append the queues, as in "h:AB r: i:C".
+ *
+ * Results are separated by ", ".
+ */
+void scrape_test_timeouts(const char *script, bbuf *out) {
+  struct scrape_config cfg = {
+    .port = "0",
+    .header_timeout_ms = 100,
+    .response_timeout_ms = 200,
+    .idle_timeout_ms = 300,
+    .max_connections = 26,
+    .collector_threads = 1,
+    .workers = 1,
+  };
+  scrape_server *srv = scrape_test_server(&cfg, 0, 0, 0);
+  scrape_req *reqs[26] = { 0 };
+  int peers[26];
+  for (unsigned r = 0; r < 26; r++)
+    peers[r] = -1;
+
+  test_clock(srv, 0, 0);
+  for (const char *p = script; *p; ) {
+    if (*p == ' ') {
+      p++;
+      continue;
+    }
+    if (bbuf_len(out) > 0 && (*p == '!' || *p == '?'))
+      bbuf_puts(out, ", ");
+
+    if (*p == '+') {
+      unsigned r = p[1] - 'A';
+      enum timeout_kind kind = strchr(test_timeout_kinds, p[2]) - test_timeout_kinds;
+      if (!reqs[r]) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+          break;
+        req_start(srv, fds[0]);
+        for (unsigned i = 0; i < srv->nreqs; i++)
+          if (srv->reqs[i]->state != req_state_inactive && srv->reqs[i]->socket == fds[0])
+            reqs[r] = srv->reqs[i];
+        peers[r] = fds[1];
+      }
+      timeout_start(srv, reqs[r], kind);
+      p += 3;
+    } else if (*p == '-') {
+      timeout_stop(srv, reqs[p[1] - 'A']);
+      p += 2;
+    } else if (*p == '@') {
+      char *end;
+      long millis = strtol(p + 1, &end, 10);
+      long nanos = *end == '+' ? 1 : 0;
+      test_clock(srv, millis, nanos);
+      p = end + nanos;
+    } else if (*p == '!') {
+      timeout_expire(srv);
+      bbuf_puts(out, "closed:");
+      for (unsigned r = 0; r < 26; r++) {
+        if (reqs[r] && reqs[r]->state == req_state_inactive) {
+          bbuf_putc(out, 'A' + r);
+          reqs[r] = 0;
+          close(peers[r]);
+          peers[r] = -1;
+        }
+      }
+      p++;
+    } else if (*p == '?') {
+      test_timeout_queues(srv, reqs, out);
+      p++;
+    } else {
+      break;
+    }
+  }
+
+  scrape_close(srv);
+  for (unsigned r = 0; r < 26; r++)
+    if (peers[r] != -1)
+      close(peers[r]);
 }
+#endif // NANO_EXPORTER_TEST
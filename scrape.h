@@ -19,6 +19,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /** Opaque type to represent the scrape server. */
 typedef struct scrape_server scrape_server;
@@ -26,7 +27,17 @@ typedef struct scrape_server scrape_server;
 /** Opaque type to represent an ongoing scrape request. */
 typedef struct scrape_req scrape_req;
 
-/** Interface type for implementing a collector that can be scraped. */
+// from util.h
+struct arena;
+struct pfile;
+
+/**
+ * Interface type for implementing a collector that can be scraped.
+ *
+ * With more than one collector thread, the `collect` callbacks of different collectors may be
+ * called concurrently from different threads, but the callback of any one collector is never
+ * called concurrently with itself. Collectors must therefore not share mutable state.
+ */
 struct collector {
   const char *name;
   void (*collect)(scrape_req *req, void *ctx);
@@ -34,8 +45,45 @@ struct collector {
   bool has_args;
 };
 
-/** Sets up a scrape server listening at the given port. */
-scrape_server *scrape_listen(const char *port);
+/** Configuration options of the scrape server. */
+struct scrape_config {
+  /** Port (or service name) to listen on. */
+  const char *port;
+  /** Compression level (1-9) for gzip-encoded responses, or 0 to never compress. */
+  int gzip_level;
+  /** Smallest response body size (in bytes) that is compressed. */
+  size_t gzip_min_size;
+  /**
+   * Time window (in milliseconds) after a collection pass during which further scrapes are served
+   * the same results, or 0 to run the collectors for every scrape.
+   */
+  unsigned coalesce_ms;
+  /**
+   * Interval (in milliseconds) for running the collectors in a background thread, with scrapes
+   * served the latest results, or 0 to collect when scraped. Takes precedence over `coalesce_ms`.
+   */
+  unsigned collect_interval_ms;
+  /** Whether to attach the collection time as a timestamp to written samples. */
+  bool timestamps;
+  /** Deadline (in milliseconds) for receiving the request headers. */
+  unsigned header_timeout_ms;
+  /** Deadline (in milliseconds) for writing the full response. */
+  unsigned response_timeout_ms;
+  /** Deadline (in milliseconds) for the next request to start on a persistent connection. */
+  unsigned idle_timeout_ms;
+  /** Maximum number of concurrent connections; any more are closed immediately. */
+  unsigned max_connections;
+  /** Number of threads to run collectors on in parallel, or 1 to run them one after another. */
+  unsigned collector_threads;
+  /**
+   * Number of worker threads, each accepting connections on its own sockets bound to the port
+   * with `SO_REUSEPORT`. With more than one, scrapes are always served from shared snapshots.
+   */
+  unsigned workers;
+};
+
+/** Sets up a scrape server listening according to the given configuration. */
+scrape_server *scrape_listen(const struct scrape_config *cfg);
 
 /** Enters a loop serving scrape requests of the provided collectors. */
 void scrape_serve(scrape_server *server, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
@@ -56,15 +104,78 @@ struct label {
 /**
  * Writes a metric value as a response to a scrape.
  *
+ * The scrape write functions are only safe to call on the \p req passed to the `collect` callback,
+ * from the thread that callback was called on, and before the callback returns. Calls for the
+ * different \p req objects of concurrently running collectors do not interfere with each other.
+ *
  * The \p labels parameter can be `NULL` if no extra labels need to be
  * attached. If not null, it should point at the first element of an
  * array of `struct label` objects, terminated by a sentinel value
- * with a null pointer as the key.
+ * with a null pointer as the key. Backslashes, double quotes and newlines in label values are
+ * escaped in the output.
  *
  * Returns `false` if setting up the server failed, otherwise does not return.
  */
 void scrape_write(scrape_req *req, const char *metric, const struct label *labels, double value);
 
+/**
+ * Writes a metric sample with an integer value to the scrape response.
+ *
+ * This is otherwise identical to scrape_write(), except that the value is written exactly, without
+ * being rounded to double precision, as counters read from the kernel can exceed 2^53.
+ */
+void scrape_write_u64(scrape_req *req, const char *metric, const struct label *labels, uint64_t value);
+
+/**
+ * Metadata of a metric family: its name, and its `# HELP` and `# TYPE` lines rendered in the text
+ * format. Use METRIC_META() to render them at compile time.
+ */
+struct metric_meta {
+  const char *name;
+  const char *text;
+  size_t len;
+};
+
+#define METRIC_META_TEXT(name, type, help) "# HELP " name " " help "\n# TYPE " name " " type "\n"
+
+/**
+ * Initializer for a `struct metric_meta` of the metric \p name_ with the given \p type (such as
+ * "counter" or "gauge") and \p help text. All three must be string literals; the help text must not
+ * contain backslashes or newlines.
+ */
+#define METRIC_META(name_, type, help) {                         \
+    .name = name_,                                              \
+    .text = METRIC_META_TEXT(name_, type, help),                \
+    .len = sizeof METRIC_META_TEXT(name_, type, help) - 1,      \
+  }
+
+/**
+ * Writes the metadata of a metric family as a response to a scrape.
+ *
+ * The metadata should be written at most once per scrape, before the first sample of the family.
+ * All the samples of the family should then be written one after another.
+ */
+void scrape_write_meta(scrape_req *req, const struct metric_meta *meta);
+
+/**
+ * Returns a memory arena for scratch use by the collector writing to \p req.
+ *
+ * The arena is reset before each collector runs, so memory allocated from it is only valid until
+ * the `collect` callback returns. As the arena keeps its memory, a collector that takes all the
+ * memory it needs during a scrape from it makes no heap allocations once warmed up.
+ */
+struct arena *scrape_arena(scrape_req *req);
+
+/**
+ * Returns the lines of the file \p f, as read once for the current collection pass.
+ *
+ * Only the first collector of a pass asking for a file (identified by its path) reads it, and all
+ * the others get the same lines, so files such as /proc/stat used by several collectors are read
+ * and split only once per scrape. The lines are shared, and must not be modified. Returns a null
+ * pointer if the file could not be read.
+ */
+const char *const *scrape_read_lines(scrape_req *req, struct pfile *f);
+
 /**
  * Writes raw data to the scrape response.
  *
@@ -21,59 +21,74 @@
 #include "scrape.h"
 #include "util.h"
 
-// size of input buffer for paths and lines
-#define BUF_SIZE 256
-
+static void *stat_init(int argc, char *argv[]);
 static void stat_collect(scrape_req *req, void *ctx);
 
 const struct collector stat_collector = {
   .name = "stat",
   .collect = stat_collect,
+  .init = stat_init,
 };
 
 static const struct {
-  const char *name;
+  struct metric_meta meta;
   const char *key;
   unsigned key_len;
 } metrics[] = {
-  { .name = "node_boot_time_seconds", .key = "btime ", .key_len = 6 },
-  { .name = "node_context_switches_total", .key = "ctxt ", .key_len = 5 },
-  { .name = "node_forks_total", .key = "processes ", .key_len = 10 },
-  { .name = "node_intr_total", .key = "intr ", .key_len = 5 },
-  { .name = "node_procs_blocked", .key = "procs_blocked ", .key_len = 14 },
-  { .name = "node_procs_running", .key = "procs_running ", .key_len = 14 },
+  {
+    .meta = METRIC_META("node_boot_time_seconds", "gauge", "Node boot time, in unixtime."),
+    .key = "btime ", .key_len = 6,
+  },
+  {
+    .meta = METRIC_META("node_context_switches_total", "counter", "Total number of context switches."),
+    .key = "ctxt ", .key_len = 5,
+  },
+  {
+    .meta = METRIC_META("node_forks_total", "counter", "Total number of forks."),
+    .key = "processes ", .key_len = 10,
+  },
+  {
+    .meta = METRIC_META("node_intr_total", "counter", "Total number of interrupts serviced."),
+    .key = "intr ", .key_len = 5,
+  },
+  {
+    .meta = METRIC_META("node_procs_blocked", "gauge", "Number of processes blocked waiting for I/O to complete."),
+    .key = "procs_blocked ", .key_len = 14,
+  },
+  {
+    .meta = METRIC_META("node_procs_running", "gauge", "Number of processes in runnable state."),
+    .key = "procs_running ", .key_len = 14,
+  },
 };
 #define NMETRICS (sizeof metrics / sizeof *metrics)
 
-static void stat_collect(scrape_req *req, void *ctx) {
-  (void) ctx;
-
-  // buffers
-
-  char buf[BUF_SIZE];
+static void *stat_init(int argc, char *argv[]) {
+  (void) argc; (void) argv;
+  return pfile_open(PATH("/proc/stat"));
+}
 
-  FILE *f;
+static void stat_collect(scrape_req *req, void *ctx) {
+  pfile *stat = ctx;
 
   // scan /proc/stat for metrics
 
-  f = fopen(PATH("/proc/stat"), "r");
-  if (!f)
+  const char *const *lines = scrape_read_lines(req, stat);
+  if (!lines)
     return;
 
-  while (fgets_line(buf, sizeof buf, f)) {
+  for (const char *const *line = lines; *line; line++) {
     for (size_t m = 0; m < NMETRICS; m++) {
-      if (strncmp(buf, metrics[m].key, metrics[m].key_len) != 0)
+      if (strncmp(*line, metrics[m].key, metrics[m].key_len) != 0)
         continue;
 
-      char *end;
-      double d = strtod(buf + metrics[m].key_len, &end);
-      if (*end != '\0' && *end != ' ' && *end != '\n')
+      uint64_t value;
+      char *end = parse_u64(*line + metrics[m].key_len, &value);
+      if (!end || (*end != '\0' && *end != ' '))
         continue;
 
-      scrape_write(req, metrics[m].name, 0, d);
+      scrape_write_meta(req, &metrics[m].meta);
+      scrape_write_u64(req, metrics[m].meta.name, 0, value);
       break;
     }
   }
-
-  fclose(f);
 }
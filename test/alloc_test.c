@@ -0,0 +1,252 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Checks that once warmed up, a scrape of each collector is served without any heap allocations:
+// through the real request path, over a socket pair, including the request buffers, their growth,
+// and the compressor and buffer caches. malloc and friends are interposed to count calls.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "harness.h"
+#include "../scrape.h"
+#include "../util.h"
+
+extern const struct collector cpu_collector;
+extern const struct collector diskstats_collector;
+extern const struct collector filesystem_collector;
+extern const struct collector hwmon_collector;
+extern const struct collector meminfo_collector;
+extern const struct collector netdev_collector;
+extern const struct collector stat_collector;
+extern const struct collector textfile_collector;
+extern const struct collector uname_collector;
+
+void cpu_test_override_tick(void *ctx, long tick);
+void filesystem_test_override_statvfs(void *ctx, int (*statvfs_func)(const char *path, struct statvfs *buf));
+void uname_test_override_data(void *ctx, struct utsname *name);
+
+scrape_server *scrape_test_server(const struct scrape_config *cfg, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
+void scrape_test_connect(scrape_server *srv, int s);
+void scrape_test_run(scrape_server *srv);
+
+// allocation counting
+
+static bool counting = false;
+static unsigned allocs = 0;
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+  if (counting)
+    allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  if (counting)
+    allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (counting)
+    allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+#endif // __GLIBC__
+
+// scrapes over a socket pair
+
+static const struct scrape_config scrape_cfg = {
+  .port = "0",
+  .gzip_level = 1,
+  .gzip_min_size = 0,
+  .header_timeout_ms = 10000,
+  .response_timeout_ms = 10000,
+  .idle_timeout_ms = 10000,
+  .max_connections = 4,
+  .collector_threads = 1,
+  .workers = 1,
+};
+
+// the whole response, read without allocating
+static char response[65536];
+
+/**
+ * Serves one scrape over a new connection on \p srv, and reads the response into `response`, as a
+ * string. Returns `false` if the response was not complete.
+ */
+static bool scrape_once(scrape_server *srv, bool gzip) {
+  static const char plain_request[] = "GET /metrics HTTP/1.1\r\nConnection: close\r\n\r\n";
+  static const char gzip_request[] = "GET /metrics HTTP/1.1\r\nConnection: close\r\nAccept-Encoding: gzip\r\n\r\n";
+  const char *request = gzip ? gzip_request : plain_request;
+  size_t request_len = gzip ? sizeof gzip_request - 1 : sizeof plain_request - 1;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    return false;
+  if (write(fds[1], request, request_len) != (ssize_t) request_len) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+
+  // the response fits in the socket buffer, so the server is done by the time its socket is closed
+  scrape_test_connect(srv, fds[0]);
+  scrape_test_run(srv);
+
+  size_t len = 0;
+  ssize_t got;
+  while (len < sizeof response - 1 && (got = read(fds[1], response + len, sizeof response - 1 - len)) > 0)
+    len += got;
+  close(fds[1]);
+  response[len] = '\0';
+
+  return len >= 5 && memcmp(response + len - 5, "0\r\n\r\n", 5) == 0;
+}
+
+static int fake_statvfs(const char *path, struct statvfs *buf) {
+  (void) path;
+  memset(buf, 0, sizeof *buf);
+  buf->f_frsize = 4096;
+  buf->f_blocks = 1234567;
+  return 0;
+}
+
+/**
+ * Scrapes \p coll a few times, both plain and compressed, and fails if the last ones allocated,
+ * or did not write \p metric.
+ */
+static void check_steady_state(test_env *env, const struct collector *coll, void *ctx, const char *metric) {
+  if (coll->init && !ctx)
+    test_fail(env, "%s: init failed", coll->name);
+
+  scrape_server *srv = scrape_test_server(&scrape_cfg, 1, (const struct collector *[]){ coll }, (void *[]){ ctx });
+  if (!srv)
+    test_fail(env, "%s: failed to set up server", coll->name);
+
+  bool complete = true, written = false;
+  for (int round = 0; round < 3; round++) {
+    allocs = 0;
+    counting = round == 2;
+    complete = scrape_once(srv, false) && complete;
+    written = strstr(response, metric) != 0;
+    complete = scrape_once(srv, true) && complete;
+    counting = false;
+  }
+  scrape_close(srv);
+
+  if (!complete)
+    test_fail(env, "%s: incomplete response", coll->name);
+  if (!written)
+    test_fail(env, "%s: %s not written", coll->name, metric);
+  if (allocs != 0)
+    test_fail(env, "%s: %u heap allocations in a steady-state scrape", coll->name, allocs);
+}
+
+TEST(steady_state_allocs) {
+  test_write_file(
+      env,
+      "proc/stat",
+      "cpu  1222 2444 3666 4888 6110 7332 8554 9776\n"
+      "cpu0 1111 2222 3333 4444 5555 6666 7777 8888\n"
+      "cpu1 111 222 333 444 555 666 777 888\n"
+      "intr 9977823731 9 0 0 0 0 0 0 0 1 0 0 0\n"
+      "ctxt 17392647926\n"
+      "btime 1538002179\n"
+      "processes 9325143\n"
+      "procs_running 2\n"
+      "procs_blocked 0\n");
+  test_write_file(env, "sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", "1234567\n");
+  test_write_file(env, "sys/devices/system/cpu/cpu1/cpufreq/scaling_cur_freq", "987654\n");
+  test_write_file(
+      env,
+      "proc/diskstats",
+      "   8       0 sda 1111 2222 3333 4444 5555 6666 7777 8888 9999 101010 111111 121212 131313 141414 151515\n"
+      "   8      16 sdb 111 222 333 444 555 666 777 888 999 1010 1111 1212 1313 1414 1515\n");
+  test_write_file(
+      env,
+      "proc/mounts",
+      "/dev/mapper/vg00-root / ext4 rw,relatime,errors=remount-ro 0 0\n"
+      "/dev/sda1 /boot ext2 rw,noatime 0 0\n");
+  test_write_file(env, "sys/devices/virtual/hwmon/hwmon0/name", "acpitz\n");
+  test_write_file(env, "sys/devices/virtual/hwmon/hwmon0/temp1_input", "27800\n");
+  test_add_link(env, "sys/class/hwmon/hwmon0", "../../devices/virtual/hwmon/hwmon0");
+  test_write_file(env, "sys/class/hwmon/hwmon1/name", "it87\n");
+  test_write_file(env, "sys/class/hwmon/hwmon1/fan1_input", "1305\n");
+  test_write_file(env, "sys/class/hwmon/hwmon1/in0_input", "3020\n");
+  test_write_file(
+      env,
+      "proc/meminfo",
+      "MemTotal:       16316872 kB\n"
+      "MemFree:         1986284 kB\n"
+      "HugePages_Total:       0\n");
+  test_write_file(
+      env,
+      "proc/net/dev",
+      "Inter-|   Receive                                                |  Transmit\n"
+      " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n"
+      "    lo:  123456   12345  123  234  345   456        567       678   987654   98765  987  876  765   654     543        432\n"
+      "  eno1:   12345    1234   12   23   34    45         56        67    98765    9876   98   87   76    65      54         43\n");
+  test_write_file(env, "textfile/metrics.prom", "test_metric{label=\"value\"} 1234\n");
+
+#ifndef __GLIBC__
+  printf("skipped: counting allocations needs glibc\n");
+#else
+  void *ctx;
+
+  ctx = cpu_collector.init(0, 0);
+  cpu_test_override_tick(ctx, 100);
+  check_steady_state(env, &cpu_collector, ctx, "node_cpu_seconds_total");
+
+  check_steady_state(env, &diskstats_collector, diskstats_collector.init(0, 0), "node_disk_reads_completed_total");
+
+  ctx = filesystem_collector.init(0, 0);
+  filesystem_test_override_statvfs(ctx, fake_statvfs);
+  check_steady_state(env, &filesystem_collector, ctx, "node_filesystem_size_bytes");
+
+  check_steady_state(env, &hwmon_collector, hwmon_collector.init(0, 0), "node_hwmon_temp_celsius");
+  check_steady_state(env, &meminfo_collector, meminfo_collector.init(0, 0), "node_memory_MemTotal_bytes");
+  check_steady_state(env, &netdev_collector, netdev_collector.init(0, 0), "node_network_receive_bytes_total");
+  check_steady_state(env, &stat_collector, stat_collector.init(0, 0), "node_context_switches_total");
+  check_steady_state(env, &textfile_collector, textfile_collector.init(1, (char *[]){ "dir=textfile", 0 }), "test_metric");
+
+  ctx = uname_collector.init(0, 0);
+  uname_test_override_data(ctx, &(struct utsname){
+      .sysname = "Linux", .release = "4.18.0", .version = "#1 SMP", .machine = "x86_64",
+      .nodename = "test", });
+  check_steady_state(env, &uname_collector, ctx, "node_uname_info");
+#endif // __GLIBC__
+}
+
+TEST_SUITE {
+  TEST_SUITE_START;
+  RUN_TEST(steady_state_allocs);
+  TEST_SUITE_END;
+}
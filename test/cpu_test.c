@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
+
 #include "harness.h"
 #include "mock_scrape.h"
 
@@ -67,9 +69,36 @@ TEST(cpufreq_metrics) {
   mock_scrape_free(req);
 }
 
+TEST(cpufreq_many_cpus) {
+  char path[64], value[16], label[8];
+  for (int cpu = 0; cpu < 100; cpu++) {
+    snprintf(path, sizeof path, "sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+    snprintf(value, sizeof value, "%d\n", 1000 + cpu);
+    test_write_file(env, path, value);
+  }
+  void *ctx = cpu_collector.init(0, 0);
+
+  // the first scrape probes for CPUs, the second one reuses the count, and must notice a new CPU
+  for (int scrape = 0; scrape < 2; scrape++) {
+    int ncpus = 100 + scrape;
+    if (scrape == 1)
+      test_write_file(env, "sys/devices/system/cpu/cpu100/cpufreq/scaling_cur_freq", "1100\n");
+
+    scrape_req *req = mock_scrape_start(env);
+    cpu_collector.collect(req, ctx);
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+      snprintf(label, sizeof label, "%d", cpu);
+      mock_scrape_expect(req, "node_cpu_frequency_hertz", LABEL_LIST({"cpu", label}), (1000.0 + cpu) * 1000);
+    }
+    mock_scrape_expect_no_more(req);
+    mock_scrape_free(req);
+  }
+}
+
 TEST_SUITE {
   TEST_SUITE_START;
   RUN_TEST(cpu_metrics);
   RUN_TEST(cpufreq_metrics);
+  RUN_TEST(cpufreq_many_cpus);
   TEST_SUITE_END;
 }
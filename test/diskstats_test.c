@@ -30,39 +30,38 @@ TEST(diskstats_metrics) {
   void *ctx = diskstats_collector.init(0, 0);
   diskstats_collector.collect(req, ctx);
 
-  struct label *labels;
-  labels = LABEL_LIST({"device", "sda"});
-  mock_scrape_expect(req, "node_disk_reads_completed_total",          labels, 1111.0);
-  mock_scrape_expect(req, "node_disk_reads_merged_total",             labels, 2222.0);
-  mock_scrape_expect(req, "node_disk_read_bytes_total",               labels, 1706496.0);
-  mock_scrape_expect(req, "node_disk_read_time_seconds_total",        labels, 4.444);
-  mock_scrape_expect(req, "node_disk_writes_completed_total",         labels, 5555.0);
-  mock_scrape_expect(req, "node_disk_writes_merged_total",            labels, 6666.0);
-  mock_scrape_expect(req, "node_disk_written_bytes_total",            labels, 3981824.0);
-  mock_scrape_expect(req, "node_disk_write_time_seconds_total",       labels, 8.888);
-  mock_scrape_expect(req, "node_disk_io_now",                         labels, 9999.0);
-  mock_scrape_expect(req, "node_disk_io_time_seconds_total",          labels, 101.010);
-  mock_scrape_expect(req, "node_disk_io_time_weighted_seconds_total", labels, 111.111);
-  mock_scrape_expect(req, "node_disk_discards_completed_total",       labels, 121212.0);
-  mock_scrape_expect(req, "node_disk_discards_merged_total",          labels, 131313.0);
-  mock_scrape_expect(req, "node_disk_discarded_sectors_total",        labels, 141414.0);
-  mock_scrape_expect(req, "node_disk_discard_time_seconds_total",     labels, 151.515);
-  labels = LABEL_LIST({"device", "sdb"});
-  mock_scrape_expect(req, "node_disk_reads_completed_total",          labels, 111.0);
-  mock_scrape_expect(req, "node_disk_reads_merged_total",             labels, 222.0);
-  mock_scrape_expect(req, "node_disk_read_bytes_total",               labels, 170496.0);
-  mock_scrape_expect(req, "node_disk_read_time_seconds_total",        labels, 0.444);
-  mock_scrape_expect(req, "node_disk_writes_completed_total",         labels, 555.0);
-  mock_scrape_expect(req, "node_disk_writes_merged_total",            labels, 666.0);
-  mock_scrape_expect(req, "node_disk_written_bytes_total",            labels, 397824.0);
-  mock_scrape_expect(req, "node_disk_write_time_seconds_total",       labels, 0.888);
-  mock_scrape_expect(req, "node_disk_io_now",                         labels, 999.0);
-  mock_scrape_expect(req, "node_disk_io_time_seconds_total",          labels, 1.010);
-  mock_scrape_expect(req, "node_disk_io_time_weighted_seconds_total", labels, 1.111);
-  mock_scrape_expect(req, "node_disk_discards_completed_total",       labels, 1212.0);
-  mock_scrape_expect(req, "node_disk_discards_merged_total",          labels, 1313.0);
-  mock_scrape_expect(req, "node_disk_discarded_sectors_total",        labels, 1414.0);
-  mock_scrape_expect(req, "node_disk_discard_time_seconds_total",     labels, 1.515);
+  struct label *sda = LABEL_LIST({"device", "sda"});
+  struct label *sdb = LABEL_LIST({"device", "sdb"});
+  mock_scrape_expect(req, "node_disk_reads_completed_total",          sda, 1111.0);
+  mock_scrape_expect(req, "node_disk_reads_completed_total",          sdb, 111.0);
+  mock_scrape_expect(req, "node_disk_reads_merged_total",             sda, 2222.0);
+  mock_scrape_expect(req, "node_disk_reads_merged_total",             sdb, 222.0);
+  mock_scrape_expect(req, "node_disk_read_bytes_total",               sda, 1706496.0);
+  mock_scrape_expect(req, "node_disk_read_bytes_total",               sdb, 170496.0);
+  mock_scrape_expect(req, "node_disk_read_time_seconds_total",        sda, 4.444);
+  mock_scrape_expect(req, "node_disk_read_time_seconds_total",        sdb, 0.444);
+  mock_scrape_expect(req, "node_disk_writes_completed_total",         sda, 5555.0);
+  mock_scrape_expect(req, "node_disk_writes_completed_total",         sdb, 555.0);
+  mock_scrape_expect(req, "node_disk_writes_merged_total",            sda, 6666.0);
+  mock_scrape_expect(req, "node_disk_writes_merged_total",            sdb, 666.0);
+  mock_scrape_expect(req, "node_disk_written_bytes_total",            sda, 3981824.0);
+  mock_scrape_expect(req, "node_disk_written_bytes_total",            sdb, 397824.0);
+  mock_scrape_expect(req, "node_disk_write_time_seconds_total",       sda, 8.888);
+  mock_scrape_expect(req, "node_disk_write_time_seconds_total",       sdb, 0.888);
+  mock_scrape_expect(req, "node_disk_io_now",                         sda, 9999.0);
+  mock_scrape_expect(req, "node_disk_io_now",                         sdb, 999.0);
+  mock_scrape_expect(req, "node_disk_io_time_seconds_total",          sda, 101.010);
+  mock_scrape_expect(req, "node_disk_io_time_seconds_total",          sdb, 1.010);
+  mock_scrape_expect(req, "node_disk_io_time_weighted_seconds_total", sda, 111.111);
+  mock_scrape_expect(req, "node_disk_io_time_weighted_seconds_total", sdb, 1.111);
+  mock_scrape_expect(req, "node_disk_discards_completed_total",       sda, 121212.0);
+  mock_scrape_expect(req, "node_disk_discards_completed_total",       sdb, 1212.0);
+  mock_scrape_expect(req, "node_disk_discards_merged_total",          sda, 131313.0);
+  mock_scrape_expect(req, "node_disk_discards_merged_total",          sdb, 1313.0);
+  mock_scrape_expect(req, "node_disk_discarded_sectors_total",        sda, 141414.0);
+  mock_scrape_expect(req, "node_disk_discarded_sectors_total",        sdb, 1414.0);
+  mock_scrape_expect(req, "node_disk_discard_time_seconds_total",     sda, 151.515);
+  mock_scrape_expect(req, "node_disk_discard_time_seconds_total",     sdb, 1.515);
   mock_scrape_expect_no_more(req);
   mock_scrape_free(req);
 }
@@ -57,28 +57,27 @@ TEST(filesystem_metrics) {
   filesystem_test_override_statvfs(ctx, mock_statvfs_func);
   filesystem_collector.collect(req, ctx);
 
-  struct label *labels;
-  labels = LABEL_LIST({"device", "/dev/mapper/vg00-root"}, {"fstype", "ext4"}, {"mountpoint", "/"});
-  mock_scrape_expect(req, "node_filesystem_avail_bytes", labels, 448790016);
-  mock_scrape_expect(req, "node_filesystem_files", labels, 123456);
-  mock_scrape_expect(req, "node_filesystem_files_free", labels, 98765);
-  mock_scrape_expect(req, "node_filesystem_free_bytes", labels, 505678848);
-  mock_scrape_expect(req, "node_filesystem_readonly", labels, 0);
-  mock_scrape_expect(req, "node_filesystem_size_bytes", labels, 6320987136);
-  labels = LABEL_LIST({"device", "/dev/sda1"}, {"fstype", "ext2"}, {"mountpoint", "/boot"});
-  mock_scrape_expect(req, "node_filesystem_avail_bytes", labels, 359030784);
-  mock_scrape_expect(req, "node_filesystem_files", labels, 12345);
-  mock_scrape_expect(req, "node_filesystem_files_free", labels, 9876);
-  mock_scrape_expect(req, "node_filesystem_free_bytes", labels, 404541440);
-  mock_scrape_expect(req, "node_filesystem_readonly", labels, 0);
-  mock_scrape_expect(req, "node_filesystem_size_bytes", labels, 5056786432);
-  labels = LABEL_LIST({"device", "/dev/mapper/fake"}, {"fstype", "btrfs"}, {"mountpoint", "/mnt/ro"});
-  mock_scrape_expect(req, "node_filesystem_avail_bytes", labels, 39190016);
-  mock_scrape_expect(req, "node_filesystem_files", labels, 23456);
-  mock_scrape_expect(req, "node_filesystem_files_free", labels, 8765);
-  mock_scrape_expect(req, "node_filesystem_free_bytes", labels, 44878848);
-  mock_scrape_expect(req, "node_filesystem_readonly", labels, 1);
-  mock_scrape_expect(req, "node_filesystem_size_bytes", labels, 1200987136);
+  struct label *root = LABEL_LIST({"device", "/dev/mapper/vg00-root"}, {"fstype", "ext4"}, {"mountpoint", "/"});
+  struct label *boot = LABEL_LIST({"device", "/dev/sda1"}, {"fstype", "ext2"}, {"mountpoint", "/boot"});
+  struct label *ro = LABEL_LIST({"device", "/dev/mapper/fake"}, {"fstype", "btrfs"}, {"mountpoint", "/mnt/ro"});
+  mock_scrape_expect(req, "node_filesystem_avail_bytes", root, 448790016);
+  mock_scrape_expect(req, "node_filesystem_avail_bytes", boot, 359030784);
+  mock_scrape_expect(req, "node_filesystem_avail_bytes", ro, 39190016);
+  mock_scrape_expect(req, "node_filesystem_files", root, 123456);
+  mock_scrape_expect(req, "node_filesystem_files", boot, 12345);
+  mock_scrape_expect(req, "node_filesystem_files", ro, 23456);
+  mock_scrape_expect(req, "node_filesystem_files_free", root, 98765);
+  mock_scrape_expect(req, "node_filesystem_files_free", boot, 9876);
+  mock_scrape_expect(req, "node_filesystem_files_free", ro, 8765);
+  mock_scrape_expect(req, "node_filesystem_free_bytes", root, 505678848);
+  mock_scrape_expect(req, "node_filesystem_free_bytes", boot, 404541440);
+  mock_scrape_expect(req, "node_filesystem_free_bytes", ro, 44878848);
+  mock_scrape_expect(req, "node_filesystem_readonly", root, 0);
+  mock_scrape_expect(req, "node_filesystem_readonly", boot, 0);
+  mock_scrape_expect(req, "node_filesystem_readonly", ro, 1);
+  mock_scrape_expect(req, "node_filesystem_size_bytes", root, 6320987136);
+  mock_scrape_expect(req, "node_filesystem_size_bytes", boot, 5056786432);
+  mock_scrape_expect(req, "node_filesystem_size_bytes", ro, 1200987136);
   mock_scrape_expect_no_more(req);
   mock_scrape_free(req);
 }
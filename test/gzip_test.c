@@ -0,0 +1,205 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "harness.h"
+#include "../gzip.h"
+#include "../util.h"
+
+/** Returns the next value of a 64-bit xorshift generator. */
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/** Fills \p len bytes of \p data with text that looks like a scrape response. */
+static void fill_metrics(uint8_t *data, size_t len) {
+  uint64_t state = 1;
+  size_t pos = 0;
+  while (pos < len) {
+    char line[128];
+    uint64_t r = next_random(&state);
+    int n = snprintf(line, sizeof line, "node_network_receive_bytes_total{device=\"eth%u\"} %llu\n",
+                     (unsigned) (r % 16), (unsigned long long) (r >> 20));
+    size_t copy = (size_t) n < len - pos ? (size_t) n : len - pos;
+    memcpy(data + pos, line, copy);
+    pos += copy;
+  }
+}
+
+/** Fills \p len bytes of \p data with pseudo-random bytes that do not compress. */
+static void fill_random(uint8_t *data, size_t len) {
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < len; i++)
+    data[i] = next_random(&state) >> 56;
+}
+
+/** Reads a little-endian 32-bit value. */
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/**
+ * Compresses \p data at \p level, passing it to gzip_write at most \p chunk bytes at a time, and
+ * checks that the result is a single gzip member that inflates back to \p data.
+ */
+static void expect_roundtrip(test_env *env, gzip_stream *z, const uint8_t *data, size_t len, size_t chunk) {
+  bbuf *out = bbuf_alloc(4096, SIZE_MAX);
+
+  gzip_start(z, out);
+  for (size_t pos = 0; pos < len; pos += chunk)
+    gzip_write(z, data + pos, len - pos < chunk ? len - pos : chunk, out);
+  gzip_finish(z, out);
+
+  size_t out_len;
+  uint8_t *gz = (uint8_t *) bbuf_get(out, &out_len);
+  if (out_len < 18) {
+    bbuf_free(out);
+    test_fail(env, "output of %zu bytes too short for a gzip member", out_len);
+  }
+
+  // the trailer holds the CRC-32 and the size (mod 2^32) of the input
+
+  uint32_t want_crc = crc32(crc32(0, Z_NULL, 0), data, len);
+  uint32_t got_crc = get_u32(gz + out_len - 8), got_size = get_u32(gz + out_len - 4);
+  if (got_crc != want_crc || got_size != (uint32_t) len) {
+    bbuf_free(out);
+    test_fail(env, "trailer: got crc %08x size %u, want crc %08x size %u",
+              got_crc, got_size, want_crc, (uint32_t) len);
+  }
+
+  // inflate with zlib, which also checks the trailer against what it decoded
+
+  uint8_t *got = malloc(len + 1);
+  z_stream s = { .next_in = gz, .avail_in = out_len, .next_out = got, .avail_out = len + 1 };
+  int ret = inflateInit2(&s, 16 + MAX_WBITS);  // 16: gzip wrapper only
+  if (ret == Z_OK)
+    ret = inflate(&s, Z_FINISH);
+  size_t got_len = len + 1 - s.avail_out, trailing = s.avail_in;
+  const char *msg = s.msg ? s.msg : "";
+  inflateEnd(&s);
+
+  bool ok = ret == Z_STREAM_END && trailing == 0 && got_len == len && memcmp(got, data, len) == 0;
+  free(got);
+  bbuf_free(out);
+  if (!ok)
+    test_fail(env, "inflate: ret %d (%s), %zu bytes out of %zu, %zu trailing bytes",
+              ret, msg, got_len, len, trailing);
+}
+
+/** Runs expect_roundtrip for \p data at every compression level. */
+static void expect_roundtrip_levels(test_env *env, const uint8_t *data, size_t len, size_t chunk) {
+  for (int level = 1; level <= 9; level++) {
+    gzip_stream *z = gzip_alloc(level);
+    expect_roundtrip(env, z, data, len, chunk);
+    gzip_free(z);
+  }
+}
+
+TEST(empty) {
+  expect_roundtrip_levels(env, (const uint8_t *) "", 0, 1);
+}
+
+TEST(short_text) {
+  static const char text[] = "# TYPE node_load1 gauge\nnode_load1 0.5\n";
+  expect_roundtrip_levels(env, (const uint8_t *) text, sizeof text - 1, sizeof text);
+}
+
+TEST(metrics_levels) {
+  // several times the 32 KiB window, and enough symbols for multiple blocks
+  size_t len = 300000;
+  uint8_t *data = malloc(len);
+  fill_metrics(data, len);
+  expect_roundtrip_levels(env, data, len, len);
+  free(data);
+}
+
+TEST(small_writes) {
+  static const size_t chunks[] = { 1, 7, 100, 4093 };
+  size_t len = 100000;
+  uint8_t *data = malloc(len);
+  fill_metrics(data, len);
+  for (size_t i = 0; i < sizeof chunks / sizeof *chunks; i++)
+    expect_roundtrip_levels(env, data, len, chunks[i]);
+  free(data);
+}
+
+TEST(incompressible) {
+  size_t len = 200000;
+  uint8_t *data = malloc(len);
+  fill_random(data, len);
+  expect_roundtrip_levels(env, data, len, 65536);
+  free(data);
+}
+
+TEST(window_boundary) {
+  // a random block repeated at distances just inside and just outside the window
+  static const size_t sizes[] = { 32768 - 300, 32768 - 262, 32768, 40000 };
+  for (size_t i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+    size_t block = sizes[i], len = 3 * block;
+    uint8_t *data = malloc(len);
+    fill_random(data, block);
+    memcpy(data + block, data, block);
+    memcpy(data + 2 * block, data, block);
+    expect_roundtrip_levels(env, data, len, 10000);
+    free(data);
+  }
+}
+
+TEST(long_runs) {
+  size_t len = 150000;
+  uint8_t *data = malloc(len);
+  memset(data, 'a', len);
+  for (size_t i = 1000; i < len; i += 1000)
+    data[i] = 'b';
+  expect_roundtrip_levels(env, data, len, 3000);
+  free(data);
+}
+
+TEST(reuse) {
+  // a compressor is reused across responses by calling gzip_start again
+  size_t len = 50000;
+  uint8_t *data = malloc(len);
+  fill_metrics(data, len);
+  gzip_stream *z = gzip_alloc(6);
+  expect_roundtrip(env, z, data, len, 512);
+  expect_roundtrip(env, z, data + 1000, 20000, 512);
+  expect_roundtrip(env, z, data, 0, 1);
+  gzip_free(z);
+  free(data);
+}
+
+TEST_SUITE {
+  TEST_SUITE_START;
+  RUN_TEST(empty);
+  RUN_TEST(short_text);
+  RUN_TEST(metrics_levels);
+  RUN_TEST(small_writes);
+  RUN_TEST(incompressible);
+  RUN_TEST(window_boundary);
+  RUN_TEST(long_runs);
+  RUN_TEST(reuse);
+  TEST_SUITE_END;
+}
@@ -42,7 +42,8 @@ TEST(hwmon_metrics) {
   test_write_file(env, "sys/class/hwmon/hwmon2/in1_alarm", "1\n");
   scrape_req *req = mock_scrape_start(env);
 
-  hwmon_collector.collect(req, 0);
+  void *ctx = hwmon_collector.init(0, 0);
+  hwmon_collector.collect(req, ctx);
 
   struct label *labels_acpitz_temp1 = LABEL_LIST({"chip", "hwmon/acpitz"}, {"sensor", "temp1"});
   struct label *labels_acpitz_temp2 = LABEL_LIST({"chip", "hwmon/acpitz"}, {"sensor", "temp2"});
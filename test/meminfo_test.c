@@ -32,7 +32,8 @@ TEST(meminfo_metrics) {
       "HugePages_Free:       12\n");
   scrape_req *req = mock_scrape_start(env);
 
-  meminfo_collector.collect(req, 0);
+  void *ctx = meminfo_collector.init(0, 0);
+  meminfo_collector.collect(req, ctx);
 
   mock_scrape_expect(req, "node_memory_MemTotal_bytes", 0, 16708476928);
   mock_scrape_expect(req, "node_memory_MemFree_bytes", 0, 2033954816);
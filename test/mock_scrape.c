@@ -24,6 +24,7 @@
 
 #define MAX_METRICS 128
 #define MAX_RAWS 16
+#define MAX_METAS 32
 
 struct scrape_metric {
   char *metric;
@@ -41,6 +42,15 @@ struct scrape_req {
   char *raws[MAX_RAWS];
   unsigned raws_written;
   unsigned raws_tested;
+
+  // metric families with metadata written, and the one whose samples are being written
+  const char *metas[MAX_METAS];
+  unsigned metas_written;
+  const char *meta_current;
+
+  struct arena *scratch;
+  // memory for files returned by scrape_read_lines, which the mock reads anew on every call
+  struct arena *pass;
 };
 
 static void dump_metrics(scrape_req *req);
@@ -50,16 +60,33 @@ static struct label *copy_labels(const struct label *labels);
 static void free_labels(struct label *labels);
 static void compare_labels(scrape_req *req, const struct label *got, const struct label *expected);
 
+static bool has_meta(scrape_req *req, const char *metric) {
+  for (unsigned i = 0; i < req->metas_written; i++)
+    if (strcmp(req->metas[i], metric) == 0)
+      return true;
+  return false;
+}
+
 void scrape_write(scrape_req *req, const char *metric, const struct label *labels, double value) {
   if (req->metrics_written >= MAX_METRICS)
     test_fail(req->env, "exceeded MAX_METRICS: %u metrics already written", req->metrics_written);
 
+  // samples of a family with metadata must directly follow it, or another sample of the family
+  if (req->meta_current && strcmp(req->meta_current, metric) != 0)
+    req->meta_current = 0;
+  if (!req->meta_current && has_meta(req, metric))
+    test_fail(req->env, "sample of %s not written together with its metadata", metric);
+
   struct scrape_metric *rec = &req->metrics[req->metrics_written++];
   rec->metric = must_strdup(metric);
   rec->labels = copy_labels(labels);
   rec->value = value;
 }
 
+void scrape_write_u64(scrape_req *req, const char *metric, const struct label *labels, uint64_t value) {
+  scrape_write(req, metric, labels, value);
+}
+
 void scrape_write_raw(scrape_req *req, const void *buf, size_t len) {
   if (req->metrics_written >= MAX_RAWS)
     test_fail(req->env, "exceeded MAX_RAWS: %u raw blocks already written", req->raws_written);
@@ -70,11 +97,45 @@ void scrape_write_raw(scrape_req *req, const void *buf, size_t len) {
   req->raws[req->raws_written++] = raw;
 }
 
+void scrape_write_meta(scrape_req *req, const struct metric_meta *meta) {
+  if (req->metas_written >= MAX_METAS)
+    test_fail(req->env, "exceeded MAX_METAS: %u metadata blocks already written", req->metas_written);
+  if (has_meta(req, meta->name))
+    test_fail(req->env, "metadata of %s written twice", meta->name);
+  for (unsigned i = 0; i < req->metrics_written; i++)
+    if (strcmp(req->metrics[i].metric, meta->name) == 0)
+      test_fail(req->env, "metadata of %s written after its samples", meta->name);
+
+  size_t name_len = strlen(meta->name);
+  const char *type = strstr(meta->text, "\n# TYPE ");
+  if (meta->len != strlen(meta->text)
+      || strncmp(meta->text, "# HELP ", 7) != 0 || strncmp(meta->text + 7, meta->name, name_len) != 0
+      || !type || strncmp(type + 8, meta->name, name_len) != 0
+      || meta->text[meta->len - 1] != '\n')
+    test_fail(req->env, "malformed metadata of %s: [[[%s]]]", meta->name, meta->text);
+
+  req->metas[req->metas_written++] = meta->name;
+  req->meta_current = meta->name;
+}
+
+struct arena *scrape_arena(scrape_req *req) {
+  return req->scratch;
+}
+
+const char *const *scrape_read_lines(scrape_req *req, struct pfile *f) {
+  char *data = pfile_read(f, req->pass, 0);
+  return data ? (const char *const *) arena_split_lines(req->pass, data) : 0;
+}
+
 scrape_req *mock_scrape_start(test_env *env) {
   scrape_req *req = must_malloc(sizeof *req);
   req->env = env;
   req->metrics_written = req->metrics_tested = 0;
   req->raws_written = req->raws_tested = 0;
+  req->metas_written = 0;
+  req->meta_current = 0;
+  req->scratch = arena_alloc(1024);
+  req->pass = arena_alloc(1024);
   return req;
 }
 
@@ -85,6 +146,8 @@ void mock_scrape_free(scrape_req *req) {
   }
   for (unsigned i = 0; i < req->raws_written; i++)
     free(req->raws[i]);
+  arena_free(req->scratch);
+  arena_free(req->pass);
   free(req);
 }
 
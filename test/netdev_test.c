@@ -54,8 +54,28 @@ TEST(netdev_metrics) {
   mock_scrape_free(req);
 }
 
+TEST(netdev_bad_header) {
+  static const char *const headers[] = {
+    "Inter-|   Receive                                                |  Transmit\n",
+    "Inter-|   Receive                                                |  Transmit\n"
+    " face |bytes    packets errs drop fifo frame compressed multicast\n",
+    "Inter-|   Receive                                                |  Transmit\n"
+    " face |bytes    packets|bytes    packets|bytes\n",
+    "Inter-|   Receive                                                |  Transmit\n"
+    " face |c00 c01 c02 c03 c04 c05 c06 c07 c08 c09 c10 c11 c12 c13 c14 c15"
+    "|c16 c17 c18 c19 c20 c21 c22 c23 c24 c25 c26 c27 c28 c29 c30 c31 c32\n",
+  };
+
+  for (size_t i = 0; i < sizeof headers / sizeof *headers; i++) {
+    test_write_file(env, "proc/net/dev", headers[i]);
+    if (netdev_collector.init(0, 0))
+      test_fail(env, "init succeeded with header %zu", i);
+  }
+}
+
 TEST_SUITE {
   TEST_SUITE_START;
   RUN_TEST(netdev_metrics);
+  RUN_TEST(netdev_bad_header);
   TEST_SUITE_END;
 }
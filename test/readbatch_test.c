@@ -0,0 +1,169 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Built twice: with plain reads, and with NANO_EXPORTER_URING for the io_uring backend.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "harness.h"
+#include "../readbatch.h"
+
+bool readbatch_test_uses_ring(readbatch *batch);
+
+/** Allocates a batch, noting if the io_uring backend was asked for but isn't available. */
+static readbatch *batch_alloc(void) {
+  readbatch *batch = readbatch_alloc();
+#ifdef NANO_EXPORTER_URING
+  static bool noted = false;
+  if (!readbatch_test_uses_ring(batch) && !noted) {
+    printf("io_uring not available: testing plain reads\n");
+    noted = true;
+  }
+#endif
+  return batch;
+}
+
+/** Frees \p batch, failing if its ring was given up on while reading: the tests should never need that. */
+static void batch_free(test_env *env, readbatch *batch, bool had_ring) {
+  bool has_ring = readbatch_test_uses_ring(batch);
+  readbatch_free(batch);
+  if (had_ring && !has_ring)
+    test_fail(env, "io_uring failed, and the batch fell back to plain reads");
+}
+
+static void expect_file(test_env *env, readbatch *batch, unsigned i, const char *buf, const char *want) {
+  ssize_t len = readbatch_len(batch, i);
+  if (len != (ssize_t) strlen(want) || strcmp(buf, want) != 0)
+    test_fail(env, "file %u: got %zd bytes \"%s\", want %zu bytes \"%s\"", i, len, buf, strlen(want), want);
+}
+
+TEST(read_files) {
+  test_write_file(env, "a", "first\n");
+  test_write_file(env, "b", "");
+  test_write_file(env, "c", "third\n");
+
+  readbatch *batch = batch_alloc();
+  bool had_ring = readbatch_test_uses_ring(batch);
+  char a[64], b[64], c[64];
+  readbatch_add(batch, "a", a, sizeof a);
+  readbatch_add(batch, "b", b, sizeof b);
+  readbatch_add(batch, "c", c, sizeof c);
+  readbatch_run(batch);
+
+  expect_file(env, batch, 0, a, "first\n");
+  expect_file(env, batch, 1, b, "");
+  expect_file(env, batch, 2, c, "third\n");
+  if (readbatch_len(batch, 3) != -1)
+    test_fail(env, "length of a file not in the batch: %zd", readbatch_len(batch, 3));
+  batch_free(env, batch, had_ring);
+}
+
+TEST(missing_file) {
+  test_write_file(env, "present", "here\n");
+
+  readbatch *batch = batch_alloc();
+  bool had_ring = readbatch_test_uses_ring(batch);
+  char missing[64], present[64];
+  memset(missing, 'x', sizeof missing);
+  readbatch_add(batch, "missing", missing, sizeof missing);
+  readbatch_add(batch, "present", present, sizeof present);
+  readbatch_run(batch);
+
+  if (readbatch_len(batch, 0) != -1)
+    test_fail(env, "missing file: got length %zd, want -1", readbatch_len(batch, 0));
+  if (missing[0] != '\0')
+    test_fail(env, "missing file: buffer not cleared");
+  expect_file(env, batch, 1, present, "here\n");
+  batch_free(env, batch, had_ring);
+}
+
+TEST(truncation) {
+  test_write_file(env, "long", "0123456789abcdef");
+
+  readbatch *batch = batch_alloc();
+  bool had_ring = readbatch_test_uses_ring(batch);
+  char buf[16];
+  memset(buf, 'x', sizeof buf);
+  readbatch_add(batch, "long", buf, 8);
+  readbatch_run(batch);
+
+  // at most size - 1 bytes, then the terminator, and nothing written past the buffer size
+  expect_file(env, batch, 0, buf, "0123456");
+  if (buf[8] != 'x')
+    test_fail(env, "wrote past the end of the buffer");
+  batch_free(env, batch, had_ring);
+}
+
+TEST(nul_termination) {
+  test_write_file(env, "short", "abc");
+
+  readbatch *batch = batch_alloc();
+  bool had_ring = readbatch_test_uses_ring(batch);
+  char buf[16];
+  memset(buf, 'x', sizeof buf);
+  readbatch_add(batch, "short", buf, sizeof buf);
+  readbatch_run(batch);
+
+  expect_file(env, batch, 0, buf, "abc");
+  if (buf[3] != '\0' || buf[4] != 'x')
+    test_fail(env, "buffer not terminated right after the contents");
+  batch_free(env, batch, had_ring);
+}
+
+TEST(reuse) {
+  test_write_file(env, "a", "one");
+  test_write_file(env, "b", "two");
+
+  readbatch *batch = batch_alloc();
+  bool had_ring = readbatch_test_uses_ring(batch);
+  static char bufs[READBATCH_MAX][8];
+
+  // full batches, enough of them to go around the ring several times
+  for (unsigned round = 0; round < 8; round++) {
+    for (unsigned i = 0; i < READBATCH_MAX; i++)
+      if (!readbatch_add(batch, i % 3 == 2 ? "missing" : i % 3 == 1 ? "b" : "a", bufs[i], sizeof bufs[i]))
+        test_fail(env, "round %u: batch full after %u files", round, i);
+    if (readbatch_add(batch, "a", bufs[0], sizeof bufs[0]))
+      test_fail(env, "round %u: added a file past READBATCH_MAX", round);
+    readbatch_run(batch);
+    for (unsigned i = 0; i < READBATCH_MAX; i++) {
+      if (i % 3 == 2 && readbatch_len(batch, i) != -1)
+        test_fail(env, "round %u: missing file %u: got length %zd", round, i, readbatch_len(batch, i));
+      else if (i % 3 != 2)
+        expect_file(env, batch, i, bufs[i], i % 3 == 1 ? "two" : "one");
+    }
+  }
+
+  // a new, smaller batch forgets the files of the last one
+  char buf[8];
+  readbatch_add(batch, "b", buf, sizeof buf);
+  readbatch_run(batch);
+  expect_file(env, batch, 0, buf, "two");
+  if (readbatch_len(batch, 1) != -1)
+    test_fail(env, "file from the previous batch still has length %zd", readbatch_len(batch, 1));
+  batch_free(env, batch, had_ring);
+}
+
+TEST_SUITE {
+  TEST_SUITE_START;
+  RUN_TEST(read_files);
+  RUN_TEST(missing_file);
+  RUN_TEST(truncation);
+  RUN_TEST(nul_termination);
+  RUN_TEST(reuse);
+  TEST_SUITE_END;
+}
@@ -0,0 +1,413 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "harness.h"
+#include "../scrape.h"
+#include "../util.h"
+
+void scrape_test_parse(const char *in, size_t step, bbuf *out);
+void scrape_test_timeouts(const char *script, bbuf *out);
+scrape_server *scrape_test_server(const struct scrape_config *cfg, unsigned ncoll, const struct collector *coll[], void *coll_ctx[]);
+void scrape_test_connect(scrape_server *srv, int s);
+void scrape_test_run(scrape_server *srv);
+
+#define REQ "GET /metrics HTTP/1.1\r\n"
+
+struct parse_case {
+  const char *name;
+  const char *in;
+  const char *want;
+};
+
+/** Checks that parsing \p c->in gives the same result however it's split into reads. */
+static void expect_parse(test_env *env, const struct parse_case *c) {
+  static const size_t steps[] = { 1, 2, 5, 1024 };
+  bbuf *out = bbuf_alloc(64, SIZE_MAX);
+
+  for (size_t i = 0; i < sizeof steps / sizeof *steps; i++) {
+    bbuf_reset(out);
+    scrape_test_parse(c->in, steps[i], out);
+    size_t len;
+    char *got = bbuf_get(out, &len);
+    if (len != strlen(c->want) || memcmp(got, c->want, len) != 0) {
+      char msg[256];
+      snprintf(msg, sizeof msg, "%s, %zu bytes at a time: got \"%.*s\", want \"%s\"",
+               c->name, steps[i], (int) len, got, c->want);
+      bbuf_free(out);
+      test_fail(env, "%s", msg);
+    }
+  }
+
+  bbuf_free(out);
+}
+
+static void expect_parse_all(test_env *env, const struct parse_case *cases, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    expect_parse(env, &cases[i]);
+}
+
+TEST(parse_request_line) {
+  static const struct parse_case cases[] = {
+    { "minimal", REQ "\r\n", "valid" },
+    { "bare newlines", "GET /metrics HTTP/1.1\n\n", "valid" },
+    { "with headers", REQ "Host: localhost:9100\r\nUser-Agent: Prometheus/2.0\r\n\r\n", "valid" },
+    { "method", "POST /metrics HTTP/1.1\r\n\r\n", "invalid" },
+    { "lowercase method", "get /metrics HTTP/1.1\r\n\r\n", "invalid" },
+    { "path", "GET / HTTP/1.1\r\n\r\n", "invalid" },
+    { "query", "GET /metrics?x=1 HTTP/1.1\r\n\r\n", "invalid" },
+    { "HTTP/1.0", "GET /metrics HTTP/1.0\r\n\r\n", "invalid" },
+    { "HTTP/0.9", "GET /metrics\r\n\r\n", "invalid" },
+    { "HTTP/2", "GET /metrics HTTP/2\r\n\r\n", "invalid" },
+    { "garbage", "\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03", "invalid" },
+  };
+  expect_parse_all(env, cases, sizeof cases / sizeof *cases);
+}
+
+TEST(parse_partial) {
+  static const struct parse_case cases[] = {
+    { "empty", "", "" },
+    { "method", "GE", "incomplete" },
+    { "path", "GET /metr", "incomplete" },
+    { "version", "GET /metrics HTTP/1.", "incomplete" },
+    { "request line", REQ, "incomplete" },
+    { "headers", REQ "Host: localhost\r\n", "incomplete" },
+    { "header line", REQ "Accept-Encoding: gz", "incomplete" },
+    { "final line", REQ "Host: localhost\r\n\r", "incomplete" },
+  };
+  expect_parse_all(env, cases, sizeof cases / sizeof *cases);
+}
+
+TEST(parse_pipelined) {
+  static const struct parse_case cases[] = {
+    { "two", REQ "\r\n" REQ "\r\n", "valid, valid" },
+    { "three", REQ "\r\n" REQ "Host: a\r\n\r\n" REQ "\r\n", "valid, valid, valid" },
+    { "then partial", REQ "\r\n" "GET /met", "valid, incomplete" },
+    { "then invalid", REQ "\r\n" "GET /other HTTP/1.1\r\n\r\n" REQ "\r\n", "valid, invalid" },
+    { "headers reset", REQ "Accept-Encoding: gzip\r\n\r\n" REQ "\r\n", "valid gzip, valid" },
+    { "close ends", REQ "\r\n" REQ "Connection: close\r\n\r\n" REQ "\r\n", "valid, valid close" },
+  };
+  expect_parse_all(env, cases, sizeof cases / sizeof *cases);
+}
+
+TEST(parse_connection) {
+  static const struct parse_case cases[] = {
+    { "close", REQ "Connection: close\r\n\r\n", "valid close" },
+    { "case", REQ "connection: CLOSE\r\n\r\n", "valid close" },
+    { "keep-alive", REQ "Connection: keep-alive\r\n\r\n", "valid" },
+    { "list", REQ "Connection: Upgrade, close\r\n\r\n", "valid close" },
+    { "no space", REQ "Connection:close\r\n\r\n", "valid close" },
+    { "prefix", REQ "Connection: closed\r\n\r\n", "valid" },
+    { "other header", REQ "X-Connection: close\r\n\r\n", "valid" },
+  };
+  expect_parse_all(env, cases, sizeof cases / sizeof *cases);
+}
+
+TEST(parse_accept_encoding) {
+  static const struct parse_case cases[] = {
+    { "gzip", REQ "Accept-Encoding: gzip\r\n\r\n", "valid gzip" },
+    { "case", REQ "accept-encoding: GZip\r\n\r\n", "valid gzip" },
+    { "list", REQ "Accept-Encoding: deflate, gzip, br\r\n\r\n", "valid gzip" },
+    { "absent", REQ "Accept-Encoding: deflate, br\r\n\r\n", "valid" },
+    { "prefix", REQ "Accept-Encoding: x-gzip\r\n\r\n", "valid" },
+    { "q=1", REQ "Accept-Encoding: gzip;q=1.0\r\n\r\n", "valid gzip" },
+    { "q=0.5", REQ "Accept-Encoding: identity;q=1, gzip;q=0.5\r\n\r\n", "valid gzip" },
+    { "q=0.001", REQ "Accept-Encoding: gzip;q=0.001\r\n\r\n", "valid gzip" },
+    { "q=0", REQ "Accept-Encoding: gzip;q=0\r\n\r\n", "valid" },
+    { "q=0.000", REQ "Accept-Encoding: gzip;q=0.000, deflate\r\n\r\n", "valid" },
+    { "Q=0 spaced", REQ "Accept-Encoding: gzip ; Q=0\r\n\r\n", "valid" },
+    { "other q=0", REQ "Accept-Encoding: deflate;q=0, gzip\r\n\r\n", "valid gzip" },
+    { "with close", REQ "Accept-Encoding: gzip\r\nConnection: close\r\n\r\n", "valid gzip close" },
+  };
+  expect_parse_all(env, cases, sizeof cases / sizeof *cases);
+}
+
+TEST(parse_long_header) {
+  // header lines too long to inspect are skipped, without affecting the ones after them
+  char in[1024];
+  char filler[400];
+  memset(filler, 'x', sizeof filler - 1);
+  filler[sizeof filler - 1] = '\0';
+
+  struct parse_case c = { .name = "skipped", .in = in, .want = "valid gzip" };
+  snprintf(in, sizeof in, REQ "Cookie: %s\r\nAccept-Encoding: gzip\r\n\r\n", filler);
+  expect_parse(env, &c);
+
+  c = (struct parse_case){ .name = "long value", .in = in, .want = "valid" };
+  snprintf(in, sizeof in, REQ "Accept-Encoding: %s, gzip\r\n\r\n", filler);
+  expect_parse(env, &c);
+}
+
+// timeout queues
+
+struct timeout_case {
+  const char *name;
+  const char *script;
+  const char *want;
+};
+
+static void expect_timeouts(test_env *env, const struct timeout_case *cases, size_t n) {
+  bbuf *out = bbuf_alloc(64, SIZE_MAX);
+
+  for (size_t i = 0; i < n; i++) {
+    bbuf_reset(out);
+    scrape_test_timeouts(cases[i].script, out);
+    size_t len;
+    char *got = bbuf_get(out, &len);
+    if (len != strlen(cases[i].want) || memcmp(got, cases[i].want, len) != 0) {
+      char msg[256];
+      snprintf(msg, sizeof msg, "%s: got \"%.*s\", want \"%s\"", cases[i].name, (int) len, got, cases[i].want);
+      bbuf_free(out);
+      test_fail(env, "%s", msg);
+    }
+  }
+
+  bbuf_free(out);
+}
+
+TEST(timeout_order) {
+  static const struct timeout_case cases[] = {
+    { "empty", "?", "h: r: i:" },
+    { "started", "+Ah +Bh +Ch ?", "h:ABC r: i:" },
+    { "restarted", "+Ah +Bh +Ch +Ah ?", "h:BCA r: i:" },
+    { "kinds", "+Ah +Br +Ci +Dh +Er ?", "h:AD r:BE i:C" },
+    { "moved", "+Ah +Bh +Ch +Br +Bi ?", "h:AC r: i:B" },
+  };
+  expect_timeouts(env, cases, sizeof cases / sizeof *cases);
+}
+
+TEST(timeout_stop) {
+  static const struct timeout_case cases[] = {
+    { "middle", "+Ah +Bh +Ch -B ?", "h:AC r: i:" },
+    { "head", "+Ah +Bh +Ch -A ?", "h:BC r: i:" },
+    { "tail", "+Ah +Bh +Ch -C ?", "h:AB r: i:" },
+    { "only", "+Ah -A ?", "h: r: i:" },
+    { "twice", "+Ah +Bh -B -B ?", "h:A r: i:" },
+    { "restarted", "+Ah +Bh +Ch -B +Bh ?", "h:ACB r: i:" },
+    { "all", "+Ah +Bh +Ch -B -A -C +Dh ?", "h:D r: i:" },
+  };
+  expect_timeouts(env, cases, sizeof cases / sizeof *cases);
+}
+
+TEST(timeout_expire) {
+  static const struct timeout_case cases[] = {
+    { "at deadline", "+Ah @100 ! ?", "closed:, h:A r: i:" },
+    { "after deadline", "+Ah @100+ ! ?", "closed:A, h: r: i:" },
+    { "in order", "+Ah @50 +Bh @100+ ! @150 ! @150+ ! ?", "closed:A, closed:, closed:B, h: r: i:" },
+    { "stops at first", "+Ah @10 +Bh @20 +Ch @110 ! ?", "closed:A, h:BC r: i:" },
+    { "restarted", "+Ah +Bh @50 +Ah @100+ ! ?", "closed:B, h:A r: i:" },
+    { "stopped", "+Ah +Bh -A @100+ ! ?", "closed:B, h: r: i:" },
+    { "kinds", "+Ah +Br +Ci @100+ ! @200+ ! @300+ ! ?", "closed:A, closed:B, closed:C, h: r: i:" },
+    { "all queues", "+Ci +Br +Ah @300+ ! ?", "closed:ABC, h: r: i:" },
+  };
+  expect_timeouts(env, cases, sizeof cases / sizeof *cases);
+}
+
+// streaming a large response to a slow client
+
+// lines written by the streaming collector, over a megabyte in all
+#define STREAM_LINES 40000
+
+static void stream_line(bbuf *out, unsigned i) {
+  bbuf_putf(out, "stream_test{line=\"%u\"} %u\n", i, i);
+}
+
+/** Writes STREAM_LINES lines of output in one call, as a textfile collector might. */
+static void stream_collect(scrape_req *req, void *ctx) {
+  bbuf *line = ctx;
+  for (unsigned i = 0; i < STREAM_LINES; i++) {
+    bbuf_reset(line);
+    stream_line(line, i);
+    size_t len;
+    char *data = bbuf_get(line, &len);
+    scrape_write_raw(req, data, len);
+  }
+}
+
+static const struct collector stream_collector = {
+  .name = "stream",
+  .collect = stream_collect,
+};
+
+struct stream_client {
+  int socket;
+  unsigned delay_ms;
+  bbuf *response;
+};
+
+static void sleep_millis(unsigned millis) {
+  struct timespec t = { .tv_sec = millis / 1000, .tv_nsec = millis % 1000 * 1000000L };
+  nanosleep(&t, 0);
+}
+
+/** Sends a request, and reads the response slowly after a delay, until the server closes the socket. */
+static void *stream_client_main(void *arg) {
+  struct stream_client *c = arg;
+  static const char request[] = "GET /metrics HTTP/1.1\r\nConnection: close\r\n\r\n";
+
+  if (write(c->socket, request, sizeof request - 1) != sizeof request - 1)
+    return 0;
+  sleep_millis(c->delay_ms);
+
+  char buf[4096];
+  ssize_t got;
+  for (unsigned reads = 1; (got = read(c->socket, buf, sizeof buf)) > 0; reads++) {
+    bbuf_put(c->response, buf, got);
+    if (reads % 16 == 0)
+      sleep_millis(1);
+  }
+  return 0;
+}
+
+/**
+ * Removes the head and the chunked framing from \p response, leaving the body. Returns `false` if
+ * the response is malformed or incomplete.
+ */
+static bool dechunk(bbuf *response, bbuf *body) {
+  size_t len;
+  bbuf_putc(response, '\0');
+  char *data = bbuf_get(response, &len);
+  char *end = data + len - 1;
+
+  char *p = strstr(data, "\r\n\r\n");
+  if (!p || !strstr(data, "Transfer-Encoding: chunked\r\n"))
+    return false;
+  p += 4;
+
+  while (true) {
+    char *size_end;
+    unsigned long size = strtoul(p, &size_end, 16);
+    if (size_end == p || end - size_end < 2 || memcmp(size_end, "\r\n", 2) != 0)
+      return false;
+    p = size_end + 2;
+    if ((size_t) (end - p) < size + 2 || memcmp(p + size, "\r\n", 2) != 0)
+      return false;
+    if (size == 0)
+      return p + 2 == end;
+    bbuf_put(body, p, size);
+    p += size + 2;
+  }
+}
+
+/**
+ * Streams the output of stream_collect through a socket pair to a client that starts reading after
+ * \p delay_ms, with the given response deadline. Returns `true` if the client got the full body.
+ */
+static bool stream_response(test_env *env, unsigned delay_ms, unsigned response_timeout_ms) {
+  struct scrape_config cfg = {
+    .port = "0",
+    .header_timeout_ms = 10000,
+    .response_timeout_ms = response_timeout_ms,
+    .idle_timeout_ms = 10000,
+    .max_connections = 4,
+    .collector_threads = 1,
+    .workers = 1,
+  };
+  bbuf *line = bbuf_alloc(64, SIZE_MAX);
+  scrape_server *srv = scrape_test_server(&cfg, 1, (const struct collector *[]){ &stream_collector }, (void *[]){ line });
+  if (!srv) {
+    bbuf_free(line);
+    test_fail(env, "failed to set up server");
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    scrape_close(srv);
+    bbuf_free(line);
+    test_fail(env, "socketpair failed");
+  }
+  // a small send buffer keeps most of the response from fitting in the socket
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, (int[]){ 4096 }, sizeof (int));
+
+  struct stream_client client = { .socket = fds[1], .delay_ms = delay_ms, .response = bbuf_alloc(4096, SIZE_MAX) };
+  pthread_t thread;
+  if (pthread_create(&thread, 0, stream_client_main, &client) != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    scrape_close(srv);
+    bbuf_free(line);
+    bbuf_free(client.response);
+    test_fail(env, "pthread_create failed");
+  }
+
+  scrape_test_connect(srv, fds[0]);
+  scrape_test_run(srv);
+  pthread_join(thread, 0);
+  close(fds[1]);
+  scrape_close(srv);
+
+  bbuf *body = bbuf_alloc(4096, SIZE_MAX), *want = bbuf_alloc(4096, SIZE_MAX);
+  for (unsigned i = 0; i < STREAM_LINES; i++)
+    stream_line(want, i);
+
+  // the server's own metrics follow the collector output
+  bool complete = dechunk(client.response, body) && bbuf_len(body) > bbuf_len(want);
+  if (complete) {
+    size_t body_len, want_len;
+    char *body_data = bbuf_get(body, &body_len), *want_data = bbuf_get(want, &want_len);
+    if (memcmp(body_data, want_data, want_len) != 0) {
+      bbuf_free(body);
+      bbuf_free(want);
+      bbuf_free(line);
+      bbuf_free(client.response);
+      test_fail(env, "body does not match the collector output");
+    }
+  }
+
+  bbuf_free(body);
+  bbuf_free(want);
+  bbuf_free(line);
+  bbuf_free(client.response);
+  return complete;
+}
+
+TEST(stream_slow_client) {
+  // the collector output is parked, then the worker waits for the client to catch up
+  if (!stream_response(env, 100, 10000))
+    test_fail(env, "incomplete response");
+}
+
+TEST(stream_past_deadline) {
+  // a client that doesn't read before the response deadline has its connection closed
+  if (stream_response(env, 500, 100))
+    test_fail(env, "response completed after the deadline");
+}
+
+TEST_SUITE {
+  TEST_SUITE_START;
+  RUN_TEST(parse_request_line);
+  RUN_TEST(parse_partial);
+  RUN_TEST(parse_pipelined);
+  RUN_TEST(parse_connection);
+  RUN_TEST(parse_accept_encoding);
+  RUN_TEST(parse_long_header);
+  RUN_TEST(timeout_order);
+  RUN_TEST(timeout_stop);
+  RUN_TEST(timeout_expire);
+  RUN_TEST(stream_slow_client);
+  RUN_TEST(stream_past_deadline);
+  TEST_SUITE_END;
+}
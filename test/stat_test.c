@@ -35,7 +35,8 @@ TEST(stat_metrics) {
       "softirq 4290947107 27801943 1780530729 1705513 249559277 0 0 187155918 1259122343 22702 785048682\n");
   scrape_req *req = mock_scrape_start(env);
 
-  stat_collector.collect(req, 0);
+  void *ctx = stat_collector.init(0, 0);
+  stat_collector.collect(req, ctx);
 
   mock_scrape_expect(req, "node_intr_total", 0, 9977823731);
   mock_scrape_expect(req, "node_context_switches_total", 0, 17392647926);
@@ -0,0 +1,394 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmarks for the formatting and parsing utilities used on every scrape. Each benchmark
+// is run against the generic (printf-style) code it replaces, on the same inputs.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <glob.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../readbatch.h"
+#include "../util.h"
+
+#define NVALUES 4096
+#define ROUNDS 256
+
+static double values[NVALUES];
+
+static double now_sec(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/** Sets up a mix of sample values: mostly whole counters and gauges, and some fractions. */
+static void setup_values(void) {
+  uint64_t x = 88172645463325252ull;
+  for (unsigned i = 0; i < NVALUES; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    switch (i % 8) {
+      case 0: values[i] = (double) (x % 1000); break;
+      case 1: case 2: values[i] = (double) (x >> 24); break;
+      case 3: case 4: values[i] = (double) (x >> 40) * 1024; break;
+      case 5: values[i] = (double) (x % 100000) / 100; break;
+      case 6: values[i] = (double) (x >> 11) / (1ull << 53); break;
+      case 7: values[i] = (double) (x >> 20) / 1000; break;
+    }
+  }
+}
+
+/** Runs \p fn over all the test values repeatedly, and reports the time taken. */
+static void run(const char *name, void (*fn)(bbuf *buf, double value)) {
+  bbuf *buf = bbuf_alloc(1 << 20, 1 << 20);
+  size_t bytes = 0;
+
+  double start = now_sec();
+  for (unsigned r = 0; r < ROUNDS; r++) {
+    bbuf_reset(buf);
+    for (unsigned i = 0; i < NVALUES; i++)
+      fn(buf, values[i]);
+    bytes += bbuf_len(buf);
+  }
+  double elapsed = now_sec() - start;
+
+  printf("  %-24s %7.1f ns/op %8.1f MB/s\n",
+         name, elapsed * 1e9 / ((double) ROUNDS * NVALUES), bytes / elapsed / 1e6);
+  bbuf_free(buf);
+}
+
+static void double_printf(bbuf *buf, double value) {
+  bbuf_putf(buf, " %.16g\n", value);
+}
+
+static void double_put(bbuf *buf, double value) {
+  bbuf_putc(buf, ' ');
+  bbuf_put_double(buf, value);
+  bbuf_putc(buf, '\n');
+}
+
+static void int_printf(bbuf *buf, double value) {
+  bbuf_putf(buf, " %lld\n", (long long) value);
+}
+
+static void int_put(bbuf *buf, double value) {
+  bbuf_putc(buf, ' ');
+  bbuf_put_i64(buf, (int64_t) value);
+  bbuf_putc(buf, '\n');
+}
+
+/** Writes a full sample line the way scrape_write used to, with two labels and a timestamp. */
+static void sample_printf(bbuf *buf, double value) {
+  bbuf_puts(buf, "node_network_receive_bytes_total{");
+  bbuf_putf(buf, "%s=\"%s\"", "device", "eth0");
+  bbuf_putc(buf, ',');
+  bbuf_putf(buf, "%s=\"%s\"", "mode", "user");
+  bbuf_putf(buf, "} %.16g %lld\n", value, 1546300800000ll);
+}
+
+/** Writes the same sample line as sample_printf with the typed appenders. */
+static void sample_put(bbuf *buf, double value) {
+  bbuf_puts(buf, "node_network_receive_bytes_total{");
+  bbuf_put_label(buf, "device", "eth0");
+  bbuf_putc(buf, ',');
+  bbuf_put_label(buf, "mode", "user");
+  bbuf_put(buf, "} ", 2);
+  bbuf_put_double(buf, value);
+  bbuf_putc(buf, ' ');
+  bbuf_put_i64(buf, 1546300800000ll);
+  bbuf_putc(buf, '\n');
+}
+
+/** Writes a label pair the way bbuf_put_label did before it escaped values: copied as is. */
+static void label_copy(bbuf *buf, double value) {
+  (void) value;
+  const char *key = "mountpoint", *val = "/var/lib/docker/overlay2/3f2a9c/merged";
+  size_t key_len = strlen(key), val_len = strlen(val);
+  bbuf_put(buf, key, key_len);
+  bbuf_put(buf, "=\"", 2);
+  bbuf_put(buf, val, val_len);
+  bbuf_putc(buf, '"');
+}
+
+static void label_escaped(bbuf *buf, double value) {
+  (void) value;
+  bbuf_put_label(buf, "mountpoint", "/var/lib/docker/overlay2/3f2a9c/merged");
+}
+
+static void label_escaped_dirty(bbuf *buf, double value) {
+  (void) value;
+  bbuf_put_label(buf, "mountpoint", "/var/lib/docker/\"overlay2\"/3f2a9c/merged");
+}
+
+/** Decimal counters of varying lengths, as found in /proc files. */
+static char numbers[NVALUES][24];
+
+static void setup_numbers(void) {
+  uint64_t x = 88172645463325252ull;
+  for (unsigned i = 0; i < NVALUES; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    snprintf(numbers[i], sizeof numbers[i], "%llu", (unsigned long long) (x >> (i % 8 * 8)));
+  }
+}
+
+/** Runs \p fn over all the test numbers repeatedly, and reports the time taken. */
+static void run_parse(const char *name, uint64_t (*fn)(const char *s)) {
+  uint64_t sum = 0;
+  size_t bytes = 0;
+  for (unsigned i = 0; i < NVALUES; i++)
+    bytes += strlen(numbers[i]);
+
+  double start = now_sec();
+  for (unsigned r = 0; r < ROUNDS; r++)
+    for (unsigned i = 0; i < NVALUES; i++)
+      sum += fn(numbers[i]);
+  double elapsed = now_sec() - start;
+
+  printf("  %-24s %7.1f ns/op %8.1f MB/s  (sum %016llx)\n",
+         name, elapsed * 1e9 / ((double) ROUNDS * NVALUES), bytes * ROUNDS / elapsed / 1e6,
+         (unsigned long long) sum);
+}
+
+static uint64_t number_strtod(const char *s) {
+  return (uint64_t) strtod(s, 0);
+}
+
+static uint64_t number_strtoull(const char *s) {
+  return strtoull(s, 0, 10);
+}
+
+static uint64_t number_parse(const char *s) {
+  uint64_t value = 0;
+  parse_u64(s, &value);
+  return value;
+}
+
+/** Synthetic /proc tables: a 10k-device /proc/diskstats, and a 1k-interface /proc/net/dev. */
+static char *diskstats_table;
+static char *netdev_table;
+
+static char *setup_table(unsigned lines, const char *header, const char *format, unsigned ncolumns) {
+  bbuf *buf = bbuf_alloc(1 << 16, 1 << 24);
+  uint64_t x = 88172645463325252ull;
+  bbuf_puts(buf, header);
+  for (unsigned i = 0; i < lines; i++) {
+    bbuf_putf(buf, format, i);
+    for (unsigned c = 0; c < ncolumns; c++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      bbuf_putf(buf, " %llu", (unsigned long long) (x >> (c % 8 * 8)));
+    }
+    bbuf_putc(buf, '\n');
+  }
+  bbuf_putc(buf, '\0');
+  size_t len;
+  char *data = bbuf_get(buf, &len);
+  char *table = malloc(len);
+  memcpy(table, data, len);
+  bbuf_free(buf);
+  return table;
+}
+
+/** Splits every line of \p table into fields repeatedly, and reports the time taken. */
+static void run_split(const char *name, const char *table, size_t (*fn)(char *line, char *fields[], size_t max)) {
+  size_t len = strlen(table) + 1;
+  char *work = malloc(len);
+  size_t lines = 0, nfields = 0;
+
+  double start = now_sec();
+  for (unsigned r = 0; r < ROUNDS / 16; r++) {
+    memcpy(work, table, len);  // splitting is done in place
+    char *fields[32];
+    for (char *pos = work, *line; (line = next_line(&pos)); lines++)
+      nfields += fn(line, fields, 32);
+  }
+  double elapsed = now_sec() - start;
+
+  printf("  %-24s %7.1f ns/line %8.1f MB/s  (%zu fields)\n",
+         name, elapsed * 1e9 / lines, (len - 1) * (ROUNDS / 16) / elapsed / 1e6, nfields);
+  free(work);
+}
+
+static size_t split_strtok(char *line, char *fields[], size_t max) {
+  size_t n = 0;
+  char *p;
+  for (char *f = strtok_r(line, " ", &p); f && n < max; f = strtok_r(0, " ", &p))
+    fields[n++] = f;
+  return n;
+}
+
+/** Interface names of a container host: mostly veth pairs, and a few physical ones. */
+static char names[NVALUES][24];
+static const char *patterns = "lo,docker*,br-*,cni*,flannel*,cali*,tunl*,vxlan*,kube-ipvs*,eth9,virbr*,veth*";
+
+static void setup_names(void) {
+  for (unsigned i = 0; i < NVALUES; i++) {
+    if (i % 64 == 0)
+      snprintf(names[i], sizeof names[i], "eth%u", i / 64);
+    else
+      snprintf(names[i], sizeof names[i], "veth%08x", i * 2654435761u);
+  }
+}
+
+/** Runs \p fn over all the test names repeatedly, and reports the time taken. */
+static void run_match(const char *name, bool (*fn)(const char *key)) {
+  unsigned matched = 0;
+
+  double start = now_sec();
+  for (unsigned r = 0; r < ROUNDS; r++)
+    for (unsigned i = 0; i < NVALUES; i++)
+      matched += fn(names[i]);
+  double elapsed = now_sec() - start;
+
+  printf("  %-24s %7.1f ns/op  (%u matched)\n",
+         name, elapsed * 1e9 / ((double) ROUNDS * NVALUES), matched);
+}
+
+static struct slist *pattern_list;
+static matcher *pattern_matcher;
+
+/** Linear scan over the pattern list, as done before the patterns were compiled. */
+static bool match_linear(const char *key) {
+  size_t key_len = strlen(key);
+  for (const struct slist *p = pattern_list; p; p = p->next) {
+    size_t match_len = strlen(p->data);
+    if (match_len > 0 && p->data[match_len-1] == '*') {
+      if (match_len-1 <= key_len && memcmp(p->data, key, match_len-1) == 0)
+        return true;
+    } else {
+      if (match_len == key_len && memcmp(p->data, key, key_len) == 0)
+        return true;
+    }
+  }
+  return false;
+}
+
+static bool match_compiled(const char *key) {
+  return matcher_matches(pattern_matcher, key);
+}
+
+/**
+ * Small sysfs attribute files, like the ones the cpufreq and hwmon collectors read in batches. The
+ * readbatch backend measured is the one built: use CPPFLAGS=-DNANO_EXPORTER_URING for io_uring.
+ */
+static glob_t attr_files;
+static char attr_bufs[READBATCH_MAX][64];
+static readbatch *attr_batch;
+
+static void setup_attrs(void) {
+  if (glob("/sys/class/net/*/statistics/*", 0, 0, &attr_files) != 0)
+    glob("/sys/devices/system/cpu/cpu*/topology/*", 0, 0, &attr_files);
+  if (attr_files.gl_pathc > READBATCH_MAX)
+    attr_files.gl_pathc = READBATCH_MAX;
+  attr_batch = readbatch_alloc();
+}
+
+/** Runs \p fn over all the attribute files repeatedly, and reports the time taken per file. */
+static void run_attrs(const char *name, size_t (*fn)(void)) {
+  if (attr_files.gl_pathc == 0) {
+    printf("  %-24s skipped, no attribute files found\n", name);
+    return;
+  }
+  size_t bytes = 0;
+  unsigned rounds = ROUNDS * 4;
+
+  double start = now_sec();
+  for (unsigned r = 0; r < rounds; r++)
+    bytes += fn();
+  double elapsed = now_sec() - start;
+
+  printf("  %-24s %7.1f ns/op  (%zu files, %zu bytes)\n",
+         name, elapsed * 1e9 / ((double) rounds * attr_files.gl_pathc), attr_files.gl_pathc, bytes);
+}
+
+/** Opens, reads and closes each file with plain system calls, as the readbatch fallback does. */
+static size_t attrs_plain(void) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < attr_files.gl_pathc; i++) {
+    int fd = open(attr_files.gl_pathv[i], O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    ssize_t len = read(fd, attr_bufs[i], sizeof attr_bufs[i] - 1);
+    if (len > 0)
+      bytes += len;
+    close(fd);
+  }
+  return bytes;
+}
+
+static size_t attrs_batch(void) {
+  for (size_t i = 0; i < attr_files.gl_pathc; i++)
+    readbatch_add(attr_batch, attr_files.gl_pathv[i], attr_bufs[i], sizeof attr_bufs[i]);
+  readbatch_run(attr_batch);
+  size_t bytes = 0;
+  for (size_t i = 0; i < attr_files.gl_pathc; i++)
+    if (readbatch_len(attr_batch, i) > 0)
+      bytes += readbatch_len(attr_batch, i);
+  return bytes;
+}
+
+int main(void) {
+  setup_values();
+  run("double, bbuf_putf", double_printf);
+  run("double, bbuf_put_double", double_put);
+  run("integer, bbuf_putf", int_printf);
+  run("integer, bbuf_put_i64", int_put);
+  run("sample, bbuf_putf", sample_printf);
+  run("sample, typed appenders", sample_put);
+  run("label, copied as is", label_copy);
+  run("label, escaped", label_escaped);
+  run("label, escaped (quotes)", label_escaped_dirty);
+  setup_numbers();
+  run_parse("number, strtod", number_strtod);
+  run_parse("number, strtoull", number_strtoull);
+  run_parse("number, parse_u64", number_parse);
+  diskstats_table = setup_table(10000, "", "%8u       0 sd", 15);
+  netdev_table = setup_table(
+      1000,
+      "Inter-|   Receive                                                |  Transmit\n"
+      " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n",
+      "  eth%u:", 16);
+  run_split("diskstats, strtok_r", diskstats_table, split_strtok);
+  run_split("diskstats, split_fields", diskstats_table, split_fields);
+  run_split("net/dev, strtok_r", netdev_table, split_strtok);
+  run_split("net/dev, split_fields", netdev_table, split_fields);
+  free(diskstats_table);
+  free(netdev_table);
+  setup_names();
+  pattern_list = slist_split(patterns, ",");
+  pattern_matcher = matcher_split(patterns, ",");
+  run_match("names, linear scan", match_linear);
+  run_match("names, matcher", match_compiled);
+  matcher_free(pattern_matcher);
+  setup_attrs();
+  run_attrs("sysfs, open/read/close", attrs_plain);
+  run_attrs("sysfs, readbatch", attrs_batch);
+  readbatch_free(attr_batch);
+  globfree(&attr_files);
+  return 0;
+}
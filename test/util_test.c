@@ -0,0 +1,464 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "../util.h"
+
+/** Checks that bbuf_put_double formats \p value exactly like "%.16g". */
+static void expect_double(test_env *env, bbuf *buf, double value) {
+  char want[64];
+  snprintf(want, sizeof want, "%.16g", value);
+
+  bbuf_reset(buf);
+  bbuf_put_double(buf, value);
+  size_t len;
+  char *got = bbuf_get(buf, &len);
+  if (len != strlen(want) || memcmp(got, want, len) != 0)
+    test_fail(env, "formatting %a: got %.*s, want %s", value, (int) len, got, want);
+}
+
+/** Returns the next value of a 64-bit xorshift generator. */
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/** Checks that \p buf holds exactly the string \p want, and resets it. */
+static void expect_buf(test_env *env, bbuf *buf, const char *want) {
+  size_t len;
+  char *got = bbuf_get(buf, &len);
+  if (len != strlen(want) || memcmp(got, want, len) != 0)
+    test_fail(env, "got %.*s, want %s", (int) len, got, want);
+  bbuf_reset(buf);
+}
+
+TEST(put_integers) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  static const uint64_t values[] = {
+    0, 1, 9, 10, 99, 100, 4294967295ull, 4294967296ull, 99999999999999999ull,
+    100000000000000000ull, 9999999999999999999ull, 10000000000000000000ull, UINT64_MAX,
+  };
+  char want[32];
+  for (size_t i = 0; i < sizeof values / sizeof *values; i++) {
+    snprintf(want, sizeof want, "%llu", (unsigned long long) values[i]);
+    bbuf_put_u64(buf, values[i]);
+    expect_buf(env, buf, want);
+    int64_t v = (int64_t) (values[i] >> 1);
+    snprintf(want, sizeof want, "%lld", (long long) -v);
+    bbuf_put_i64(buf, -v);
+    expect_buf(env, buf, want);
+  }
+  bbuf_put_i64(buf, INT64_MIN);
+  expect_buf(env, buf, "-9223372036854775808");
+  bbuf_free(buf);
+}
+
+TEST(put_integer_overflow) {
+  bbuf *buf = bbuf_alloc(4, 4);
+  bbuf_put_u64(buf, 123);
+  bbuf_put_u64(buf, 45);
+  bbuf_put_i64(buf, -6);
+  expect_buf(env, buf, "123");
+  bbuf_free(buf);
+}
+
+TEST(put_label) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  bbuf_put_label(buf, "device", "sda");
+  expect_buf(env, buf, "device=\"sda\"");
+  bbuf_put_label(buf, "empty", "");
+  expect_buf(env, buf, "empty=\"\"");
+  bbuf_put_label(buf, "mountpoint", "/mnt/\"x\"\n");
+  expect_buf(env, buf, "mountpoint=\"/mnt/\\\"x\\\"\\n\"");
+  bbuf_free(buf);
+}
+
+TEST(put_escaped) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  bbuf_put_escaped(buf, "plain");
+  expect_buf(env, buf, "plain");
+  bbuf_put_escaped(buf, "a\\b\"c\nd");
+  expect_buf(env, buf, "a\\\\b\\\"c\\nd");
+  bbuf_put_escaped(buf, "");
+  expect_buf(env, buf, "");
+  bbuf_free(buf);
+}
+
+TEST(escape_positions) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  char str[40], want[80];
+  static const char specials[] = { '\\', '"', '\n' };
+  // a special character at every position of strings of every length across a few words
+  for (size_t len = 1; len < sizeof str; len++) {
+    for (size_t pos = 0; pos < len; pos++) {
+      char special = specials[(len + pos) % 3];
+      memset(str, 'a' + len % 26, len);
+      str[len] = '\0';
+      str[pos] = special;
+
+      if (label_escape_count(str, len) != 1)
+        test_fail(env, "escape count of length %zu, position %zu: %zu",
+                  len, pos, label_escape_count(str, len));
+      memcpy(want, str, pos);
+      want[pos] = '\\';
+      want[pos + 1] = special == '\n' ? 'n' : special;
+      memcpy(want + pos + 2, str + pos + 1, len - pos);
+      bbuf_put_escaped(buf, str);
+      expect_buf(env, buf, want);
+    }
+  }
+  // only the first len bytes are looked at
+  if (label_escape_count("abcdefgh\"", 8) != 0 || label_escape_count("\"\"\\\n\n\\\"\"\\", 9) != 9)
+    test_fail(env, "wrong escape count");
+  // bytes with the high bit set are not special
+  if (label_escape_count("\xdc\xa2\x8a\xa2\xdc\xa2\x8a\xa2", 8) != 0)
+    test_fail(env, "high bytes counted as special");
+  bbuf_free(buf);
+}
+
+TEST(put_double_special) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  static const double values[] = {
+    0.0, -0.0, 1.0, -1.0, 0.1, 0.3, 9.3, 2.5, 1.0 / 3, 2.0 / 3, 1e-4, 1e-5, 9.99999e-5,
+    1e15, 1e15 + 0.5, 1e15 + 1.5, 1e16, 1e16 + 2, 9007199254740993.0, 9999999999999998.0,
+    9.999999999999999e15, 9.9999999999999999e15, 0.99999999999999995, 123456789012345678.0,
+    1.7976931348623157e308, 2.2250738585072014e-308, 4.9406564584124654e-324, 1e-300, 1e300,
+    1e22, 1e23, 1e42, 1e43, 1e-12, 1e-13, 5e-13, 18446744073709551615.0, 0.000123456789,
+    INFINITY, NAN,
+  };
+  for (size_t i = 0; i < sizeof values / sizeof *values; i++) {
+    expect_double(env, buf, values[i]);
+    expect_double(env, buf, -values[i]);
+  }
+  bbuf_free(buf);
+}
+
+TEST(put_double_integers) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  uint64_t state = 1;
+  for (unsigned i = 0; i < 100000; i++) {
+    uint64_t r = next_random(&state);
+    expect_double(env, buf, (double) (r >> (r & 63)));
+  }
+  for (double v = 1; v < 1e17; v *= 10) {
+    expect_double(env, buf, v - 1);
+    expect_double(env, buf, v + 1);
+  }
+  bbuf_free(buf);
+}
+
+TEST(put_double_decimals) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  uint64_t state = 2;
+  for (unsigned i = 0; i < 100000; i++) {
+    uint64_t r = next_random(&state);
+    double scale = 1;
+    for (unsigned d = r % 20; d > 0; d--)
+      scale *= 10;
+    expect_double(env, buf, (double) (r >> 40) / scale);
+    expect_double(env, buf, (double) (r >> 12) / scale);
+  }
+  bbuf_free(buf);
+}
+
+TEST(put_double_random_bits) {
+  bbuf *buf = bbuf_alloc(64, 64);
+  uint64_t state = 3;
+  for (unsigned i = 0; i < 200000; i++) {
+    uint64_t r = next_random(&state);
+    double v;
+    memcpy(&v, &r, sizeof v);
+    expect_double(env, buf, v);
+    // also cover the more common exponents densely
+    r = (r & ~(UINT64_C(0x7ff) << 52)) | ((uint64_t) (1023 - 60 + i % 160) << 52);
+    memcpy(&v, &r, sizeof v);
+    expect_double(env, buf, v);
+  }
+  bbuf_free(buf);
+}
+
+/** Checks that parse_u64 agrees with strtoull on the decimal number \p s, followed by \p tail. */
+static void expect_u64(test_env *env, const char *s, const char *tail) {
+  char buf[64];
+  snprintf(buf, sizeof buf, "%s%s", s, tail);
+
+  errno = 0;
+  char *want_end;
+  unsigned long long want = strtoull(buf, &want_end, 10);
+  bool want_ok = errno == 0 && want_end != buf;
+
+  uint64_t got;
+  char *got_end = parse_u64(buf, &got);
+  if (!want_ok) {
+    if (got_end)
+      test_fail(env, "parsing %s: got %llu, want failure", buf, (unsigned long long) got);
+    return;
+  }
+  if (!got_end || got != want || got_end != want_end)
+    test_fail(env, "parsing %s: got %llu (%zu chars), want %llu (%zu chars)",
+              buf, got_end ? (unsigned long long) got : 0, got_end ? (size_t) (got_end - buf) : 0,
+              want, (size_t) (want_end - buf));
+  if (want < (1ull << 53) && (double) got != strtod(s, 0))
+    test_fail(env, "parsing %s: got %llu, strtod disagrees", buf, (unsigned long long) got);
+}
+
+TEST(parse_u64_edge_cases) {
+  static const char *const numbers[] = {
+    "0", "1", "9", "10", "007", "000000000000000000000000001", "4294967296",
+    "9007199254740993", "9999999999999999999", "10000000000000000000",
+    "18446744073709551615", "18446744073709551616", "18446744073709551620",
+    "99999999999999999999", "100000000000000000000",
+  };
+  static const char *const tails[] = { "", " 123", "\n", "kB", ".5" };
+  for (size_t i = 0; i < sizeof numbers / sizeof *numbers; i++)
+    for (size_t t = 0; t < sizeof tails / sizeof *tails; t++)
+      expect_u64(env, numbers[i], tails[t]);
+
+  // strtoull skips whitespace and accepts signs, parse_u64 does not
+  static const char *const invalid[] = { "", " 1", "+1", "-1", "x1", "\n" };
+  for (size_t i = 0; i < sizeof invalid / sizeof *invalid; i++) {
+    uint64_t v;
+    if (parse_u64(invalid[i], &v))
+      test_fail(env, "parsing [%s]: got %llu, want failure", invalid[i], (unsigned long long) v);
+  }
+
+  static const struct { const char *s; bool ok; int64_t value; } signed_numbers[] = {
+    { "0", true, 0 }, { "-0", true, 0 }, { "-27800", true, -27800 }, { "27800", true, 27800 },
+    { "9223372036854775807", true, INT64_MAX }, { "-9223372036854775808", true, INT64_MIN },
+    { "9223372036854775808", false, 0 }, { "-9223372036854775809", false, 0 }, { "--1", false, 0 },
+  };
+  for (size_t i = 0; i < sizeof signed_numbers / sizeof *signed_numbers; i++) {
+    int64_t v;
+    char *end = parse_i64(signed_numbers[i].s, &v);
+    if (signed_numbers[i].ok ? !end || *end != '\0' || v != signed_numbers[i].value : end != 0)
+      test_fail(env, "parsing signed %s: got %s %lld", signed_numbers[i].s,
+                end ? "value" : "failure", end ? (long long) v : 0);
+  }
+}
+
+TEST(parse_u64_random) {
+  uint64_t state = 88172645463325252ull;
+  char buf[32];
+  for (int i = 0; i < 100000; i++) {
+    uint64_t x = next_random(&state);
+    snprintf(buf, sizeof buf, "%llu", (unsigned long long) (x >> (i % 64)));
+    expect_u64(env, buf, i % 2 ? " " : "");
+  }
+}
+
+static void expect_fields(test_env *env, const char *str, size_t max, size_t want_n, const char *const *want) {
+  char buf[64];
+  char *fields[8];
+  snprintf(buf, sizeof buf, "%s", str);
+  size_t n = split_fields(buf, fields, max);
+  if (n != want_n) {
+    test_fail(env, "split_fields(\"%s\", %zu): got %zu fields, want %zu", str, max, n, want_n);
+    return;
+  }
+  for (size_t i = 0; i < n; i++)
+    if (strcmp(fields[i], want[i]) != 0)
+      test_fail(env, "split_fields(\"%s\", %zu): field %zu is \"%s\", want \"%s\"", str, max, i, fields[i], want[i]);
+}
+
+TEST(split_fields) {
+  expect_fields(env, "", 8, 0, 0);
+  expect_fields(env, "   ", 8, 0, 0);
+  expect_fields(env, "a", 8, 1, (const char *[]){ "a" });
+  expect_fields(env, "   8       0 sda 1111", 8, 4, (const char *[]){ "8", "0", "sda", "1111" });
+  expect_fields(env, "a b  ", 8, 2, (const char *[]){ "a", "b" });
+  expect_fields(env, "a b c d", 2, 2, (const char *[]){ "a", "b" });
+  expect_fields(env, "a\tb c", 8, 2, (const char *[]){ "a\tb", "c" });
+}
+
+TEST(matcher) {
+  matcher *m = matcher_split("sda,sd*,,veth*,lo,loop1", ",");
+  const struct { const char *key; bool want; } cases[] = {
+    { "sda", true },
+    { "sdb", true },
+    { "sd", true },
+    { "s", false },
+    { "", false },
+    { "veth", true },
+    { "veth1234abcd", true },
+    { "vet", false },
+    { "lo", true },
+    { "loo", false },
+    { "loop1", true },
+    { "loop10", false },
+    { "eth0", false },
+  };
+  for (size_t i = 0; i < sizeof cases / sizeof *cases; i++)
+    if (matcher_matches(m, cases[i].key) != cases[i].want)
+      test_fail(env, "matcher_matches(\"%s\"): got %d, want %d", cases[i].key, !cases[i].want, cases[i].want);
+  matcher_free(m);
+
+  m = matcher_split("*", ",");
+  if (!matcher_matches(m, "") || !matcher_matches(m, "anything"))
+    test_fail(env, "matcher_matches: \"*\" should match everything");
+  matcher_free(m);
+
+  if (matcher_split(",,", ","))
+    test_fail(env, "matcher_split: expected no matcher for an empty list");
+}
+
+TEST(fit_keeps_contents) {
+  bbuf *buf = bbuf_alloc(16, 4096);
+  bbuf_puts(buf, "0123456789");
+  bbuf_fit(buf, 2);  // never below the contents
+  bbuf_puts(buf, "abc");
+  bbuf_fit(buf, 100000);  // capped at the maximum
+  bbuf_puts(buf, "def");
+  expect_buf(env, buf, "0123456789abcdef");
+  bbuf_fit(buf, 0);
+  for (int i = 0; i < 100; i++)
+    bbuf_putc(buf, 'x');
+  if (bbuf_len(buf) != 100)
+    test_fail(env, "got %zu bytes after shrinking, want 100", bbuf_len(buf));
+  bbuf_free(buf);
+}
+
+TEST(arena_alignment) {
+  // odd sizes, across several blocks and a reset
+  arena *a = arena_alloc(64);
+  for (int round = 0; round < 2; round++) {
+    for (size_t size = 1; size < 300; size += 7) {
+      uintptr_t p = (uintptr_t) arena_get(a, size);
+      if (p % _Alignof(max_align_t) != 0) {
+        arena_free(a);
+        test_fail(env, "arena_get(%zu) returned misaligned %#jx", size, (uintmax_t) p);
+      }
+    }
+    arena_reset(a);
+  }
+  arena_free(a);
+}
+
+TEST(arena_read_file) {
+  char big[10000];
+  for (size_t i = 0; i < sizeof big - 1; i++)
+    big[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  big[sizeof big - 1] = '\0';
+  test_write_file(env, "small", "first\nsecond\n\nlast");
+  test_write_file(env, "big", big);
+
+  arena *a = arena_alloc(16);
+  for (int round = 0; round < 2; round++) {
+    arena_reset(a);
+
+    size_t len;
+    char *small = arena_read_file(a, "small", &len);
+    if (!small || len != 18)
+      test_fail(env, "small file: got %zu bytes", small ? len : 0);
+    char *data = arena_read_file(a, "big", &len);
+    if (!data || len != sizeof big - 1 || strcmp(data, big) != 0)
+      test_fail(env, "big file: got %zu bytes, want %zu", data ? len : 0, sizeof big - 1);
+    if (line_count(data) != (sizeof big - 1 + 63) / 64)
+      test_fail(env, "big file: got %zu lines", line_count(data));
+    if (arena_read_file(a, "missing", 0))
+      test_fail(env, "missing file read");
+
+    static const char *want[] = { "first", "second", "", "last" };
+    if (line_count(small) != 4)
+      test_fail(env, "small file: got %zu lines, want 4", line_count(small));
+    char *pos = small, *line;
+    for (size_t i = 0; i < 4; i++)
+      if (!(line = next_line(&pos)) || strcmp(line, want[i]) != 0)
+        test_fail(env, "line %zu: got %s, want %s", i, line ? line : "(null)", want[i]);
+    if (next_line(&pos))
+      test_fail(env, "extra line after last");
+  }
+  arena_free(a);
+}
+
+TEST(arena_read_dir) {
+  char path[32];
+  for (int i = 0; i < 200; i++) {
+    snprintf(path, sizeof path, "dir/file%03d", i);
+    test_write_file(env, path, "");
+  }
+
+  arena *a = arena_alloc(16);
+  char **names = arena_read_dir(a, "dir");
+  if (!names)
+    test_fail(env, "dir not read");
+  bool seen[200] = { false };
+  size_t n = 0;
+  for (; names[n]; n++) {
+    int i;
+    if (sscanf(names[n], "file%03d", &i) != 1 || i < 0 || i >= 200 || seen[i])
+      test_fail(env, "unexpected entry: %s", names[n]);
+    seen[i] = true;
+  }
+  if (n != 200)
+    test_fail(env, "got %zu entries, want 200", n);
+  if (arena_read_dir(a, "missing"))
+    test_fail(env, "missing dir read");
+  arena_free(a);
+}
+
+TEST(pfile_reread) {
+  pfile *f = pfile_open("file");
+  arena *a = arena_alloc(64);
+  if (pfile_read(f, a, 0))
+    test_fail(env, "read missing file");
+
+  static const char *contents[] = { "first contents\n", "second, longer contents\n", "third\n" };
+  for (size_t i = 0; i < sizeof contents / sizeof *contents; i++) {
+    test_write_file(env, "file", contents[i]);
+    arena_reset(a);
+    size_t len;
+    char *got = pfile_read(f, a, &len);
+    if (!got || len != strlen(contents[i]) || strcmp(got, contents[i]) != 0)
+      test_fail(env, "read %zu: got %s, want %s", i, got ? got : "(null)", contents[i]);
+  }
+
+  arena_free(a);
+  pfile_free(f);
+}
+
+TEST_SUITE {
+  TEST_SUITE_START;
+  RUN_TEST(put_integers);
+  RUN_TEST(put_integer_overflow);
+  RUN_TEST(put_label);
+  RUN_TEST(put_escaped);
+  RUN_TEST(escape_positions);
+  RUN_TEST(put_double_special);
+  RUN_TEST(put_double_integers);
+  RUN_TEST(put_double_decimals);
+  RUN_TEST(put_double_random_bits);
+  RUN_TEST(parse_u64_edge_cases);
+  RUN_TEST(parse_u64_random);
+  RUN_TEST(split_fields);
+  RUN_TEST(matcher);
+  RUN_TEST(fit_keeps_contents);
+  RUN_TEST(arena_alignment);
+  RUN_TEST(arena_read_file);
+  RUN_TEST(arena_read_dir);
+  RUN_TEST(pfile_reread);
+  TEST_SUITE_END;
+}
@@ -14,11 +14,14 @@
  * limitations under the License.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
-#include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "scrape.h"
 #include "util.h"
@@ -53,34 +56,31 @@ void *textfile_init(int argc, char *argv[]) {
 void textfile_collect(scrape_req *req, void *ctx) {
   const char *dir = ctx;
 
-  DIR *d = opendir(dir);
-  if (!d)
+  char **names = arena_read_dir(scrape_arena(req), dir);
+  if (!names)
     return;
 
-  struct dirent *dent;
   char buf[4096];
 
-  while ((dent = readdir(d))) {
-    size_t name_len = strlen(dent->d_name);
-    if (name_len < 6 || strcmp(dent->d_name + name_len - 5, ".prom") != 0)
+  for (char **name = names; *name; name++) {
+    size_t name_len = strlen(*name);
+    if (name_len < 6 || strcmp(*name + name_len - 5, ".prom") != 0)
       continue;
 
-    snprintf(buf, sizeof buf, "%s/%s", dir, dent->d_name);
-    FILE *f = fopen(buf, "r");
-    if (!f)
+    snprintf(buf, sizeof buf, "%s/%s", dir, *name);
+    int fd = open(buf, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
       continue;
 
     bool has_newline = true;
-    size_t len;
-    while ((len = fread(buf, 1, sizeof buf, f)) > 0) {
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof buf)) > 0) {
       scrape_write_raw(req, buf, len);
       has_newline = buf[len - 1] == '\n';
     }
     if (!has_newline)
       scrape_write_raw(req, (char[]){'\n'}, 1);
 
-    fclose(f);
+    close(fd);
   }
-
-  closedir(d);
 }
@@ -39,6 +39,9 @@ enum {
   max_label,
 };
 
+static const struct metric_meta uname_info_meta = METRIC_META(
+    "node_uname_info", "gauge", "Labeled system information as provided by the uname system call.");
+
 struct uname_context {
   struct label labels[max_label + 1];
 };
@@ -73,7 +76,8 @@ static void *uname_init(int argc, char *argv[]) {
 
 static void uname_collect(scrape_req *req, void *ctx_ptr) {
   struct uname_context *ctx = ctx_ptr;
-  scrape_write(req, "node_uname_info", ctx->labels, 1.0);
+  scrape_write_meta(req, &uname_info_meta);
+  scrape_write(req, uname_info_meta.name, ctx->labels, 1.0);
 }
 
 #ifdef NANO_EXPORTER_TEST
@@ -15,14 +15,23 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+// for syscall
+#define _DEFAULT_SOURCE
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "util.h"
 
@@ -73,6 +82,20 @@ size_t bbuf_len(bbuf *buf) {
   return buf->len;
 }
 
+void bbuf_fit(bbuf *buf, size_t size) {
+  if (size < buf->len)
+    size = buf->len;
+  if (size > buf->max_size)
+    size = buf->max_size;
+  if (size == 0)
+    size = 1;  // the buffer grows by doubling
+  if (buf->size >= size && buf->size / 2 <= size)
+    return;
+
+  buf->data = must_realloc(buf->data, size);
+  buf->size = size;
+}
+
 void bbuf_put(bbuf *buf, const void *src, size_t len) {
   if (!bbuf_reserve(buf, len))
     return;
@@ -108,6 +131,39 @@ void bbuf_putf(bbuf *buf, const char *fmt, ...) {
   }
 }
 
+void bbuf_put_label(bbuf *buf, const char *key, const char *value) {
+  size_t key_len = strlen(key), value_len = strlen(value);
+  size_t escapes = label_escape_count(value, value_len);
+  if (!bbuf_reserve(buf, key_len + value_len + escapes + 3))
+    return;
+
+  char *p = buf->data + buf->len;
+  memcpy(p, key, key_len);
+  p += key_len;
+  *p++ = '=';
+  *p++ = '"';
+  if (escapes == 0) {
+    memcpy(p, value, value_len);
+    p += value_len;
+  } else {
+    p = label_escape(p, value, value_len);
+  }
+  *p++ = '"';
+  buf->len = p - buf->data;
+}
+
+void bbuf_put_escaped(bbuf *buf, const char *str) {
+  size_t len = strlen(str);
+  size_t escapes = label_escape_count(str, len);
+  if (escapes == 0) {
+    bbuf_put(buf, str, len);
+    return;
+  }
+  if (!bbuf_reserve(buf, len + escapes))
+    return;
+  buf->len = label_escape(buf->data + buf->len, str, len) - buf->data;
+}
+
 char *bbuf_get(struct bbuf *buf, size_t *len) {
   *len = buf->len;
   return buf->data;
@@ -123,6 +179,569 @@ int bbuf_cmp(bbuf *buf, const char *other) {
     return +1;
 }
 
+// number formatting
+
+// Sample values are formatted exactly as by printf's "%.16g", but without going through the
+// general-purpose printf machinery: whole numbers (the bulk of all values) have their digits
+// written directly, and most other values are scaled to a 16-digit integer with exact 128-bit
+// arithmetic, and correctly rounded (to nearest, ties to even) just like printf does. Values
+// outside the range of the power of five table fall back to snprintf.
+
+#define DOUBLE_LEN_MAX 32
+
+#if defined(__SIZEOF_INT128__)
+#define HAVE_UINT128 1
+__extension__ typedef unsigned __int128 uint128;
+#endif
+
+static const char digit_pairs[200] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const uint64_t pow10_u64[20] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+  1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+  100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+  1000000000000000000ull, 10000000000000000000ull,
+};
+
+/**
+ * Writes the decimal digits of \p v (less than 10^8) ending just before \p end, returning the first
+ * one. If \p pad is set, leading zeros are added to always write eight digits.
+ */
+static char *format_u32(char *end, uint32_t v, bool pad) {
+  char *start = end - 8;
+  while (v >= 100) {
+    // v / 100 as a multiplication, since the build may optimize for size and use a divide instead
+    uint32_t q = (uint32_t) (((uint64_t) v * 1374389535u) >> 37);
+    unsigned d = (v - q * 100) * 2;
+    v = q;
+    *--end = digit_pairs[d + 1];
+    *--end = digit_pairs[d];
+  }
+  if (v >= 10) {
+    *--end = digit_pairs[v * 2 + 1];
+    *--end = digit_pairs[v * 2];
+  } else {
+    *--end = '0' + v;
+  }
+  while (pad && end > start)
+    *--end = '0';
+  return end;
+}
+
+/** Writes the decimal digits of \p v ending just before \p end, returning the first one. */
+static char *format_u64(char *end, uint64_t v) {
+  while (v >= 100000000) {
+    uint64_t q = v / 100000000;
+    end = format_u32(end, (uint32_t) (v - q * 100000000), true);
+    v = q;
+  }
+  return format_u32(end, (uint32_t) v, false);
+}
+
+/** Returns the number of decimal digits in \p v. */
+static unsigned count_digits(uint64_t v) {
+  unsigned n = 1;
+  while (n < 20 && v >= pow10_u64[n])
+    n++;
+  return n;
+}
+
+#ifdef HAVE_UINT128
+
+#define POW5_MAX 27
+
+static const uint64_t pow5_u64[POW5_MAX + 1] = {
+  1ull, 5ull, 25ull, 125ull, 625ull, 3125ull, 15625ull, 78125ull, 390625ull, 1953125ull,
+  9765625ull, 48828125ull, 244140625ull, 1220703125ull, 6103515625ull, 30517578125ull,
+  152587890625ull, 762939453125ull, 3814697265625ull, 19073486328125ull, 95367431640625ull,
+  476837158203125ull, 2384185791015625ull, 11920928955078125ull, 59604644775390625ull,
+  298023223876953125ull, 1490116119384765625ull, 7450580596923828125ull,
+};
+
+/**
+ * Computes `m * 2^q * 10^p` rounded to the nearest integer (ties to even) into \p out.
+ *
+ * Returns `false` if the computation doesn't fit in 128 bits, or the result in 64 bits.
+ */
+static bool scale_round(uint64_t m, int q, int p, uint64_t *out) {
+  int s = q + p;
+  uint128 a, quot;
+  bool up;
+
+  if (p >= 0) {
+    if (p > POW5_MAX)
+      return false;
+    a = (uint128) m * pow5_u64[p];
+    if (s >= 0) {
+      if (s >= 64 || a >> (64 - s) != 0)
+        return false;
+      *out = (uint64_t) (a << s);
+      return true;
+    }
+    if (s <= -128)
+      return false;
+    quot = a >> -s;
+    uint128 rem = a - (quot << -s), half = (uint128) 1 << (-s - 1);
+    up = rem > half || (rem == half && (quot & 1));
+  } else {
+    if (-p > POW5_MAX || s < 0 || s > 74)
+      return false;
+    a = (uint128) m << s;
+    uint64_t d = pow5_u64[-p];
+    quot = a / d;
+    uint64_t rem = (uint64_t) (a - quot * d);
+    up = rem > d - rem || (rem == d - rem && (quot & 1));
+  }
+
+  if (quot >> 63 != 0)
+    return false;
+  *out = (uint64_t) quot + up;
+  return true;
+}
+
+#endif // HAVE_UINT128
+
+/** Formats \p value like "%.16g" into \p out, which must have room for DOUBLE_LEN_MAX bytes. */
+static size_t format_double(char *out, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  unsigned biased_exp = (bits >> 52) & 0x7ff;
+  uint64_t frac = bits & ((UINT64_C(1) << 52) - 1);
+  char *p = out;
+
+  if (biased_exp == 0x7ff)
+    goto fallback;  // infinity or NaN
+  if (bits >> 63)
+    *p++ = '-';
+  if (biased_exp == 0 && frac == 0) {
+    *p++ = '0';
+    return p - out;
+  }
+
+  double mag = value < 0 ? -value : value;
+  if (mag < 1e16 && mag == (double) (uint64_t) mag) {
+    char digits[24], *end = digits + sizeof digits;
+    char *start = format_u64(end, (uint64_t) mag);
+    memcpy(p, start, end - start);
+    return p + (end - start) - out;
+  }
+
+#ifdef HAVE_UINT128
+  if (biased_exp == 0)
+    goto fallback;  // subnormal
+  uint64_t m = frac | (UINT64_C(1) << 52);
+  int q = (int) biased_exp - 1075;
+
+  // estimate the decimal exponent from the binary one (log10(2) ~ 1233 / 4096), then correct it
+  int k = (int) biased_exp - 1023;
+  int e = k >= 0 ? k * 1233 / 4096 : -((-k * 1233 + 4095) / 4096);
+  uint64_t n;
+  while (true) {
+    if (!scale_round(m, q, 15 - e, &n))
+      goto fallback;
+    if (n >= pow10_u64[16])
+      e++;
+    else if (n < pow10_u64[15])
+      e--;
+    else
+      break;
+  }
+
+  char digits[16];
+  format_u64(digits + 16, n);
+  int ndigits = 16;
+  while (digits[ndigits - 1] == '0')
+    ndigits--;
+
+  if (e >= 16 || e < -4) {
+    // exponential notation
+    *p++ = digits[0];
+    if (ndigits > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, ndigits - 1);
+      p += ndigits - 1;
+    }
+    *p++ = 'e';
+    *p++ = e < 0 ? '-' : '+';
+    unsigned exp = e < 0 ? -e : e;
+    if (exp < 10)
+      *p++ = '0';
+    char exp_digits[4], *exp_end = exp_digits + sizeof exp_digits;
+    char *exp_start = format_u64(exp_end, exp);
+    memcpy(p, exp_start, exp_end - exp_start);
+    p += exp_end - exp_start;
+  } else if (e >= 0) {
+    memcpy(p, digits, e + 1);
+    p += e + 1;
+    if (ndigits > e + 1) {
+      *p++ = '.';
+      memcpy(p, digits + e + 1, ndigits - (e + 1));
+      p += ndigits - (e + 1);
+    }
+  } else {
+    *p++ = '0';
+    *p++ = '.';
+    for (int z = -1; z > e; z--)
+      *p++ = '0';
+    memcpy(p, digits, ndigits);
+    p += ndigits;
+  }
+  return p - out;
+#endif // HAVE_UINT128
+
+ fallback:
+  return snprintf(out, DOUBLE_LEN_MAX, "%.16g", value);
+}
+
+void bbuf_put_u64(bbuf *buf, uint64_t value) {
+  unsigned len = count_digits(value);
+  if (!bbuf_reserve(buf, len))
+    return;
+  format_u64(buf->data + buf->len + len, value);
+  buf->len += len;
+}
+
+void bbuf_put_i64(bbuf *buf, int64_t value) {
+  uint64_t mag = value < 0 ? -(uint64_t) value : (uint64_t) value;
+  unsigned len = count_digits(mag) + (value < 0);
+  if (!bbuf_reserve(buf, len))
+    return;
+  if (value < 0)
+    buf->data[buf->len] = '-';
+  format_u64(buf->data + buf->len + len, mag);
+  buf->len += len;
+}
+
+void bbuf_put_double(bbuf *buf, double value) {
+  if (bbuf_reserve(buf, DOUBLE_LEN_MAX)) {
+    buf->len += format_double(buf->data + buf->len, value);
+  } else {
+    char tmp[DOUBLE_LEN_MAX];
+    bbuf_put(buf, tmp, format_double(tmp, value));
+  }
+}
+
+// label value escaping
+
+#define BYTES_01 UINT64_C(0x0101010101010101)
+#define BYTES_80 UINT64_C(0x8080808080808080)
+
+/** Returns nonzero if any byte of \p w is zero. */
+static inline uint64_t has_zero_byte(uint64_t w) {
+  return (w - BYTES_01) & ~w & BYTES_80;
+}
+
+/** Returns nonzero if any byte of \p w is a backslash, double quote or newline. */
+static inline uint64_t has_special_byte(uint64_t w) {
+  return has_zero_byte(w ^ ('\\' * BYTES_01))
+      | has_zero_byte(w ^ ('"' * BYTES_01))
+      | has_zero_byte(w ^ ('\n' * BYTES_01));
+}
+
+static inline bool is_special(char c) {
+  return c == '\\' || c == '"' || c == '\n';
+}
+
+size_t label_escape_count(const char *str, size_t len) {
+  size_t count = 0, i = 0;
+
+  // clean strings are scanned a word at a time; only words with special bytes are looked into
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, str + i, sizeof w);
+    if (has_special_byte(w))
+      for (unsigned b = 0; b < 8; b++)
+        count += is_special(str[i + b]);
+  }
+  for (; i < len; i++)
+    count += is_special(str[i]);
+
+  return count;
+}
+
+char *label_escape(char *dst, const char *src, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    switch (src[i]) {
+      case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+      case '"': *dst++ = '\\'; *dst++ = '"'; break;
+      case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+      default: *dst++ = src[i]; break;
+    }
+  }
+  return dst;
+}
+
+// memory arenas
+
+// alignment of all arena allocations: that of malloc, which the blocks come from
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_block {
+  struct arena_block *prev;
+  size_t size;
+  _Alignas(ARENA_ALIGN) char data[];
+};
+
+struct arena {
+  // current block, and the amount of it in use
+  struct arena_block *block;
+  size_t used;
+  // total size of all the blocks
+  size_t total;
+};
+
+static struct arena_block *arena_block_alloc(size_t size, struct arena_block *prev) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  struct arena_block *block = must_malloc(sizeof *block + size);
+  block->prev = prev;
+  block->size = size;
+  return block;
+}
+
+arena *arena_alloc(size_t size) {
+  arena *a = must_malloc(sizeof *a);
+  a->block = arena_block_alloc(size, 0);
+  a->used = 0;
+  a->total = a->block->size;
+  return a;
+}
+
+void arena_free(arena *a) {
+  struct arena_block *block = a->block;
+  while (block) {
+    struct arena_block *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+  free(a);
+}
+
+void arena_reset(arena *a) {
+  if (a->block->prev) {
+    struct arena_block *block = a->block;
+    while (block) {
+      struct arena_block *prev = block->prev;
+      free(block);
+      block = prev;
+    }
+    a->block = arena_block_alloc(a->total, 0);
+  }
+  a->used = 0;
+}
+
+/** Starts a new block in \p a with room for at least \p size bytes. */
+static void arena_grow(arena *a, size_t size) {
+  size_t new_size = 2 * a->block->size;
+  if (new_size < size)
+    new_size = size;
+  a->block = arena_block_alloc(new_size, a->block);
+  a->used = 0;
+  a->total += a->block->size;
+}
+
+void *arena_get(arena *a, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (size > a->block->size - a->used)
+    arena_grow(a, size);
+  void *p = a->block->data + a->used;
+  a->used += size;
+  return p;
+}
+
+/**
+ * Reads the rest of the open file \p fd into memory from \p a.
+ *
+ * If \p positional is set, the file is read from the start with `pread`, leaving the file offset
+ * alone. Returns a null pointer if reading fails, in which case no memory is claimed.
+ */
+static char *arena_read_fd(arena *a, int fd, bool positional, size_t *len) {
+  // the contents are read into all the free space of the current block, which is only claimed
+  // (rounded to the alignment) once the size is known
+  char *buf = a->block->data + a->used;
+  size_t size = a->block->size - a->used, got = 0;
+  while (true) {
+    if (size - got < 2) {
+      arena_grow(a, 2 * size > 256 ? 2 * size : 256);
+      memcpy(a->block->data, buf, got);
+      buf = a->block->data;
+      size = a->block->size;
+    }
+    ssize_t ret = positional
+        ? pread(fd, buf + got, size - got - 1, got)
+        : read(fd, buf + got, size - got - 1);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1)
+      return 0;
+    if (ret == 0)
+      break;
+    got += ret;
+  }
+
+  buf[got] = '\0';
+  a->used += (got + ARENA_ALIGN) & ~(size_t) (ARENA_ALIGN - 1);
+  if (len)
+    *len = got;
+  return buf;
+}
+
+char *arena_read_file(arena *a, const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  char *data = arena_read_fd(a, fd, false, len);
+  close(fd);
+  return data;
+}
+
+// directory entry names are collected in a list, and the array of pointers built at the end
+struct arena_name {
+  struct arena_name *next;
+  char name[];
+};
+
+/** Appends the name \p name to the list ending in \p *tail. */
+static void arena_name_add(arena *a, struct arena_name ***tail, const char *name) {
+  size_t len = strlen(name) + 1;
+  struct arena_name *n = arena_get(a, sizeof *n + len);
+  n->next = 0;
+  memcpy(n->name, name, len);
+  **tail = n;
+  *tail = &n->next;
+}
+
+/** Returns a null-terminated array of the \p count names in the list \p names. */
+static char **arena_names(arena *a, struct arena_name *names, size_t count) {
+  char **array = arena_get(a, (count + 1) * sizeof *array);
+  for (size_t i = 0; i < count; i++, names = names->next)
+    array[i] = names->name;
+  array[count] = 0;
+  return array;
+}
+
+#ifdef __linux__
+
+// Directories are listed with getdents64(2) directly: opendir(3) would allocate its buffer from
+// the heap every time.
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+char **arena_read_dir(arena *a, const char *path) {
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+
+  _Alignas(struct linux_dirent64) char buf[2048];
+  struct arena_name *names = 0, **tail = &names;
+  size_t count = 0;
+  while (true) {
+    long ret = syscall(SYS_getdents64, fd, buf, sizeof buf);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1) {
+      close(fd);
+      return 0;
+    }
+    if (ret == 0)
+      break;
+    for (long pos = 0; pos < ret; ) {
+      struct linux_dirent64 *dent = (struct linux_dirent64 *) (buf + pos);
+      pos += dent->d_reclen;
+      if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+        continue;
+      arena_name_add(a, &tail, dent->d_name);
+      count++;
+    }
+  }
+  close(fd);
+
+  return arena_names(a, names, count);
+}
+
+#else // __linux__
+
+char **arena_read_dir(arena *a, const char *path) {
+  DIR *dir = opendir(path);
+  if (!dir)
+    return 0;
+
+  struct arena_name *names = 0, **tail = &names;
+  size_t count = 0;
+  struct dirent *dent;
+  while ((dent = readdir(dir))) {
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+    arena_name_add(a, &tail, dent->d_name);
+    count++;
+  }
+  closedir(dir);
+
+  return arena_names(a, names, count);
+}
+
+#endif // __linux__
+
+char **arena_split_lines(arena *a, char *str) {
+  char **lines = arena_get(a, (line_count(str) + 1) * sizeof *lines);
+  size_t n = 0;
+  for (char *pos = str, *line; (line = next_line(&pos)); )
+    lines[n++] = line;
+  lines[n] = 0;
+  return lines;
+}
+
+// persistent files
+
+struct pfile {
+  int fd;
+  char path[];
+};
+
+pfile *pfile_open(const char *path) {
+  size_t path_len = strlen(path) + 1;
+  pfile *f = must_malloc(sizeof *f + path_len);
+  memcpy(f->path, path, path_len);
+  f->fd = open(path, O_RDONLY | O_CLOEXEC);
+  return f;
+}
+
+void pfile_free(pfile *f) {
+  if (f->fd != -1)
+    close(f->fd);
+  free(f);
+}
+
+const char *pfile_path(pfile *f) {
+  return f->path;
+}
+
+char *pfile_read(pfile *f, arena *a, size_t *len) {
+  // a read error may mean the file went stale, so it's reopened once before giving up
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (f->fd == -1)
+      f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (f->fd == -1)
+      return 0;
+    char *data = arena_read_fd(a, f->fd, true, len);
+    if (data)
+      return data;
+    close(f->fd);
+    f->fd = -1;
+  }
+  return 0;
+}
+
 // string lists
 
 struct slist *slist_split(const char *str, const char *delim) {
@@ -173,20 +792,106 @@ bool slist_contains(const struct slist *list, const char *key) {
   return false;
 }
 
-bool slist_matches(const struct slist *list, const char *key) {
-  size_t key_len = strlen(key);
+// name matchers
+
+/** Trie node for one byte of the patterns. Node 0 is the root, so 0 also stands for no node. */
+struct matcher_node {
+  uint32_t child;
+  uint32_t sibling;
+  unsigned char c;
+  // a pattern ends here: the key must end too (exact), or can have any tail (prefix)
+  bool exact;
+  bool prefix;
+};
 
-  for (; list; list = list->next) {
-    size_t match_len = strlen(list->data);
-    if (match_len > 0 && list->data[match_len-1] == '*') {
-      if (match_len-1 <= key_len && memcmp(list->data, key, match_len-1) == 0)
-        return true;
-    } else {
-      if (match_len == key_len && memcmp(list->data, key, key_len) == 0)
-        return true;
+struct matcher {
+  struct matcher_node *nodes;
+  size_t len;
+  size_t size;
+};
+
+static void matcher_add(matcher *m, const char *pattern, size_t len) {
+  bool prefix = len > 0 && pattern[len-1] == '*';
+  if (prefix)
+    len--;
+
+  uint32_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = pattern[i];
+    uint32_t child = m->nodes[n].child;
+    while (child && m->nodes[child].c != c)
+      child = m->nodes[child].sibling;
+
+    if (!child) {
+      if (m->len == m->size) {
+        m->size *= 2;
+        m->nodes = must_realloc(m->nodes, m->size * sizeof *m->nodes);
+      }
+      child = m->len++;
+      m->nodes[child] = (struct matcher_node){
+        .child = 0, .sibling = m->nodes[n].child, .c = c, .exact = false, .prefix = false };
+      m->nodes[n].child = child;
     }
+    n = child;
+  }
+
+  if (prefix)
+    m->nodes[n].prefix = true;
+  else
+    m->nodes[n].exact = true;
+}
+
+matcher *matcher_split(const char *str, const char *delim) {
+  matcher *m = 0;
+
+  while (*str) {
+    size_t span = strcspn(str, delim);
+    if (span == 0) {
+      str++;
+      continue;
+    }
+
+    if (!m) {
+      m = must_malloc(sizeof *m);
+      m->size = 16;
+      m->nodes = must_malloc(m->size * sizeof *m->nodes);
+      m->nodes[0] = (struct matcher_node){ .child = 0, .sibling = 0, .exact = false, .prefix = false };
+      m->len = 1;
+    }
+    matcher_add(m, str, span);
+
+    str += span;
+    while (*str && strchr(delim, *str))
+      str++;
+  }
+
+  return m;
+}
+
+bool matcher_matches(const matcher *m, const char *key) {
+  const struct matcher_node *nodes = m->nodes;
+  const struct matcher_node *n = &nodes[0];
+
+  for (const unsigned char *p = (const unsigned char *) key; ; p++) {
+    if (n->prefix)
+      return true;
+    if (*p == '\0')
+      return n->exact;
+
+    uint32_t child = n->child;
+    while (child && nodes[child].c != *p)
+      child = nodes[child].sibling;
+    if (!child)
+      return false;
+    n = &nodes[child];
+  }
+}
+
+void matcher_free(matcher *m) {
+  if (m) {
+    free(m->nodes);
+    free(m);
   }
-  return false;
 }
 
 // miscellaneous utilities
@@ -218,19 +923,81 @@ char *must_strdup(const char *src) {
   return dst;
 }
 
-char *fgets_line(char *s, int size, FILE *stream) {
-  s[size - 1] = '\0';
-  char *got = fgets(s, size, stream);
-  if (!got)
+char *next_line(char **pos) {
+  char *line = *pos;
+  if (*line == '\0')
     return 0;
-  if (s[size - 1] == '\0' || s[size - 1] == '\n')
-    return got;
+  char *end = strchr(line, '\n');
+  if (end) {
+    *end = '\0';
+    *pos = end + 1;
+  } else {
+    *pos = line + strlen(line);
+  }
+  return line;
+}
 
-  int c;
-  while ((c = fgetc(stream)) != EOF)
-    if (c == '\n')
-      return got;
-  return 0;
+size_t line_count(const char *str) {
+  size_t count = 0;
+  for (const char *p = str; (p = strchr(p, '\n')); p++)
+    count++;
+  size_t len = strlen(str);
+  if (len > 0 && str[len - 1] != '\n')
+    count++;  // last line without a newline
+  return count;
+}
+
+size_t split_fields(char *str, char *fields[], size_t max) {
+  size_t n = 0;
+  char *p = str;
+  while (n < max) {
+    while (*p == ' ')
+      p++;
+    if (*p == '\0')
+      break;
+    fields[n++] = p;
+    while (*p != ' ' && *p != '\0')
+      p++;
+    if (*p == '\0')
+      break;
+    *p++ = '\0';
+  }
+  return n;
+}
+
+char *parse_u64(const char *s, uint64_t *value) {
+  while (s[0] == '0' && (unsigned) (s[1] - '0') < 10)
+    s++;
+
+  // the first 19 digits can't overflow, so only the 20th needs checking
+  const char *p = s;
+  uint64_t v = 0;
+  unsigned d;
+  while ((d = (unsigned) (*p - '0')) < 10 && p - s < 19) {
+    v = 10 * v + d;
+    p++;
+  }
+  if (p == s)
+    return 0;
+  if (d < 10) {
+    if (v > (UINT64_MAX - d) / 10 || (unsigned) (p[1] - '0') < 10)
+      return 0;
+    v = 10 * v + d;
+    p++;
+  }
+
+  *value = v;
+  return (char *) p;
+}
+
+char *parse_i64(const char *s, int64_t *value) {
+  bool negative = *s == '-';
+  uint64_t v;
+  char *end = parse_u64(negative ? s + 1 : s, &v);
+  if (!end || v > (uint64_t) INT64_MAX + negative)
+    return 0;
+  *value = negative ? (int64_t) (0 - v) : (int64_t) v;
+  return end;
 }
 
 int write_all(int fd, const void *buf_ptr, size_t len) {
@@ -19,6 +19,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 // character buffers
@@ -34,6 +35,13 @@ void bbuf_free(bbuf *buf);
 void bbuf_reset(bbuf *buf);
 /** Returns the current length of the buffer contents. */
 size_t bbuf_len(bbuf *buf);
+/**
+ * Resizes the storage of \p buf ahead of use, to hold \p size bytes in total.
+ *
+ * The buffer is grown if it is smaller, and shrunk if it is more than twice as large, so that
+ * small fluctuations do not cause reallocations. It is never shrunk below its current contents.
+ */
+void bbuf_fit(bbuf *buf, size_t size);
 /** Appends \p len bytes from address \p src to the buffer \p buf. */
 void bbuf_put(bbuf *buf, const void *src, size_t len);
 /** Appends the null-terminated string at \p src to the buffer \p buf. */
@@ -42,6 +50,24 @@ void bbuf_puts(bbuf *buf, const char *src);
 void bbuf_putc(bbuf *buf, int c);
 /** Appends a formatted string to \p buf. */
 void bbuf_putf(bbuf *buf, const char *fmt, ...);
+
+// The typed appenders below reserve room for their entire output once, and write it in place. As
+// with bbuf_put, nothing is appended if the buffer would grow past its maximum size.
+
+/** Appends the decimal representation of \p value to \p buf. */
+void bbuf_put_u64(bbuf *buf, uint64_t value);
+/** Appends the decimal representation of \p value to \p buf. */
+void bbuf_put_i64(bbuf *buf, int64_t value);
+/** Appends \p value to \p buf, formatted exactly like `printf("%.16g")` would, but faster. */
+void bbuf_put_double(bbuf *buf, double value);
+/** Appends a label pair `key="value"` to \p buf, with the value escaped as in bbuf_put_escaped. */
+void bbuf_put_label(bbuf *buf, const char *key, const char *value);
+/**
+ * Appends the string \p str to \p buf, escaped as in a label value of the Prometheus text format:
+ * backslash, double quote and newline become `\\`, `\"` and `\n`.
+ */
+void bbuf_put_escaped(bbuf *buf, const char *str);
+
 /**
  * Returns the contents of \p buf, writing the length to \p len.
  *
@@ -52,6 +78,87 @@ char *bbuf_get(struct bbuf *buf, size_t *len);
 /** Compares the contents of \p buf to the string in \p other, in shortlex order. */
 int bbuf_cmp(bbuf *buf, const char *other);
 
+// label value escaping
+
+/**
+ * Returns the number of bytes among the first \p len of \p str that need escaping in a label value
+ * of the Prometheus text format. The escaped form is longer by exactly that many bytes.
+ */
+size_t label_escape_count(const char *str, size_t len);
+/**
+ * Writes the \p len bytes at \p src to \p dst, escaped as in bbuf_put_escaped. Returns the end of
+ * the output.
+ */
+char *label_escape(char *dst, const char *src, size_t len);
+
+// memory arenas
+
+/**
+ * Opaque type for a bump allocator, whose allocations are all released at once.
+ *
+ * Memory is taken from a single block, with more blocks chained as needed. When the arena is
+ * reset, any extra blocks are merged into one large enough to hold everything allocated since the
+ * previous reset, so a repeated sequence of allocations of the same size never touches the heap
+ * after the first time.
+ */
+typedef struct arena arena;
+
+/** Allocates a new arena, with an initial block of \p size bytes. */
+arena *arena_alloc(size_t size);
+/** Frees all the storage associated with \p a. */
+void arena_free(arena *a);
+/** Releases all the memory allocated from \p a, to be reused for later allocations. */
+void arena_reset(arena *a);
+/** Returns \p size bytes of memory from \p a, suitably aligned for any type. */
+void *arena_get(arena *a, size_t size);
+/**
+ * Reads the entire contents of the file at \p path into memory from \p a.
+ *
+ * The contents are terminated by a '\0' byte, not included in the length written to \p len (if not
+ * null). Returns a null pointer if the file could not be opened or read.
+ */
+char *arena_read_file(arena *a, const char *path, size_t *len);
+/**
+ * Lists the directory at \p path into memory from \p a.
+ *
+ * Returns an array of entry names (except for "." and ".."), terminated by a null pointer, or a
+ * null pointer if the directory could not be opened or read.
+ */
+char **arena_read_dir(arena *a, const char *path);
+/**
+ * Splits the string \p str in place into lines, as with next_line().
+ *
+ * Returns an array of the lines, terminated by a null pointer, allocated from \p a.
+ */
+char **arena_split_lines(arena *a, char *str);
+
+// persistent files
+
+/**
+ * Type for a file kept open to be read again and again, such as the fixed files under /proc.
+ *
+ * The file is read from the start with `pread` each time, which the kernel regenerates for /proc
+ * files, so there is no open and close per read. If reading fails, the file is reopened.
+ */
+typedef struct pfile pfile;
+
+/**
+ * Opens the file at \p path for repeated reading.
+ *
+ * This always succeeds: if the file can't be opened yet, opening it is retried on each read.
+ */
+pfile *pfile_open(const char *path);
+/** Closes and frees the file \p f. */
+void pfile_free(pfile *f);
+/** Returns the path the file \p f was opened with. */
+const char *pfile_path(pfile *f);
+/**
+ * Reads the full contents of \p f into memory from \p a, as for arena_read_file().
+ *
+ * Returns a null pointer if the file can't be opened or read.
+ */
+char *pfile_read(pfile *f, arena *a, size_t *len);
+
 // string lists
 
 /** Type for a singly linked list of strings. */
@@ -82,13 +189,28 @@ struct slist **slist_append(struct slist **prev, const char *str);
 struct slist *slist_prepend(struct slist *list, const char *str);
 /** Returns `true` if \p list contains as element the string \p key. */
 bool slist_contains(const struct slist *list, const char *key);
+
+// name matchers
+
+/** Opaque type for a compiled set of name patterns. */
+typedef struct matcher matcher;
+
 /**
- * Returns `true` if any element of \p list matches \p key.
+ * Compiles the patterns in \p str, separated by \p delim, into a matcher.
  *
- * The strings must match exactly, with the exception that if the list elements ends in the '*'
- * character, any \p key string that starts with the prefix before the '*' will count as matching.
+ * Returns a null pointer if \p str contains no patterns, in the same way as slist_split().
  */
-bool slist_matches(const struct slist *list, const char *key);
+matcher *matcher_split(const char *str, const char *delim);
+/**
+ * Returns `true` if any pattern of \p m matches \p key.
+ *
+ * The strings must match exactly, with the exception that if a pattern ends in the '*' character,
+ * any \p key string that starts with the prefix before the '*' will count as matching. The key is
+ * scanned at most once, no matter how many patterns there are.
+ */
+bool matcher_matches(const matcher *m, const char *key);
+/** Releases the matcher \p m. */
+void matcher_free(matcher *m);
 
 // miscellaneous utilities
 
@@ -102,15 +224,35 @@ void *must_realloc(void *ptr, size_t size);
 char *must_strdup(const char *src);
 
 /**
- * Reads a full line from \p stream into buffer \p s of size \p size.
+ * Returns the next line of the string at \p *pos, and advances \p *pos past it.
+ *
+ * The newline character terminating the line, if any, is replaced by a '\0' byte. Returns a null
+ * pointer if there are no more lines.
+ */
+char *next_line(char **pos);
+
+/** Returns the number of lines in the string \p str, as would be returned by next_line(). */
+size_t line_count(const char *str);
+
+/**
+ * Splits the string \p str in place into fields separated by runs of spaces.
+ *
+ * Pointers to the first (at most) \p max fields are stored in \p fields, and each of them is
+ * terminated by replacing the space after it with a '\0' byte. Returns the number of fields stored.
+ * Any text after the last stored field is left as is.
+ */
+size_t split_fields(char *str, char *fields[], size_t max);
+
+/**
+ * Parses the unsigned decimal integer at the start of \p s into \p *value.
  *
- * This function is otherwise identical to standard `fgets`, except that if a full line did not fit
- * in the input buffer, characters are discarded from the stream up to and including the next
- * newline character. If the file ends before a newline is encountered, a null pointer is
- * required. This way this function always reads complete lines, which are just truncated if they
- * don't fit in the buffer.
+ * Returns a pointer past the last digit, or a null pointer if \p s doesn't start with a digit or the
+ * number doesn't fit in 64 bits. Unlike `strtoull`, no whitespace, sign or base prefix is accepted,
+ * and the locale is not consulted. The caller checks what follows the number.
  */
-char *fgets_line(char *s, int size, FILE *stream);
+char *parse_u64(const char *s, uint64_t *value);
+/** Parses a decimal integer with an optional '-' sign, as for parse_u64(). */
+char *parse_i64(const char *s, int64_t *value);
 
 /**
  * Fully writes the contents of \p buf (\p len bytes) into file descriptor \p fd.